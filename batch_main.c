@@ -0,0 +1,403 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "clib/blake2b_lanes.h"
+#include "clib/mdp_sinks.h"
+#include "clib/molecule-dynamic-visitor.h"
+
+// Renders a corpus of data files sharing one schema on all cores. Text is
+// written to stdout in the order of the files, errors and throughput stats go
+// to stderr. With -H, the blake2b hash of each file's text is written instead.
+
+#define WORKER_ARENA_SIZE (64 * 1024)
+#define WORKER_ADDRESS_CACHE_SIZE 64
+#define WORKER_FRAGMENT_CACHE_SIZE (1024 * 1024)
+#define WORKER_FRAGMENT_SLOT_SIZE 1024
+
+typedef struct {
+  const char *path;
+  size_t data_size;
+  mdp_growable_sink text;
+  // MDP_OK, an error from the visitor, or -1 when the file cannot be read
+  int result;
+  int done;
+} item_t;
+
+// Items not started yet, the owner takes items from the front while other
+// workers steal from the back, so the owner works in output order.
+typedef struct {
+  pthread_mutex_t lock;
+  size_t head;
+  size_t tail;
+} queue_t;
+
+typedef struct batch_t batch_t;
+
+typedef struct {
+  batch_t *batch;
+  size_t index;
+  pthread_t thread;
+  queue_t queue;
+  size_t processed;
+  size_t stolen;
+  mdp_arena arena;
+  void *fragment_memory;
+  // Addresses repeat across files, such as a contract sending to many users
+  mdp_address_cache address_cache;
+  // So do whole outputs and cell deps of transactions built by one wallet
+  mdp_fragment_cache fragment_cache;
+} worker_t;
+
+struct batch_t {
+  item_t *items;
+  size_t item_count;
+  worker_t *workers;
+  size_t worker_count;
+  mdp_context context;
+
+  // Guards done of items
+  pthread_mutex_t lock;
+  pthread_cond_t item_done;
+};
+
+void *read_file(const char *path, size_t *size) {
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) {
+    return NULL;
+  }
+  fseek(fp, 0L, SEEK_END);
+  *size = ftell(fp);
+  fseek(fp, 0L, SEEK_SET);
+  void *data = malloc(*size > 0 ? *size : 1);
+  if (data != NULL && fread(data, 1, *size, fp) != *size) {
+    free(data);
+    data = NULL;
+  }
+  fclose(fp);
+  return data;
+}
+
+int take_front(queue_t *queue, size_t *item) {
+  pthread_mutex_lock(&queue->lock);
+  int taken = queue->head < queue->tail;
+  if (taken) {
+    *item = queue->head++;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return taken;
+}
+
+int take_back(queue_t *queue, size_t *item) {
+  pthread_mutex_lock(&queue->lock);
+  int taken = queue->head < queue->tail;
+  if (taken) {
+    *item = --queue->tail;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return taken;
+}
+
+// Takes the next item of worker, stealing from other workers once its own
+// queue is empty
+int next_item(batch_t *batch, worker_t *worker, size_t *item) {
+  if (take_front(&worker->queue, item)) {
+    return 1;
+  }
+  for (size_t i = 1; i < batch->worker_count; i++) {
+    worker_t *victim =
+        &batch->workers[(worker->index + i) % batch->worker_count];
+    if (take_back(&victim->queue, item)) {
+      worker->stolen++;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void render_item(batch_t *batch, worker_t *worker, item_t *item) {
+  void *data = read_file(item->path, &item->data_size);
+  if (data == NULL) {
+    item->result = -1;
+    return;
+  }
+  // Data sources are per thread, only the prepared schema is shared
+  mol2_data_source_t source;
+  mdp_context context = batch->context;
+  context.data =
+      mdp_cursor_from_memory(&source, data, (uint32_t)item->data_size);
+  context.feeder = mdp_growable_sink_feeder;
+  context.feeder_context = &item->text;
+  context.arena = &worker->arena;
+  context.address_cache = &worker->address_cache;
+  context.fragment_cache = &worker->fragment_cache;
+  item->result = mdp_visit(context);
+  free(data);
+}
+
+// Allocates the memory of a worker before any thread starts, so a failure
+// cannot leave items unrendered
+int worker_allocate(worker_t *worker) {
+  uint8_t *buffer = (uint8_t *)malloc(WORKER_ARENA_SIZE);
+  mdp_address_cache_entry *entries = (mdp_address_cache_entry *)malloc(
+      WORKER_ADDRESS_CACHE_SIZE * sizeof(mdp_address_cache_entry));
+  worker->fragment_memory = malloc(WORKER_FRAGMENT_CACHE_SIZE);
+  mdp_arena_initialize(&worker->arena, buffer, WORKER_ARENA_SIZE);
+  worker->address_cache.entries = entries;
+  if (buffer == NULL || entries == NULL || worker->fragment_memory == NULL) {
+    return 1;
+  }
+  mdp_address_cache_initialize(&worker->address_cache, entries,
+                               WORKER_ADDRESS_CACHE_SIZE);
+  return mdp_fragment_cache_initialize(
+      &worker->fragment_cache, worker->fragment_memory,
+      WORKER_FRAGMENT_CACHE_SIZE, WORKER_FRAGMENT_SLOT_SIZE);
+}
+
+void worker_release(worker_t *worker) {
+  free(worker->fragment_memory);
+  free(worker->address_cache.entries);
+  free(worker->arena.buffer);
+}
+
+void batch_release(batch_t *batch) {
+  for (size_t i = 0; batch->workers != NULL && i < batch->worker_count; i++) {
+    worker_release(&batch->workers[i]);
+  }
+  free(batch->workers);
+  free(batch->items);
+}
+
+void *worker_main(void *argument) {
+  worker_t *worker = (worker_t *)argument;
+  batch_t *batch = worker->batch;
+
+  size_t index;
+  while (next_item(batch, worker, &index)) {
+    item_t *item = &batch->items[index];
+    render_item(batch, worker, item);
+    worker->processed++;
+
+    pthread_mutex_lock(&batch->lock);
+    item->done = 1;
+    pthread_cond_broadcast(&batch->item_done);
+    pthread_mutex_unlock(&batch->lock);
+  }
+  return NULL;
+}
+
+// Hashes the text of up to BLAKE2B_LANES items at once, feeding all lanes in
+// turn so they advance in lockstep. Failed items are skipped.
+void hash_items(blake2b_lanes_state *state, item_t *items, size_t count) {
+  size_t longest = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (items[i].result == MDP_OK && items[i].text.length > longest) {
+      longest = items[i].text.length;
+    }
+  }
+  for (size_t offset = 0; offset < longest; offset += BLAKE2B_LANES_BUFFER) {
+    for (size_t i = 0; i < count; i++) {
+      if (items[i].result != MDP_OK || items[i].text.length <= offset) {
+        continue;
+      }
+      size_t length = items[i].text.length - offset;
+      if (length > BLAKE2B_LANES_BUFFER) {
+        length = BLAKE2B_LANES_BUFFER;
+      }
+      blake2b_lanes_update(state, i, &items[i].text.data[offset], length);
+    }
+  }
+  uint8_t digests[BLAKE2B_LANES * 32];
+  blake2b_lanes_final(state, digests);
+  for (size_t i = 0; i < count; i++) {
+    if (items[i].result != MDP_OK) {
+      continue;
+    }
+    printf("0x");
+    for (int j = 0; j < 32; j++) {
+      printf("%02x", digests[i * 32 + j]);
+    }
+    printf("  %s\n", items[i].path);
+  }
+}
+
+double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+  size_t worker_count = (size_t)sysconf(_SC_NPROCESSORS_ONLN);
+  int format = MDP_FORMAT_TEXT;
+  const char *hrp = "ckb";
+  int hash = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "j:f:p:H")) != -1) {
+    if (opt == 'j') {
+      worker_count = (size_t)atoi(optarg);
+    } else if (opt == 'f' && strcmp(optarg, "text") == 0) {
+      format = MDP_FORMAT_TEXT;
+    } else if (opt == 'f' && strcmp(optarg, "json") == 0) {
+      format = MDP_FORMAT_JSON;
+    } else if (opt == 'f' && strcmp(optarg, "compact") == 0) {
+      format = MDP_FORMAT_COMPACT;
+    } else if (opt == 'p') {
+      hrp = optarg;
+    } else if (opt == 'H') {
+      hash = 1;
+    } else {
+      optind = argc;
+      break;
+    }
+  }
+  if (argc - optind < 2 || worker_count == 0) {
+    printf(
+        "Usage: %s [-j threads] [-f text|json|compact] [-p hrp] [-H] "
+        "<schema file> <data file>...\n",
+        argv[0]);
+    return 1;
+  }
+
+  size_t schema_size = 0;
+  void *schema = read_file(argv[optind], &schema_size);
+  if (schema == NULL) {
+    fprintf(stderr, "Cannot open file %s\n", argv[optind]);
+    return 1;
+  }
+  // The prepared schema is built once, then shared by all workers
+  static uint8_t schema_arena_buffer[64 * 1024];
+  mdp_arena schema_arena;
+  mdp_arena_initialize(&schema_arena, schema_arena_buffer,
+                       sizeof(schema_arena_buffer));
+  mol2_data_source_t schema_source;
+  mdp_schema prepared_schema;
+  int ret = mdp_prepare_schema(
+      &schema_arena,
+      mdp_cursor_from_memory(&schema_source, schema, (uint32_t)schema_size),
+      &prepared_schema);
+  if (ret != MDP_OK) {
+    fprintf(stderr, "Error preparing schema: %d\n", ret);
+    return ret;
+  }
+
+  batch_t batch;
+  memset(&batch, 0, sizeof(batch));
+  batch.item_count = (size_t)(argc - optind - 1);
+  if (worker_count > batch.item_count) {
+    worker_count = batch.item_count;
+  }
+  batch.worker_count = worker_count;
+  batch.items = (item_t *)calloc(batch.item_count, sizeof(item_t));
+  batch.workers = (worker_t *)calloc(worker_count, sizeof(worker_t));
+  int allocated = batch.items != NULL && batch.workers != NULL;
+  for (size_t i = 0; allocated && i < worker_count; i++) {
+    allocated = worker_allocate(&batch.workers[i]) == 0;
+  }
+  if (!allocated) {
+    fprintf(stderr, "Cannot allocate memory for %lu workers\n", worker_count);
+    batch_release(&batch);
+    free(schema);
+    return 1;
+  }
+  for (size_t i = 0; i < batch.item_count; i++) {
+    batch.items[i].path = argv[optind + 1 + i];
+  }
+  mdp_context_initialize(&batch.context);
+  batch.context.hrp = hrp;
+  batch.context.prepared_schema = &prepared_schema;
+  batch.context.format = format;
+  pthread_mutex_init(&batch.lock, NULL);
+  pthread_cond_init(&batch.item_done, NULL);
+
+  // Each worker starts with a contiguous range of items
+  double start = now_seconds();
+  for (size_t i = 0; i < worker_count; i++) {
+    worker_t *worker = &batch.workers[i];
+    worker->index = i;
+    pthread_mutex_init(&worker->queue.lock, NULL);
+    worker->queue.head = batch.item_count * i / worker_count;
+    worker->queue.tail = batch.item_count * (i + 1) / worker_count;
+    worker->batch = &batch;
+  }
+  // Items of workers failing to start are stolen by the others
+  size_t started = 0;
+  for (; started < worker_count; started++) {
+    ret = pthread_create(&batch.workers[started].thread, NULL, worker_main,
+                         &batch.workers[started]);
+    if (ret != 0) {
+      fprintf(stderr, "Cannot start thread %lu: %s\n", started, strerror(ret));
+      break;
+    }
+  }
+  if (started == 0) {
+    batch_release(&batch);
+    free(schema);
+    return 1;
+  }
+
+  // Text is written in order, freeing each item once written. Hashes are
+  // computed once every lane has an item.
+  static blake2b_lanes_state hash_state;
+  blake2b_lanes_init(&hash_state, 32);
+  size_t hashed = 0;
+  size_t data_total = 0;
+  size_t text_total = 0;
+  size_t failed = 0;
+  for (size_t i = 0; i < batch.item_count; i++) {
+    item_t *item = &batch.items[i];
+    pthread_mutex_lock(&batch.lock);
+    while (!item->done) {
+      pthread_cond_wait(&batch.item_done, &batch.lock);
+    }
+    pthread_mutex_unlock(&batch.lock);
+
+    if (item->result == -1) {
+      fprintf(stderr, "Cannot open file %s\n", item->path);
+      failed++;
+    } else if (item->result != MDP_OK) {
+      fprintf(stderr, "Error visiting %s: %d\n", item->path, item->result);
+      failed++;
+    } else if (!hash) {
+      fwrite(item->text.data, 1, item->text.length, stdout);
+    }
+    data_total += item->data_size;
+    text_total += item->text.length;
+    if (!hash) {
+      mdp_growable_sink_release(&item->text);
+    } else if (i + 1 - hashed == BLAKE2B_LANES || i + 1 == batch.item_count) {
+      hash_items(&hash_state, &batch.items[hashed], i + 1 - hashed);
+      for (; hashed <= i; hashed++) {
+        mdp_growable_sink_release(&batch.items[hashed].text);
+      }
+    }
+  }
+  for (size_t i = 0; i < started; i++) {
+    pthread_join(batch.workers[i].thread, NULL);
+  }
+  fflush(stdout);
+  double elapsed = now_seconds() - start;
+
+  fprintf(stderr,
+          "Rendered %lu items (%lu failed) with %lu threads in %.3f s\n",
+          batch.item_count, failed, started, elapsed);
+  fprintf(stderr, "Data: %lu bytes, %.2f MB/s, %.0f items/s\n", data_total,
+          data_total / elapsed / 1e6, batch.item_count / elapsed);
+  fprintf(stderr, "Text: %lu bytes, %.2f MB/s\n", text_total,
+          text_total / elapsed / 1e6);
+  for (size_t i = 0; i < worker_count; i++) {
+    worker_t *worker = &batch.workers[i];
+    fprintf(stderr,
+            "Thread %lu: %lu items, %lu stolen, addresses %lu cached, "
+            "%lu encoded, subtrees %lu cached, %lu visited\n",
+            i, worker->processed, worker->stolen, worker->address_cache.hits,
+            worker->address_cache.misses, worker->fragment_cache.hits,
+            worker->fragment_cache.misses);
+  }
+
+  batch_release(&batch);
+  free(schema);
+  return failed > 0 ? 1 : 0;
+}
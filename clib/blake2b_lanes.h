@@ -0,0 +1,283 @@
+#ifndef MDP_BLAKE2B_LANES_H_
+#define MDP_BLAKE2B_LANES_H_
+
+/*
+ * BLAKE2b (RFC 7693) hashing BLAKE2B_LANES independent messages at once.
+ * The states of all lanes are interleaved word by word, each step of the
+ * compression function works on a vector holding a word of every lane. With
+ * GCC and Clang vector extensions, this compiles to SIMD instructions where
+ * available, such as 4 lanes with AVX2, or 8 lanes with AVX-512. On CKB-VM,
+ * lanes are simply processed one after another.
+ *
+ * Each lane buffers up to BLAKE2B_LANES_BUFFER bytes of its message. Blocks
+ * are only compressed once a lane's buffer fills up, or when all lanes are
+ * finalized together, so lanes advance in lockstep as long as messages are
+ * of similar lengths. Messages up to BLAKE2B_LANES_BUFFER bytes are hashed
+ * entirely in lockstep.
+ *
+ * Only unkeyed hashing with the default parameters is supported, digests
+ * match blake2b_init(&state, outlen) from ckb-c-stdlib. 0 is returned on
+ * success, as with other libraries included here.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+/* Must be a power of 2 */
+#ifndef BLAKE2B_LANES
+#define BLAKE2B_LANES 4
+#endif
+
+#define BLAKE2B_LANES_BLOCK_LEN 128
+#define BLAKE2B_LANES_MAX_OUT_LEN 64
+
+/* Must be a multiple of BLAKE2B_LANES_BLOCK_LEN */
+#ifndef BLAKE2B_LANES_BUFFER
+#define BLAKE2B_LANES_BUFFER (32 * BLAKE2B_LANES_BLOCK_LEN)
+#endif
+
+typedef struct {
+  uint64_t h[8][BLAKE2B_LANES];
+  /* Bytes compressed so far, messages are limited to 2^64 - 1 bytes */
+  uint64_t t[BLAKE2B_LANES];
+  /* Buffered bytes of each lane start at start, and span length bytes */
+  size_t start[BLAKE2B_LANES];
+  size_t length[BLAKE2B_LANES];
+  size_t outlen;
+  uint8_t buffer[BLAKE2B_LANES][BLAKE2B_LANES_BUFFER];
+} blake2b_lanes_state;
+
+static const uint64_t _blake2b_lanes_iv[8] = {
+    0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL,
+    0xa54ff53a5f1d36f1ULL, 0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+    0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL};
+
+static const uint8_t _blake2b_lanes_sigma[12][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3},
+    {11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4},
+    {7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8},
+    {9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13},
+    {2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9},
+    {12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11},
+    {13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10},
+    {6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5},
+    {10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0},
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3}};
+
+static uint64_t _blake2b_lanes_load64(const uint8_t *p) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  uint64_t w;
+  memcpy(&w, p, sizeof(w));
+  return w;
+#else
+  return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) |
+         ((uint64_t)p[3] << 24) | ((uint64_t)p[4] << 32) |
+         ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) |
+         ((uint64_t)p[7] << 56);
+#endif
+}
+
+/*
+ * A word of every lane, whose operations compile to SIMD instructions where
+ * available, or to a plain loop over lanes otherwise.
+ */
+typedef uint64_t _blake2b_lanes_word
+    __attribute__((vector_size(8 * BLAKE2B_LANES)));
+
+#define _BLAKE2B_LANES_ROTR(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+
+#define _BLAKE2B_LANES_G(a, b, c, d, x, y) \
+  do {                                     \
+    a = a + b + x;                         \
+    d = _BLAKE2B_LANES_ROTR(d ^ a, 32);    \
+    c = c + d;                             \
+    b = _BLAKE2B_LANES_ROTR(b ^ c, 24);    \
+    a = a + b + y;                         \
+    d = _BLAKE2B_LANES_ROTR(d ^ a, 16);    \
+    c = c + d;                             \
+    b = _BLAKE2B_LANES_ROTR(b ^ c, 63);    \
+  } while (0)
+
+#define _BLAKE2B_LANES_SKIP 0
+#define _BLAKE2B_LANES_NEXT 1
+#define _BLAKE2B_LANES_LAST 2
+
+/*
+ * Compresses the block of each lane according to kind, one of
+ * _BLAKE2B_LANES_*. counted is the bytes of the block added to the message
+ * length, which is less than a full block only for the last one.
+ */
+static void _blake2b_lanes_compress(blake2b_lanes_state *S,
+                                    const uint8_t *blocks[BLAKE2B_LANES],
+                                    const size_t counted[BLAKE2B_LANES],
+                                    const int kind[BLAKE2B_LANES]) {
+  _blake2b_lanes_word m[16];
+  _blake2b_lanes_word v[16];
+  _blake2b_lanes_word keep;
+  for (size_t l = 0; l < BLAKE2B_LANES; l++) {
+    int skip = kind[l] == _BLAKE2B_LANES_SKIP;
+    keep[l] = skip ? 0 : ~(uint64_t)0;
+    S->t[l] += skip ? 0 : counted[l];
+    for (size_t i = 0; i < 16; i++) {
+      m[i][l] = skip ? 0 : _blake2b_lanes_load64(&blocks[l][i * 8]);
+    }
+    for (size_t i = 0; i < 8; i++) {
+      v[i][l] = S->h[i][l];
+      v[i + 8][l] = _blake2b_lanes_iv[i];
+    }
+    v[12][l] ^= S->t[l];
+    v[14][l] ^= kind[l] == _BLAKE2B_LANES_LAST ? ~(uint64_t)0 : 0;
+  }
+  for (size_t r = 0; r < 12; r++) {
+    const uint8_t *s = _blake2b_lanes_sigma[r];
+    _BLAKE2B_LANES_G(v[0], v[4], v[8], v[12], m[s[0]], m[s[1]]);
+    _BLAKE2B_LANES_G(v[1], v[5], v[9], v[13], m[s[2]], m[s[3]]);
+    _BLAKE2B_LANES_G(v[2], v[6], v[10], v[14], m[s[4]], m[s[5]]);
+    _BLAKE2B_LANES_G(v[3], v[7], v[11], v[15], m[s[6]], m[s[7]]);
+    _BLAKE2B_LANES_G(v[0], v[5], v[10], v[15], m[s[8]], m[s[9]]);
+    _BLAKE2B_LANES_G(v[1], v[6], v[11], v[12], m[s[10]], m[s[11]]);
+    _BLAKE2B_LANES_G(v[2], v[7], v[8], v[13], m[s[12]], m[s[13]]);
+    _BLAKE2B_LANES_G(v[3], v[4], v[9], v[14], m[s[14]], m[s[15]]);
+  }
+  for (size_t i = 0; i < 8; i++) {
+    _blake2b_lanes_word mixed = (v[i] ^ v[i + 8]) & keep;
+    for (size_t l = 0; l < BLAKE2B_LANES; l++) {
+      S->h[i][l] ^= mixed[l];
+    }
+  }
+}
+
+/*
+ * Compresses the next block of every lane having more data buffered after
+ * it. The last block of a message is kept until it is finalized.
+ */
+static void _blake2b_lanes_step(blake2b_lanes_state *S) {
+  const uint8_t *blocks[BLAKE2B_LANES];
+  size_t counted[BLAKE2B_LANES];
+  int kind[BLAKE2B_LANES];
+  for (size_t l = 0; l < BLAKE2B_LANES; l++) {
+    blocks[l] = &S->buffer[l][S->start[l]];
+    counted[l] = BLAKE2B_LANES_BLOCK_LEN;
+    kind[l] = S->length[l] > BLAKE2B_LANES_BLOCK_LEN ? _BLAKE2B_LANES_NEXT
+                                                     : _BLAKE2B_LANES_SKIP;
+  }
+  _blake2b_lanes_compress(S, blocks, counted, kind);
+  for (size_t l = 0; l < BLAKE2B_LANES; l++) {
+    if (kind[l] == _BLAKE2B_LANES_NEXT) {
+      S->start[l] += BLAKE2B_LANES_BLOCK_LEN;
+      S->length[l] -= BLAKE2B_LANES_BLOCK_LEN;
+    }
+  }
+}
+
+static void _blake2b_lanes_reset(blake2b_lanes_state *S, size_t lane) {
+  for (size_t i = 0; i < 8; i++) {
+    S->h[i][lane] = _blake2b_lanes_iv[i];
+  }
+  // Parameter block: digest length, no key, fanout 1, depth 1
+  S->h[0][lane] ^= 0x01010000ULL ^ (uint64_t)S->outlen;
+  S->t[lane] = 0;
+  S->start[lane] = 0;
+  S->length[lane] = 0;
+}
+
+/* Starts an empty message in every lane, digests are outlen bytes long */
+int blake2b_lanes_init(blake2b_lanes_state *S, size_t outlen) {
+  if (outlen == 0 || outlen > BLAKE2B_LANES_MAX_OUT_LEN) {
+    return 1;
+  }
+  S->outlen = outlen;
+  for (size_t l = 0; l < BLAKE2B_LANES; l++) {
+    _blake2b_lanes_reset(S, l);
+  }
+  return 0;
+}
+
+/* Appends data to the message in lane */
+int blake2b_lanes_update(blake2b_lanes_state *S, size_t lane,
+                         const uint8_t *data, size_t length) {
+  if (lane >= BLAKE2B_LANES) {
+    return 1;
+  }
+  while (length > 0) {
+    size_t end = S->start[lane] + S->length[lane];
+    if (end == BLAKE2B_LANES_BUFFER) {
+      // Other lanes advance along, leaving at most one block here to move
+      while (S->length[lane] > BLAKE2B_LANES_BLOCK_LEN) {
+        _blake2b_lanes_step(S);
+      }
+      memmove(S->buffer[lane], &S->buffer[lane][S->start[lane]],
+              S->length[lane]);
+      S->start[lane] = 0;
+      continue;
+    }
+    size_t n = BLAKE2B_LANES_BUFFER - end;
+    if (n > length) {
+      n = length;
+    }
+    memcpy(&S->buffer[lane][end], data, n);
+    S->length[lane] += n;
+    data += n;
+    length -= n;
+  }
+  return 0;
+}
+
+/*
+ * Finishes the messages in all lanes, digest of lane l is written to
+ * digests[l * outlen]. Every lane then starts a new empty message, a lane
+ * never updated yields the digest of an empty message.
+ */
+int blake2b_lanes_final(blake2b_lanes_state *S, uint8_t *digests) {
+  int pending = 1;
+  while (pending) {
+    pending = 0;
+    for (size_t l = 0; l < BLAKE2B_LANES; l++) {
+      pending |= S->length[l] > BLAKE2B_LANES_BLOCK_LEN;
+    }
+    if (pending) {
+      _blake2b_lanes_step(S);
+    }
+  }
+
+  // The last block is zero padded, an empty message has a block of zeros
+  uint8_t padded[BLAKE2B_LANES][BLAKE2B_LANES_BLOCK_LEN];
+  const uint8_t *blocks[BLAKE2B_LANES];
+  int kind[BLAKE2B_LANES];
+  for (size_t l = 0; l < BLAKE2B_LANES; l++) {
+    memset(padded[l], 0, BLAKE2B_LANES_BLOCK_LEN);
+    memcpy(padded[l], &S->buffer[l][S->start[l]], S->length[l]);
+    blocks[l] = padded[l];
+    kind[l] = _BLAKE2B_LANES_LAST;
+  }
+  _blake2b_lanes_compress(S, blocks, S->length, kind);
+
+  for (size_t l = 0; l < BLAKE2B_LANES; l++) {
+    for (size_t i = 0; i < S->outlen; i++) {
+      digests[l * S->outlen + i] =
+          (uint8_t)(S->h[i / 8][l] >> (8 * (i % 8)));
+    }
+    _blake2b_lanes_reset(S, l);
+  }
+  return 0;
+}
+
+/*
+ * Feeds text into one lane, as a feeder of mdp_visit. Change lane between
+ * visits to hash the text of up to BLAKE2B_LANES values before finalizing.
+ */
+typedef struct {
+  blake2b_lanes_state *state;
+  size_t lane;
+} blake2b_lanes_feeder_context;
+
+int blake2b_lanes_feeder(const uint8_t *data, size_t length,
+                         void *feeder_context) {
+  blake2b_lanes_feeder_context *c =
+      (blake2b_lanes_feeder_context *)feeder_context;
+  return blake2b_lanes_update(c->state, c->lane, data, length);
+}
+
+#endif /* MDP_BLAKE2B_LANES_H_ */
@@ -0,0 +1,281 @@
+#ifndef MDP_SINKS_H_
+#define MDP_SINKS_H_
+
+/*
+ * Ready-made sinks for text generated by molecule-dynamic-visitor.h. Each
+ * sink is a struct used as feeder_context, along with its *_feeder function
+ * as feeder. Feeders return 0 on success, a failing feeder aborts the visit
+ * with MDP_ERROR_FEEDER, the sink tells what went wrong.
+ *
+ * Text handed to a feeder lives in the visitor's output buffer, which is
+ * reused as soon as the feeder returns, so every sink copies text once.
+ * mdp_fixed_sink works anywhere, including CKB-VM. The other sinks allocate
+ * via malloc or write to file descriptors, they are meant for native tools.
+ */
+
+// molecule2_reader.h has a field named errno, it must be seen before the
+// errno macro of errno.h
+#include "molecule-dynamic-visitor.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* Initial capacity of growable sinks, and size of the first iovec block */
+#ifndef MDP_SINK_INITIAL_CAPACITY
+#define MDP_SINK_INITIAL_CAPACITY 4096
+#endif
+
+/*
+ * ----------------------------------------------------------------------
+ * APIs
+ * ----------------------------------------------------------------------
+ */
+
+/*
+ * Keeps all text in one contiguous buffer, doubling its capacity when full,
+ * so appending is amortized O(1). A zeroed struct is an empty sink, data is
+ * owned by the sink and freed by mdp_growable_sink_release. Setting length
+ * to 0 reuses the buffer for the next visit. Fails when malloc fails.
+ */
+typedef struct {
+  uint8_t *data;
+  size_t length;
+  size_t capacity;
+} mdp_growable_sink;
+
+int mdp_growable_sink_feeder(const uint8_t *data, size_t length,
+                             void *feeder_context);
+void mdp_growable_sink_release(mdp_growable_sink *sink);
+
+/*
+ * Keeps text in a caller-provided buffer. Text not fitting in the remaining
+ * capacity sets overflow, and fails the visit without writing anything
+ * past capacity.
+ */
+typedef struct {
+  uint8_t *buffer;
+  size_t capacity;
+  size_t length;
+  int overflow;
+} mdp_fixed_sink;
+
+void mdp_fixed_sink_initialize(mdp_fixed_sink *sink, void *buffer,
+                               size_t capacity);
+int mdp_fixed_sink_feeder(const uint8_t *data, size_t length,
+                          void *feeder_context);
+
+/*
+ * Writes text to a file descriptor. Text is staged in a caller-provided
+ * buffer, once a chunk no longer fits, staged text and the chunk are
+ * written together by a single writev, without copying the chunk. Call
+ * mdp_fd_sink_flush after the visit to write what is left. error keeps the
+ * errno of a failed write, writes counts the calls to writev.
+ */
+typedef struct {
+  int fd;
+  uint8_t *buffer;
+  size_t capacity;
+  size_t length;
+
+  int error;
+  size_t writes;
+} mdp_fd_sink;
+
+void mdp_fd_sink_initialize(mdp_fd_sink *sink, int fd, void *buffer,
+                            size_t capacity);
+int mdp_fd_sink_feeder(const uint8_t *data, size_t length,
+                       void *feeder_context);
+int mdp_fd_sink_flush(mdp_fd_sink *sink);
+
+/*
+ * Collects text as a list of spans, ready to be passed to writev or sendmsg.
+ * Unlike mdp_growable_sink, text already collected is never moved: a full
+ * block is kept as it is, and a new block twice as large is allocated.
+ * Chunks continuing the same block extend its span, so there are only
+ * O(log(length)) spans, each owned by the sink until
+ * mdp_iovec_sink_release. A zeroed struct is an empty sink.
+ */
+typedef struct {
+  struct iovec *spans;
+  size_t count;
+  size_t spans_capacity;
+  /* Bytes available in the block of the last span */
+  size_t block_left;
+  size_t length;
+} mdp_iovec_sink;
+
+int mdp_iovec_sink_feeder(const uint8_t *data, size_t length,
+                          void *feeder_context);
+void mdp_iovec_sink_release(mdp_iovec_sink *sink);
+
+/*
+ * ----------------------------------------------------------------------
+ * Implementations
+ * ----------------------------------------------------------------------
+ */
+int mdp_growable_sink_feeder(const uint8_t *data, size_t length,
+                             void *feeder_context) {
+  mdp_growable_sink *sink = (mdp_growable_sink *)feeder_context;
+  if (length == 0) {
+    return 0;
+  }
+  if (length > sink->capacity - sink->length) {
+    size_t capacity =
+        sink->capacity == 0 ? MDP_SINK_INITIAL_CAPACITY : sink->capacity;
+    while (capacity - sink->length < length) {
+      capacity *= 2;
+    }
+    uint8_t *grown = (uint8_t *)realloc(sink->data, capacity);
+    if (grown == NULL) {
+      return 1;
+    }
+    sink->data = grown;
+    sink->capacity = capacity;
+  }
+  memcpy(&sink->data[sink->length], data, length);
+  sink->length += length;
+  return 0;
+}
+
+void mdp_growable_sink_release(mdp_growable_sink *sink) {
+  free(sink->data);
+  sink->data = NULL;
+  sink->length = 0;
+  sink->capacity = 0;
+}
+
+void mdp_fixed_sink_initialize(mdp_fixed_sink *sink, void *buffer,
+                               size_t capacity) {
+  sink->buffer = (uint8_t *)buffer;
+  sink->capacity = capacity;
+  sink->length = 0;
+  sink->overflow = 0;
+}
+
+int mdp_fixed_sink_feeder(const uint8_t *data, size_t length,
+                          void *feeder_context) {
+  mdp_fixed_sink *sink = (mdp_fixed_sink *)feeder_context;
+  if (length > sink->capacity - sink->length) {
+    sink->overflow = 1;
+    return 1;
+  }
+  memcpy(&sink->buffer[sink->length], data, length);
+  sink->length += length;
+  return 0;
+}
+
+void mdp_fd_sink_initialize(mdp_fd_sink *sink, int fd, void *buffer,
+                            size_t capacity) {
+  sink->fd = fd;
+  sink->buffer = (uint8_t *)buffer;
+  sink->capacity = capacity;
+  sink->length = 0;
+  sink->error = 0;
+  sink->writes = 0;
+}
+
+/* Writes all of spans, retrying on partial writes and interruptions */
+int _mdp_fd_sink_writev(mdp_fd_sink *sink, struct iovec *spans, int count) {
+  while (count > 0) {
+    ssize_t written = writev(sink->fd, spans, count);
+    sink->writes++;
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      sink->error = errno;
+      return 1;
+    }
+    while (count > 0 && (size_t)written >= spans->iov_len) {
+      written -= (ssize_t)spans->iov_len;
+      spans++;
+      count--;
+    }
+    if (count > 0) {
+      spans->iov_base = (uint8_t *)spans->iov_base + written;
+      spans->iov_len -= (size_t)written;
+    }
+  }
+  return 0;
+}
+
+int mdp_fd_sink_feeder(const uint8_t *data, size_t length,
+                       void *feeder_context) {
+  mdp_fd_sink *sink = (mdp_fd_sink *)feeder_context;
+  if (length <= sink->capacity - sink->length) {
+    memcpy(&sink->buffer[sink->length], data, length);
+    sink->length += length;
+    return 0;
+  }
+  struct iovec spans[2];
+  spans[0].iov_base = sink->buffer;
+  spans[0].iov_len = sink->length;
+  spans[1].iov_base = (void *)data;
+  spans[1].iov_len = length;
+  sink->length = 0;
+  return _mdp_fd_sink_writev(sink, spans, 2);
+}
+
+int mdp_fd_sink_flush(mdp_fd_sink *sink) {
+  if (sink->length == 0) {
+    return 0;
+  }
+  struct iovec span;
+  span.iov_base = sink->buffer;
+  span.iov_len = sink->length;
+  sink->length = 0;
+  return _mdp_fd_sink_writev(sink, &span, 1);
+}
+
+int mdp_iovec_sink_feeder(const uint8_t *data, size_t length,
+                          void *feeder_context) {
+  mdp_iovec_sink *sink = (mdp_iovec_sink *)feeder_context;
+  while (length > 0) {
+    if (sink->block_left == 0) {
+      if (sink->count == sink->spans_capacity) {
+        size_t capacity =
+            sink->spans_capacity == 0 ? 8 : sink->spans_capacity * 2;
+        struct iovec *spans = (struct iovec *)realloc(
+            sink->spans, capacity * sizeof(struct iovec));
+        if (spans == NULL) {
+          return 1;
+        }
+        sink->spans = spans;
+        sink->spans_capacity = capacity;
+      }
+      size_t size = sink->count == 0
+                        ? MDP_SINK_INITIAL_CAPACITY
+                        : sink->spans[sink->count - 1].iov_len * 2;
+      struct iovec *span = &sink->spans[sink->count];
+      span->iov_base = malloc(size);
+      if (span->iov_base == NULL) {
+        return 1;
+      }
+      span->iov_len = 0;
+      sink->count++;
+      sink->block_left = size;
+    }
+    struct iovec *span = &sink->spans[sink->count - 1];
+    size_t copied = length < sink->block_left ? length : sink->block_left;
+    memcpy((uint8_t *)span->iov_base + span->iov_len, data, copied);
+    span->iov_len += copied;
+    sink->block_left -= copied;
+    sink->length += copied;
+    data += copied;
+    length -= copied;
+  }
+  return 0;
+}
+
+void mdp_iovec_sink_release(mdp_iovec_sink *sink) {
+  for (size_t i = 0; i < sink->count; i++) {
+    free(sink->spans[i].iov_base);
+  }
+  free(sink->spans);
+  memset(sink, 0, sizeof(mdp_iovec_sink));
+}
+
+#endif /* MDP_SINKS_H_ */
@@ -1,3 +1,11 @@
+/*
+ * Generated by moleculec-c2 from schemas/definitions.mol, then EDITED BY
+ * HAND: moleculec-c2 emits Get*VTable functions assigning the fields of a
+ * static vtable on every call, a data race between threads visiting at the
+ * same time. Each vtable here is initialized in its declaration instead.
+ * Redo this edit after regenerating the file, CI fails while any vtable is
+ * still assigned at runtime.
+ */
 
 #ifndef _DEFINITIONS_API2_H_
 #define _DEFINITIONS_API2_H_
@@ -294,11 +302,10 @@ struct Uint64Type make_Uint64(mol2_cursor_t *cur) {
   return ret;
 }
 struct Uint64VTable *GetUint64VTable(void) {
-  static Uint64VTable s_vtable;
-  static int inited = 0;
-  if (inited) return &s_vtable;
-  s_vtable.len = Uint64_len_impl;
-  s_vtable.get = Uint64_get_impl;
+  static Uint64VTable s_vtable = {
+      .len = Uint64_len_impl,
+      .get = Uint64_get_impl,
+  };
   return &s_vtable;
 }
 uint32_t Uint64_len_impl(Uint64Type *this) { return 8; }
@@ -321,11 +328,10 @@ struct StringType make_String(mol2_cursor_t *cur) {
   return ret;
 }
 struct StringVTable *GetStringVTable(void) {
-  static StringVTable s_vtable;
-  static int inited = 0;
-  if (inited) return &s_vtable;
-  s_vtable.len = String_len_impl;
-  s_vtable.get = String_get_impl;
+  static StringVTable s_vtable = {
+      .len = String_len_impl,
+      .get = String_get_impl,
+  };
   return &s_vtable;
 }
 uint32_t String_len_impl(StringType *this) {
@@ -350,11 +356,10 @@ struct FieldPairType make_FieldPair(mol2_cursor_t *cur) {
   return ret;
 }
 struct FieldPairVTable *GetFieldPairVTable(void) {
-  static FieldPairVTable s_vtable;
-  static int inited = 0;
-  if (inited) return &s_vtable;
-  s_vtable.name = FieldPair_get_name_impl;
-  s_vtable.typ = FieldPair_get_typ_impl;
+  static FieldPairVTable s_vtable = {
+      .name = FieldPair_get_name_impl,
+      .typ = FieldPair_get_typ_impl,
+  };
   return &s_vtable;
 }
 mol2_cursor_t FieldPair_get_name_impl(FieldPairType *this) {
@@ -376,11 +381,10 @@ struct FieldPairVecType make_FieldPairVec(mol2_cursor_t *cur) {
   return ret;
 }
 struct FieldPairVecVTable *GetFieldPairVecVTable(void) {
-  static FieldPairVecVTable s_vtable;
-  static int inited = 0;
-  if (inited) return &s_vtable;
-  s_vtable.len = FieldPairVec_len_impl;
-  s_vtable.get = FieldPairVec_get_impl;
+  static FieldPairVecVTable s_vtable = {
+      .len = FieldPairVec_len_impl,
+      .get = FieldPairVec_get_impl,
+  };
   return &s_vtable;
 }
 uint32_t FieldPairVec_len_impl(FieldPairVecType *this) {
@@ -407,11 +411,10 @@ struct OptionDefinitionType make_OptionDefinition(mol2_cursor_t *cur) {
   return ret;
 }
 struct OptionDefinitionVTable *GetOptionDefinitionVTable(void) {
-  static OptionDefinitionVTable s_vtable;
-  static int inited = 0;
-  if (inited) return &s_vtable;
-  s_vtable.name = OptionDefinition_get_name_impl;
-  s_vtable.item = OptionDefinition_get_item_impl;
+  static OptionDefinitionVTable s_vtable = {
+      .name = OptionDefinition_get_name_impl,
+      .item = OptionDefinition_get_item_impl,
+  };
   return &s_vtable;
 }
 mol2_cursor_t OptionDefinition_get_name_impl(OptionDefinitionType *this) {
@@ -433,11 +436,10 @@ struct UnionPairType make_UnionPair(mol2_cursor_t *cur) {
   return ret;
 }
 struct UnionPairVTable *GetUnionPairVTable(void) {
-  static UnionPairVTable s_vtable;
-  static int inited = 0;
-  if (inited) return &s_vtable;
-  s_vtable.typ = UnionPair_get_typ_impl;
-  s_vtable.id = UnionPair_get_id_impl;
+  static UnionPairVTable s_vtable = {
+      .typ = UnionPair_get_typ_impl,
+      .id = UnionPair_get_id_impl,
+  };
   return &s_vtable;
 }
 mol2_cursor_t UnionPair_get_typ_impl(UnionPairType *this) {
@@ -459,11 +461,10 @@ struct UnionPairVecType make_UnionPairVec(mol2_cursor_t *cur) {
   return ret;
 }
 struct UnionPairVecVTable *GetUnionPairVecVTable(void) {
-  static UnionPairVecVTable s_vtable;
-  static int inited = 0;
-  if (inited) return &s_vtable;
-  s_vtable.len = UnionPairVec_len_impl;
-  s_vtable.get = UnionPairVec_get_impl;
+  static UnionPairVecVTable s_vtable = {
+      .len = UnionPairVec_len_impl,
+      .get = UnionPairVec_get_impl,
+  };
   return &s_vtable;
 }
 uint32_t UnionPairVec_len_impl(UnionPairVecType *this) {
@@ -490,11 +491,10 @@ struct UnionDefinitionType make_UnionDefinition(mol2_cursor_t *cur) {
   return ret;
 }
 struct UnionDefinitionVTable *GetUnionDefinitionVTable(void) {
-  static UnionDefinitionVTable s_vtable;
-  static int inited = 0;
-  if (inited) return &s_vtable;
-  s_vtable.name = UnionDefinition_get_name_impl;
-  s_vtable.items = UnionDefinition_get_items_impl;
+  static UnionDefinitionVTable s_vtable = {
+      .name = UnionDefinition_get_name_impl,
+      .items = UnionDefinition_get_items_impl,
+  };
   return &s_vtable;
 }
 mol2_cursor_t UnionDefinition_get_name_impl(UnionDefinitionType *this) {
@@ -517,12 +517,11 @@ struct ArrayDefinitionType make_ArrayDefinition(mol2_cursor_t *cur) {
   return ret;
 }
 struct ArrayDefinitionVTable *GetArrayDefinitionVTable(void) {
-  static ArrayDefinitionVTable s_vtable;
-  static int inited = 0;
-  if (inited) return &s_vtable;
-  s_vtable.name = ArrayDefinition_get_name_impl;
-  s_vtable.item = ArrayDefinition_get_item_impl;
-  s_vtable.item_count = ArrayDefinition_get_item_count_impl;
+  static ArrayDefinitionVTable s_vtable = {
+      .name = ArrayDefinition_get_name_impl,
+      .item = ArrayDefinition_get_item_impl,
+      .item_count = ArrayDefinition_get_item_count_impl,
+  };
   return &s_vtable;
 }
 mol2_cursor_t ArrayDefinition_get_name_impl(ArrayDefinitionType *this) {
@@ -550,11 +549,10 @@ struct StructDefinitionType make_StructDefinition(mol2_cursor_t *cur) {
   return ret;
 }
 struct StructDefinitionVTable *GetStructDefinitionVTable(void) {
-  static StructDefinitionVTable s_vtable;
-  static int inited = 0;
-  if (inited) return &s_vtable;
-  s_vtable.name = StructDefinition_get_name_impl;
-  s_vtable.fields = StructDefinition_get_fields_impl;
+  static StructDefinitionVTable s_vtable = {
+      .name = StructDefinition_get_name_impl,
+      .fields = StructDefinition_get_fields_impl,
+  };
   return &s_vtable;
 }
 mol2_cursor_t StructDefinition_get_name_impl(StructDefinitionType *this) {
@@ -577,11 +575,10 @@ struct FixvecDefinitionType make_FixvecDefinition(mol2_cursor_t *cur) {
   return ret;
 }
 struct FixvecDefinitionVTable *GetFixvecDefinitionVTable(void) {
-  static FixvecDefinitionVTable s_vtable;
-  static int inited = 0;
-  if (inited) return &s_vtable;
-  s_vtable.name = FixvecDefinition_get_name_impl;
-  s_vtable.item = FixvecDefinition_get_item_impl;
+  static FixvecDefinitionVTable s_vtable = {
+      .name = FixvecDefinition_get_name_impl,
+      .item = FixvecDefinition_get_item_impl,
+  };
   return &s_vtable;
 }
 mol2_cursor_t FixvecDefinition_get_name_impl(FixvecDefinitionType *this) {
@@ -603,11 +600,10 @@ struct DynvecDefinitionType make_DynvecDefinition(mol2_cursor_t *cur) {
   return ret;
 }
 struct DynvecDefinitionVTable *GetDynvecDefinitionVTable(void) {
-  static DynvecDefinitionVTable s_vtable;
-  static int inited = 0;
-  if (inited) return &s_vtable;
-  s_vtable.name = DynvecDefinition_get_name_impl;
-  s_vtable.item = DynvecDefinition_get_item_impl;
+  static DynvecDefinitionVTable s_vtable = {
+      .name = DynvecDefinition_get_name_impl,
+      .item = DynvecDefinition_get_item_impl,
+  };
   return &s_vtable;
 }
 mol2_cursor_t DynvecDefinition_get_name_impl(DynvecDefinitionType *this) {
@@ -629,11 +625,10 @@ struct TableDefinitionType make_TableDefinition(mol2_cursor_t *cur) {
   return ret;
 }
 struct TableDefinitionVTable *GetTableDefinitionVTable(void) {
-  static TableDefinitionVTable s_vtable;
-  static int inited = 0;
-  if (inited) return &s_vtable;
-  s_vtable.name = TableDefinition_get_name_impl;
-  s_vtable.fields = TableDefinition_get_fields_impl;
+  static TableDefinitionVTable s_vtable = {
+      .name = TableDefinition_get_name_impl,
+      .fields = TableDefinition_get_fields_impl,
+  };
   return &s_vtable;
 }
 mol2_cursor_t TableDefinition_get_name_impl(TableDefinitionType *this) {
@@ -656,17 +651,16 @@ struct DefinitionType make_Definition(mol2_cursor_t *cur) {
   return ret;
 }
 struct DefinitionVTable *GetDefinitionVTable(void) {
-  static DefinitionVTable s_vtable;
-  static int inited = 0;
-  if (inited) return &s_vtable;
-  s_vtable.item_id = Definition_item_id_impl;
-  s_vtable.as_OptionDefinition = Definition_as_OptionDefinition_impl;
-  s_vtable.as_UnionDefinition = Definition_as_UnionDefinition_impl;
-  s_vtable.as_ArrayDefinition = Definition_as_ArrayDefinition_impl;
-  s_vtable.as_StructDefinition = Definition_as_StructDefinition_impl;
-  s_vtable.as_FixvecDefinition = Definition_as_FixvecDefinition_impl;
-  s_vtable.as_DynvecDefinition = Definition_as_DynvecDefinition_impl;
-  s_vtable.as_TableDefinition = Definition_as_TableDefinition_impl;
+  static DefinitionVTable s_vtable = {
+      .item_id = Definition_item_id_impl,
+      .as_OptionDefinition = Definition_as_OptionDefinition_impl,
+      .as_UnionDefinition = Definition_as_UnionDefinition_impl,
+      .as_ArrayDefinition = Definition_as_ArrayDefinition_impl,
+      .as_StructDefinition = Definition_as_StructDefinition_impl,
+      .as_FixvecDefinition = Definition_as_FixvecDefinition_impl,
+      .as_DynvecDefinition = Definition_as_DynvecDefinition_impl,
+      .as_TableDefinition = Definition_as_TableDefinition_impl,
+  };
   return &s_vtable;
 }
 uint32_t Definition_item_id_impl(DefinitionType *this) {
@@ -728,11 +722,10 @@ struct DefinitionVecType make_DefinitionVec(mol2_cursor_t *cur) {
   return ret;
 }
 struct DefinitionVecVTable *GetDefinitionVecVTable(void) {
-  static DefinitionVecVTable s_vtable;
-  static int inited = 0;
-  if (inited) return &s_vtable;
-  s_vtable.len = DefinitionVec_len_impl;
-  s_vtable.get = DefinitionVec_get_impl;
+  static DefinitionVecVTable s_vtable = {
+      .len = DefinitionVec_len_impl,
+      .get = DefinitionVec_get_impl,
+  };
   return &s_vtable;
 }
 uint32_t DefinitionVec_len_impl(DefinitionVecType *this) {
@@ -759,12 +752,11 @@ struct DefinitionsType make_Definitions(mol2_cursor_t *cur) {
   return ret;
 }
 struct DefinitionsVTable *GetDefinitionsVTable(void) {
-  static DefinitionsVTable s_vtable;
-  static int inited = 0;
-  if (inited) return &s_vtable;
-  s_vtable.definitions = Definitions_get_definitions_impl;
-  s_vtable.top_level_type = Definitions_get_top_level_type_impl;
-  s_vtable.syntax_version = Definitions_get_syntax_version_impl;
+  static DefinitionsVTable s_vtable = {
+      .definitions = Definitions_get_definitions_impl,
+      .top_level_type = Definitions_get_top_level_type_impl,
+      .syntax_version = Definitions_get_syntax_version_impl,
+  };
   return &s_vtable;
 }
 DefinitionVecType Definitions_get_definitions_impl(DefinitionsType *this) {
@@ -1,12 +1,16 @@
 #ifndef MOLECULE_DYNAMIC_PARSER_H_
 #define MOLECULE_DYNAMIC_PARSER_H_
 
-#include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
+#ifdef MDP_PARALLEL
+#include <pthread.h>
+#include <stdlib.h>
+#endif
+
 #include "bech32m.h"
 #include "mol2_definitions.h"
 #include "utf8.h"
@@ -19,27 +23,791 @@
 typedef int (*mdp_text_feeder_t)(const uint8_t *data, size_t length,
                                  void *feeder_context);
 
+/*
+ * Fans generated text out to several feeders, so one visit can for example
+ * display, hash and count the same text. Use mdp_tee_feeder as the feeder of a
+ * context, with a mdp_tee as its feeder context. Each chunk is forwarded to
+ * the branches in order. The first branch returning non-zero stops the visit
+ * with MDP_ERROR_FEEDER, result of branches tells which one failed and why.
+ */
+typedef struct {
+  mdp_text_feeder_t feeder;
+  void *feeder_context;
+
+  /* Set by mdp_tee_feeder to the value returned by feeder */
+  int result;
+} mdp_tee_branch;
+
+typedef struct {
+  mdp_tee_branch *branches;
+  size_t count;
+} mdp_tee;
+
+int mdp_tee_feeder(const uint8_t *data, size_t length, void *feeder_context);
+
+/*
+ * Compares generated text against expected as it is fed, consuming expected
+ * along the way, no text is kept. mdp_comparator_feeder fails on the first
+ * byte that differs, or text running past the end of expected, with result
+ * set to MDP_ERROR_MISMATCH(or MDP_ERROR_MOL2_IO when expected cannot be
+ * read). The text is equal to expected only if the visit succeeds, and
+ * expected.size is 0 afterwards. See mdp_compare for a shortcut.
+ */
+typedef struct {
+  mol2_cursor_t expected;
+
+  int result;
+} mdp_comparator;
+
+int mdp_comparator_feeder(const uint8_t *data, size_t length,
+                          void *feeder_context);
+
+/*
+ * No global or static state is modified by any mdp_* call, everything a call
+ * works on is passed in its arguments. Calls from different threads can run
+ * concurrently, as long as mutable objects are not shared:
+ *
+ * * Prepared schemas and projections are never modified once built, they can
+ * be shared by any number of threads.
+ * * Reading through a data source fills its cache, so each thread needs its
+ * own data sources for schema and data, even for the same memory.
+ * * Arenas, contexts, pulls, indexes, address caches, fragment caches,
+ * feeder contexts and hasher contexts are used by one thread at a time.
+ *
+ * mol2_make_cursor_from_memory in molecule2_reader.h keeps its data source in
+ * a static variable, threads use mdp_cursor_from_memory instead.
+ */
+
+/*
+ * Points a cursor at size bytes of memory, reading through source, which is
+ * filled in here and must outlive the cursor.
+ */
+mol2_cursor_t mdp_cursor_from_memory(mol2_data_source_t *source,
+                                     const void *memory, uint32_t size);
+
+/*
+ * A caller-provided memory region, handed out via a bump allocator. All
+ * scratch state used by the visitor(prepared schema, output buffer, frame
+ * stack and data source caches) lives in an arena, no malloc is ever
+ * involved.
+ *
+ * Each mdp_* call taking an arena releases its scratch memory before
+ * returning, so the same arena can be reused across any number of calls.
+ * Memory allocated before a call(such as a schema prepared via
+ * mdp_prepare_schema) is kept intact.
+ */
+typedef struct {
+  uint8_t *buffer;
+  size_t size;
+  size_t used;
+
+  /* Bytes of the arena used by the latest mdp_* call */
+  size_t last_used;
+  /* Highest value ever reached by used */
+  size_t high_water;
+} mdp_arena;
+
+void mdp_arena_initialize(mdp_arena *arena, void *buffer, size_t size);
+/* Returns NULL when the arena is exhausted */
+void *mdp_arena_alloc(mdp_arena *arena, size_t size);
+
+#define MDP_KIND_OPTION 0
+#define MDP_KIND_UNION 1
+#define MDP_KIND_ARRAY 2
+#define MDP_KIND_STRUCT 3
+#define MDP_KIND_FIXVEC 4
+#define MDP_KIND_DYNVEC 5
+#define MDP_KIND_TABLE 6
+#define MDP_KIND_BYTE 7
+
+#define MDP_BUILTIN_NONE 0
+#define MDP_BUILTIN_BYTE32 1
+#define MDP_BUILTIN_UINT64 2
+#define MDP_BUILTIN_STRING 3
+#define MDP_BUILTIN_ADDRESS 4
+
+/* Definition index of the primitive byte type */
+#define MDP_TYPE_BYTE 0
+/* Marks a type name that cannot be found in the schema */
+#define MDP_TYPE_UNRESOLVED 0xFFFFFFFF
+
+/*
+ * A field of a struct / table, or a variant of a union. For union variants,
+ * name holds the variant type name.
+ */
+typedef struct {
+  const uint8_t *name;
+  uint32_t name_length;
+  uint32_t type;
+  uint64_t id;
+} mdp_field;
+
+typedef struct {
+  const uint8_t *name;
+  uint32_t name_length;
+  uint8_t kind;
+  uint8_t builtin;
+  /* Item type for option, array, fixvec and dynvec */
+  uint32_t item;
+  uint64_t item_count;
+  /* Fields for struct & table, variants for union */
+  uint32_t first_field;
+  uint32_t field_count;
+  /*
+   * Maximum number of nested frames required to visit this type, only
+   * calculated for types reachable from the top level type. 0 is used when
+   * recursive types are involved.
+   */
+  uint32_t depth;
+  /*
+   * Size in bytes of fixed size types(byte, array and struct), 0 for other
+   * types, or when the size cannot be calculated.
+   */
+  uint32_t fixed_size;
+} mdp_definition;
+
+/*
+ * A schema with all type names resolved to definition indices, and all
+ * strings copied out of the original schema data. Once prepared, a schema
+ * is never modified, and can be shared by as many visits as needed.
+ */
+typedef struct {
+  const mdp_definition *definitions;
+  uint32_t definition_count;
+  const mdp_field *fields;
+  uint32_t field_count;
+  uint32_t top_level_type;
+  uint32_t max_depth;
+} mdp_schema;
+
+/*
+ * Prepares a molecule-formatted Definitions schema, all the memory for the
+ * prepared schema is allocated from arena.
+ */
+int mdp_prepare_schema(mdp_arena *arena, mol2_cursor_t schema,
+                       mdp_schema *out);
+
+/*
+ * A projection hides struct and table fields from generated text. Fields
+ * of a definition occupy bits first_field to first_field + field_count - 1
+ * of the bitmap, a set bit hides the field.
+ *
+ * By default, hidden fields are still visited to validate them, only the
+ * text is omitted. With skip_hidden set, hidden fields are skipped by their
+ * offsets or sizes without validation, so the cost of a visit tracks the
+ * text generated, not the size of data.
+ *
+ * A projection is built against a prepared schema, it can only be used with
+ * the same schema.
+ */
+typedef struct {
+  uint8_t *hidden;
+  int skip_hidden;
+} mdp_projection;
+
+/* Initializes a projection with no hidden fields, the bitmap lives in arena */
+int mdp_projection_initialize(mdp_arena *arena, const mdp_schema *schema,
+                              mdp_projection *out);
+/*
+ * Hides field of definition, both given by name. MDP_ERROR_PATH_NOT_FOUND is
+ * returned when either cannot be found.
+ */
+int mdp_projection_hide(mdp_projection *projection, const mdp_schema *schema,
+                        const char *definition, const char *field);
+
+/*
+ * Elides long byte arrays and byte vectors from generated text. When a value
+ * has more than threshold bytes, only the first preview bytes are printed,
+ * followed by a line with the number of remaining bytes and a digest of the
+ * full content:
+ *
+ *   0x01, 0x02, 0x03, 0x04,
+ *   ... 1020 more bytes, digest = 0x<MDP_DIGEST_LEN bytes in hex>
+ *
+ * The digest is computed by streaming the content from data into the hasher
+ * functions, such as blake2b. For each elided value, init, update and final
+ * are invoked in order on hasher_context, a non-zero return value signals an
+ * error.
+ */
+typedef struct {
+  uint32_t threshold;
+  uint32_t preview;
+
+  int (*init)(void *hasher_context);
+  int (*update)(void *hasher_context, const uint8_t *data, size_t length);
+  /* Writes MDP_DIGEST_LEN bytes of digest */
+  int (*final)(void *hasher_context, uint8_t *digest);
+  void *hasher_context;
+} mdp_elision;
+
+/*
+ * Remembers the text of recently encoded addresses, so a Script seen again
+ * is not encoded by bech32m again. An entry is found by comparing the bytes
+ * of code hash, hash type and args, and hrp, and is only replaced once it
+ * is the least recently used entry. Scripts longer than
+ * MDP_ADDRESS_CACHE_SCRIPT_LEN bytes, or addresses longer than
+ * MDP_ADDRESS_CACHE_TEXT_LEN bytes, are always encoded.
+ *
+ * entries and capacity are provided by the caller, the same cache can be
+ * kept across any number of visits. hits and misses count lookups.
+ */
+#ifndef MDP_ADDRESS_CACHE_SCRIPT_LEN
+#define MDP_ADDRESS_CACHE_SCRIPT_LEN 96
+#endif
+
+#ifndef MDP_ADDRESS_CACHE_TEXT_LEN
+#define MDP_ADDRESS_CACHE_TEXT_LEN 192
+#endif
+
+typedef struct {
+  /* 0 for an empty entry */
+  uint64_t last_used;
+  uint64_t hash;
+  uint32_t script_length;
+  uint32_t text_length;
+  uint8_t script[MDP_ADDRESS_CACHE_SCRIPT_LEN];
+  uint8_t text[MDP_ADDRESS_CACHE_TEXT_LEN];
+} mdp_address_cache_entry;
+
+typedef struct {
+  mdp_address_cache_entry *entries;
+  uint32_t capacity;
+  uint64_t clock;
+
+  uint64_t hits;
+  uint64_t misses;
+} mdp_address_cache;
+
+void mdp_address_cache_initialize(mdp_address_cache *cache,
+                                  mdp_address_cache_entry *entries,
+                                  uint32_t capacity);
+
+/*
+ * Remembers the text of recently rendered subtrees, so a value seen again,
+ * such as the same Script in many transactions or a constant table, is
+ * sent without being visited again. A subtree is found by its definition
+ * and the exact bytes it spans: a hash of the bytes picks a set of
+ * MDP_FRAGMENT_CACHE_WAYS entries, then the bytes kept in the entry are
+ * compared, the least recently used entry of the set is replaced. Text is
+ * kept without its indentation, which is added back when sent, so the same
+ * fragment serves any depth.
+ *
+ * All memory is provided to mdp_fragment_cache_initialize, which keeps
+ * slot_size bytes for each entry, holding the bytes and the text of one
+ * subtree, plus twice slot_size as scratch space. Subtrees not fitting a
+ * slot are always visited.
+ *
+ * Entries are tied to the prepared schema of the context using the cache,
+ * and to the content of its format, hrp, projection and elision, so the
+ * cache is emptied once used with different ones, including a projection
+ * or hrp changed in place. Only visits generating text through a feeder,
+ * with a prepared schema, use the cache. A subtree found in the cache
+ * counts towards all budgets as if it was visited.
+ */
+#ifndef MDP_FRAGMENT_CACHE_WAYS
+#define MDP_FRAGMENT_CACHE_WAYS 4
+#endif
+
+/* Smaller subtrees are rendered faster than they are looked up */
+#ifndef MDP_FRAGMENT_MIN_SIZE
+#define MDP_FRAGMENT_MIN_SIZE 16
+#endif
+
+typedef struct {
+  /* 0 for an empty entry */
+  uint64_t last_used;
+  uint64_t hash;
+  uint32_t type;
+  /* Size of the bytes spanned by the subtree */
+  uint32_t size;
+  /* Size consumed by the subtree, at most size */
+  uint32_t consumed;
+  /* Frames nested below the subtree, and values visited in it */
+  uint32_t depth;
+  uint64_t nodes;
+  uint32_t mark_count;
+  uint32_t text_length;
+} mdp_fragment;
+
+typedef struct {
+  mdp_fragment *entries;
+  uint32_t set_count;
+  uint32_t slot_size;
+  uint8_t *slots;
+  uint8_t *scratch;
+  uint64_t clock;
+
+  /* Settings entries are rendered with, the others are kept as a hash */
+  const mdp_schema *schema;
+  uint64_t settings;
+
+  uint64_t hits;
+  uint64_t misses;
+  /* Entries replaced while holding another subtree */
+  uint64_t evictions;
+  /* Subtrees rendered but not kept, as their bytes or text exceed a slot */
+  uint64_t oversized;
+} mdp_fragment_cache;
+
+/*
+ * Sets up a cache using size bytes of memory, returns MDP_ERROR_ARENA when
+ * memory is not enough for a single set.
+ */
+int mdp_fragment_cache_initialize(mdp_fragment_cache *cache, void *memory,
+                                  size_t size, uint32_t slot_size);
+
+/*
+ * Limits on the work done by a single visit, 0 means no limit. Once a limit
+ * is exceeded, the visit aborts with MDP_ERROR_BUDGET.
+ *
+ * * max_output: bytes of generated text, the feeder never receives text
+ * beyond the limit. Not enforced by mdp_verify, which generates no text.
+ * * max_nodes: values visited, a byte vector or byte array counts as a
+ * single value.
+ * * max_depth: levels of nested values, the top level value is at level 1.
+ */
+typedef struct {
+  size_t max_output;
+  uint64_t max_nodes;
+  uint32_t max_depth;
+} mdp_budget;
+
+/*
+ * Formats of generated text:
+ *
+ * * MDP_FORMAT_TEXT: indented text for human readers, the default.
+ * * MDP_FORMAT_JSON: JSON without any whitespace, for machine consumers.
+ * Tables and structs are objects keyed by field names, arrays, fixvecs and
+ * dynvecs are arrays. A union is an object with the variant name as its only
+ * key, an option is null or its value. Byte32, bytes and single bytes are
+ * "0x" prefixed hex strings, Uint64 values are numbers, Addresses are bech32m
+ * strings. Elided bytes are objects like
+ * {"preview":"0x0102","more":1020,"digest":"0x..."}.
+ * * MDP_FORMAT_COMPACT: canonical text, still human readable but several
+ * times shorter than MDP_FORMAT_TEXT, saving cycles spent on hashing it.
+ * There is no whitespace or type annotation, tables and structs are
+ * {field:value,...}, arrays, fixvecs and dynvecs are [value,...]. A union is
+ * Variant(value), an option is None or its value. Bytes are contiguous hex
+ * digits prefixed by 0x, Strings are quoted like JSON strings, Uint64 values
+ * and Addresses are printed as in MDP_FORMAT_TEXT. Elided bytes are printed
+ * as 0x0102...(+1020 bytes, digest 0x...).
+ */
+#define MDP_FORMAT_TEXT 0
+#define MDP_FORMAT_JSON 1
+#define MDP_FORMAT_COMPACT 2
+
+/* Marks a context set up by mdp_context_initialize */
+#define MDP_CONTEXT_VERSION 0x6d647001
+
 typedef struct {
   const char *hrp;
   mol2_cursor_t schema;
   mol2_cursor_t data;
   mdp_text_feeder_t feeder;
   void *feeder_context;
+
+  /*
+   * Set by mdp_context_initialize. Optional fields below are only read when
+   * version is MDP_CONTEXT_VERSION, a context filling in the fields above
+   * one by one, as code written before optional fields existed does, has
+   * them all treated as zeroed.
+   */
+  uint32_t version;
+
+  /*
+   * Optional fields, call mdp_context_initialize to zero them, then set the
+   * ones needed.
+   *
+   * When prepared_schema is set, schema above is ignored. Otherwise the
+   * schema will be prepared at the start of each visit.
+   *
+   * When arena is not set, a stack allocated arena of MDP_DEFAULT_ARENA_SIZE
+   * bytes will be used.
+   *
+   * When projection is set, fields hidden by it are omitted from text.
+   *
+   * When elision is set, long byte arrays and byte vectors are elided.
+   *
+   * Zeroed budget imposes no limits.
+   *
+   * format is one of MDP_FORMAT_*, MDP_FORMAT_TEXT by default.
+   *
+   * When address_cache is set, addresses are looked up in it before being
+   * encoded. When fragment_cache is set, subtrees are looked up in it before
+   * being visited, taking a record for each level of nesting from arena.
+   */
+  const mdp_schema *prepared_schema;
+  mdp_arena *arena;
+  const mdp_projection *projection;
+  const mdp_elision *elision;
+  mdp_budget budget;
+  int format;
+  mdp_address_cache *address_cache;
+  mdp_fragment_cache *fragment_cache;
 } mdp_context;
 
+/* Zeroes all fields of context, and sets version */
+void mdp_context_initialize(mdp_context *context);
+
 /*
  * Given a molecule schema packed as a molecule-formatted Definitions
  * data structure(see schemas/definitions.mol file), this function visits
  * a piece of data generated from the given molecule schema, then generates
  * human readable text.
  *
- * This function fixates the exact format of generated text.
+ * This function fixates the exact format of generated text. Other formats
+ * can be selected by context.format.
  *
  * To cope with environments with tight memory requirements(such as CKB),
  * the generated text is feeded into a designated mdp_text_feeder_t function.
  */
 int mdp_visit(mdp_context context);
 
+/*
+ * Performs all the checks mdp_visit does against data, without generating
+ * any text. hrp, feeder and feeder_context in context are not used.
+ *
+ * This serves as a cheap way to reject malformed data, mdp_visit on data
+ * passing mdp_verify can only fail due to errors from the feeder, or an
+ * invalid hrp.
+ */
+int mdp_verify(mdp_context context);
+
+/*
+ * Calculates the exact length of the text mdp_visit generates for the same
+ * context, without generating the text. Lengths are computed arithmetically
+ * from the data, such as digit counts of numbers, or bech32m length from
+ * the size of address args. feeder and feeder_context in context are not
+ * used.
+ *
+ * This is useful when the text length is required before the text itself,
+ * such as a length-prefixed message to sign.
+ */
+int mdp_measure(mdp_context context, size_t *length);
+
+/*
+ * Tests if the text mdp_visit generates for context equals expected, such as
+ * a message supplied along with data, without keeping any text. Text is
+ * compared as it is generated, so the visit stops at the first differing
+ * chunk. MDP_ERROR_MISMATCH is returned when text and expected differ in
+ * either content or length. feeder and feeder_context in context are not
+ * used.
+ */
+int mdp_compare(mdp_context context, mol2_cursor_t expected);
+
+/*
+ * A trace records how the text of a visit is put together: literal text
+ * such as names, punctuation, numbers and addresses, and spans of data
+ * rendered as hex digits, byte lines or strings. Rendering the same data
+ * again from its trace is a linear pass over the trace, without the schema
+ * and without any of the checks on data. buffer and capacity are provided
+ * by the caller, length is the size of the recorded trace.
+ *
+ * A trace only describes the data and format it is recorded with, and can
+ * only be replayed by the same build of this library.
+ */
+typedef struct {
+  uint8_t *buffer;
+  size_t capacity;
+  size_t length;
+} mdp_trace;
+
+/*
+ * Visits like mdp_visit, recording the text generated into trace.
+ * MDP_ERROR_ARENA is returned when the capacity of trace is exceeded.
+ */
+int mdp_visit_record(mdp_context context, mdp_trace *trace);
+
+/*
+ * Regenerates the text recorded in trace, feeding it to feeder in context.
+ * Spans are read from data in context, which must be the data trace is
+ * recorded from, as it is not checked again. Only data, budget, feeder and
+ * feeder_context in context are used. MDP_ERROR_TRACE is returned when trace
+ * is malformed or refers past the end of data.
+ */
+int mdp_replay(mdp_context context, const mdp_trace *trace);
+
+/*
+ * A path locates a single value in data, it consists of segments separated
+ * by "/":
+ *
+ * * For tables and structs, a segment is the name of a field;
+ * * For unions, a segment is the name of the variant, which must match the
+ * variant in data;
+ * * For arrays, fixvecs and dynvecs, a segment is the decimal index of an
+ * item;
+ * * Options are stepped through when they have a value, no segment is used.
+ *
+ * For example, "MintSpore/to" locates the to field of a SporeAction union
+ * holding a MintSpore table. An empty path locates the whole data.
+ *
+ * Only the offsets and headers along the path are read, siblings are skipped,
+ * so the cost depends on the depth of the value rather than the size of data.
+ * The value itself is not validated.
+ */
+
+/*
+ * Locates the value at path in data. value is set to the cursor of the
+ * value. When type is not NULL, it is set to the definition index of the
+ * value in context.prepared_schema, it is only meaningful when a prepared
+ * schema is provided.
+ */
+int mdp_select(mdp_context context, const char *path, mol2_cursor_t *value,
+               uint32_t *type);
+
+/*
+ * Works like mdp_visit, but only generates text for the value at path. The
+ * text is exactly what mdp_visit generates for data holding the value alone.
+ */
+int mdp_visit_path(mdp_context context, const char *path);
+
+/*
+ * An index records where every value lives in data, so values can be located
+ * again and again without reading offsets from data. Nodes are kept in the
+ * order values are visited, a value comes before its children, which are
+ * linked from first_child through next_sibling. The top level value is node
+ * 0, MDP_INDEX_NONE marks missing links.
+ *
+ * Children of a node are the fields of a table or struct in schema order, the
+ * value of a union or of an option holding one, or the items of an array,
+ * fixvec or dynvec. Byte32, Uint64, byte arrays, byte vectors, Strings and
+ * Addresses have no children.
+ */
+#define MDP_INDEX_NONE 0xFFFFFFFF
+
+typedef struct {
+  /* Definition index in the prepared schema */
+  uint32_t type;
+  /* Offset from the start of data */
+  uint32_t offset;
+  uint32_t size;
+  uint32_t parent;
+  uint32_t first_child;
+  uint32_t next_sibling;
+} mdp_index_node;
+
+typedef struct {
+  mdp_index_node *nodes;
+  uint32_t capacity;
+  uint32_t count;
+} mdp_index;
+
+/*
+ * Validates data like mdp_verify, recording all values in index. nodes and
+ * capacity of index are provided by the caller, MDP_ERROR_ARENA is returned
+ * when data holds more values than capacity. projection in context is
+ * ignored, since hidden fields are still part of data.
+ */
+int mdp_build_index(mdp_context context, mdp_index *index);
+
+/*
+ * Locates the value at path like mdp_select, node is set to its index in
+ * nodes. Only the index is read, schema must be the prepared schema used to
+ * build it. Unlike mdp_select, single bytes of values with no children, such
+ * as Byte32, cannot be located.
+ */
+int mdp_index_select(const mdp_index *index, const mdp_schema *schema,
+                     const char *path, uint32_t *node);
+
+/*
+ * Works like mdp_visit_path, for the value at node of index built against
+ * the same data and schema. No offsets are read to locate the value.
+ */
+int mdp_visit_node(mdp_context context, const mdp_index *index, uint32_t node);
+
+/*
+ * Generates text for the differences between old_data and data in context,
+ * both holding a value of the top level type. The two are walked together,
+ * a value spanning the same bytes on both sides is skipped without reading
+ * further into it, so the cost depends on the size of the change rather than
+ * the size of data. Skipped values are not validated.
+ *
+ * Fields of tables and structs, items of arrays and vectors, and the values
+ * of unions and options are compared one by one. A change is reported at the
+ * value it is narrowed down to: a byte, Byte32, Uint64, byte array, byte
+ * vector, String or Address, a union switching variants, or an option gaining
+ * or losing its value. Items found in only one of two vectors are reported
+ * alone. Fields hidden by the projection in context are skipped.
+ *
+ * Each change starts with a "@@ " line holding the path of the value, as used
+ * by mdp_select. The old text follows with each line prefixed by "-", then
+ * the new text with each line prefixed by "+". Text of a value is what
+ * mdp_visit_path generates for it. No text is generated for equal data.
+ */
+int mdp_visit_diff(mdp_context context, mol2_cursor_t old_data);
+
+/*
+ * Structured events emitted while visiting data, the text generated by
+ * mdp_visit is produced by a built-in consumer of these events. t is the
+ * definition of the visited value, all cursors point into data. A non-zero
+ * return value aborts the visit with MDP_ERROR_FEEDER, NULL callbacks are
+ * skipped.
+ *
+ * * on_byte: a single byte, not part of a byte array or byte vector.
+ * * on_uint: a Uint64 value.
+ * * on_bytes: the content of a Byte32, byte array or byte vector.
+ * * on_string: the content of a String, already validated as utf8.
+ * * on_address: an Address, args is the molecule Bytes including its 4 bytes
+ * length.
+ * * on_option_begin, on_option_end: some is 0 for None, in which case no
+ * value comes in between.
+ * * on_union_begin, on_union_end: around the value of variant.
+ * * on_struct_begin, on_struct_end, on_table_begin, on_table_end: around
+ * fields, each shown field comes between on_field and on_field_end. position
+ * counts shown fields, on_table_end receives the number of shown fields.
+ * * on_vector_begin, on_vector_end: arrays, fixvecs and dynvecs of non-byte
+ * items, on_item comes before each item.
+ * * on_finish: after the whole value is visited.
+ */
+typedef struct {
+  int (*on_byte)(void *context, const mdp_definition *t, uint8_t value);
+  int (*on_uint)(void *context, const mdp_definition *t, uint64_t value);
+  int (*on_bytes)(void *context, const mdp_definition *t, mol2_cursor_t value);
+  int (*on_string)(void *context, const mdp_definition *t,
+                   mol2_cursor_t value);
+  int (*on_address)(void *context, const mdp_definition *t,
+                    mol2_cursor_t code_hash, mol2_cursor_t hash_type,
+                    mol2_cursor_t args);
+  int (*on_option_begin)(void *context, const mdp_definition *t, int some);
+  int (*on_option_end)(void *context, const mdp_definition *t, int some);
+  int (*on_union_begin)(void *context, const mdp_definition *t,
+                        const mdp_field *variant);
+  int (*on_union_end)(void *context, const mdp_definition *t);
+  int (*on_struct_begin)(void *context, const mdp_definition *t);
+  int (*on_struct_end)(void *context, const mdp_definition *t);
+  int (*on_table_begin)(void *context, const mdp_definition *t);
+  int (*on_table_end)(void *context, const mdp_definition *t, uint32_t shown);
+  int (*on_field)(void *context, const mdp_definition *t,
+                  const mdp_field *field, uint32_t position);
+  int (*on_field_end)(void *context, const mdp_definition *t,
+                      const mdp_field *field);
+  int (*on_vector_begin)(void *context, const mdp_definition *t,
+                         uint32_t count);
+  int (*on_item)(void *context, const mdp_definition *t, uint32_t index);
+  int (*on_vector_end)(void *context, const mdp_definition *t,
+                       uint32_t count);
+  int (*on_finish)(void *context);
+} mdp_events;
+
+/*
+ * Works like mdp_visit, but reports events to events instead of generating
+ * text. hrp, feeder and feeder_context in context are not used. Hidden
+ * fields of projection emit no events, elision does not apply.
+ */
+int mdp_visit_events(mdp_context context, const mdp_events *events,
+                     void *events_context);
+
+/*
+ * Receives the results of a batch visit, text of each item is fed to the
+ * feeder in context between begin and end of the item. A non-zero return
+ * value aborts the batch with MDP_ERROR_FEEDER, NULL callbacks are skipped.
+ */
+typedef struct {
+  int (*begin)(void *batch_context, size_t item);
+  /* result is MDP_OK, or the error visiting the item */
+  int (*end)(void *batch_context, size_t item, int result);
+  void *batch_context;
+} mdp_batch_sink;
+
+/*
+ * Visits count items of data, each works like mdp_visit with context.data
+ * set to the item. The schema is loaded and memory is allocated from arena
+ * once for all items, and cached data is kept between items from the same
+ * data source. An item failing to visit does not stop the batch, as with
+ * mdp_visit, part of its text may have been fed before the error.
+ */
+int mdp_visit_batch(mdp_context context, const mol2_cursor_t *items,
+                    size_t count, const mdp_batch_sink *sink);
+
+#ifdef MDP_PARALLEL
+/*
+ * Works like mdp_visit, except that the items of each fixvec or dynvec with
+ * at least min_items items are split into parts, rendered by up to threads
+ * threads in parallel. Each part is rendered into its own buffer, then fed in
+ * order, so the text is byte identical to mdp_visit. Items of a vector being
+ * split are visited serially, even when they contain large vectors.
+ *
+ * Only available when MDP_PARALLEL is defined, since pthreads and malloc are
+ * required. Each part takes MDP_DEFAULT_ARENA_SIZE bytes plus its text.
+ * No vector is split when context has a non-zero budget, which is enforced
+ * in visiting order, or elision, whose hasher context is used by one thread
+ * at a time, as well as when MDP_DATA_CACHE_SIZE is 0.
+ *
+ * Parts read data through copies of the data source of context.data, calling
+ * its read function with the same args from several threads. Vectors are
+ * only split when data is read by mol2_source_memory, which keeps no state,
+ * other read functions are called by one thread at a time as usual.
+ */
+int mdp_visit_parallel(mdp_context context, uint32_t threads,
+                       uint32_t min_items);
+#endif
+
+/*
+ * A visit in pull mode, where the caller asks for text in chunks instead of
+ * receiving it through a feeder. All state lives in context.arena, which is
+ * required, so memory use does not grow with the size of data.
+ */
+typedef struct {
+  void *state;
+  mdp_arena *arena;
+  size_t mark;
+} mdp_pull;
+
+/*
+ * Starts a visit in pull mode. feeder and feeder_context in context are not
+ * used. On success, mdp_visit_end must be called once the visit is no longer
+ * needed, so the arena is released.
+ */
+int mdp_visit_begin(mdp_pull *pull, mdp_context context);
+
+/*
+ * Starts a visit in pull mode on data arriving in chunks, such as from a
+ * network connection. context.data is not used, size is the total size of
+ * data, which is then passed in order to mdp_visit_feed. Paths are not
+ * supported.
+ *
+ * Only data that may still be read is buffered: the remaining offsets in
+ * headers of the tables and dynvecs being visited, and data not visited yet.
+ * window bytes are allocated for them from context.arena. Values printed in
+ * one go, such as byte vectors and addresses, are read as a whole, so window
+ * must hold the largest of them plus a chunk.
+ */
+int mdp_visit_begin_stream(mdp_pull *pull, mdp_context context, uint32_t size,
+                           size_t window);
+
+/*
+ * Appends the next chunk of data to a visit started by
+ * mdp_visit_begin_stream. Pull text with mdp_visit_next until it returns
+ * MDP_NEED_DATA before feeding the next chunk, so data no longer needed is
+ * released. Fails with MDP_ERROR_ARENA when window cannot hold chunk.
+ */
+int mdp_visit_feed(mdp_pull *pull, const uint8_t *chunk, size_t length);
+
+/*
+ * Fills buffer with the next chunk of text, resuming exactly where the
+ * previous call stopped. length is set to the bytes written, which is only
+ * less than capacity for the final chunk, and 0 once all text is pulled.
+ * capacity must not be 0.
+ *
+ * For visits started by mdp_visit_begin_stream, MDP_NEED_DATA is returned
+ * when text cannot advance until more data is fed, length is still set to
+ * the bytes written.
+ *
+ * Text is produced in steps, a step interrupted by a full buffer is replayed
+ * by the next call, skipping the text already delivered. Buffers much
+ * smaller than a line of text therefore repeat work, especially for elided
+ * values which are digested again on each replay.
+ *
+ * Errors are sticky, once an error is returned, all following calls return
+ * the same error. Concatenating all chunks of a successful visit gives the
+ * exact text mdp_visit generates.
+ */
+int mdp_visit_next(mdp_pull *pull, uint8_t *buffer, size_t capacity,
+                   size_t *length);
+
+/* Releases the memory used by a visit in pull mode */
+void mdp_visit_end(mdp_pull *pull);
+
 /*
  * ----------------------------------------------------------------------
  * Common (Tweakable) Definitions
@@ -61,14 +829,50 @@ int mdp_visit(mdp_context context);
 #define MDP_BUFFER_LEN 1024
 #endif
 
-#ifndef MDP_VSNPRINTF
-#define MDP_VSNPRINTF vsnprintf
-#endif
-
 #ifndef MDP_VALIDATE_UTF8
 #define MDP_VALIDATE_UTF8 utf8_check
 #endif
 
+#ifndef MDP_DEFAULT_ARENA_SIZE
+#define MDP_DEFAULT_ARENA_SIZE 16384
+#endif
+
+#ifndef MDP_ARENA_ALIGNMENT
+#define MDP_ARENA_ALIGNMENT 8
+#endif
+
+/* Output text is batched in a buffer of this size before hitting feeder */
+#ifndef MDP_OUTPUT_BUFFER_LEN
+#define MDP_OUTPUT_BUFFER_LEN MDP_BUFFER_LEN
+#endif
+
+/*
+ * Cache size of the data source used when reading data, must be no less
+ * than MIN_CACHE_SIZE. Use 0 to read from the data source provided in
+ * context directly.
+ */
+#ifndef MDP_DATA_CACHE_SIZE
+#define MDP_DATA_CACHE_SIZE MAX_CACHE_SIZE
+#endif
+
+/* Length of digests used by mdp_elision */
+#ifndef MDP_DIGEST_LEN
+#define MDP_DIGEST_LEN 32
+#endif
+
+/* Longest path reported by mdp_visit_diff, longer ones fail the diff */
+#ifndef MDP_DIFF_PATH_LEN
+#define MDP_DIFF_PATH_LEN 256
+#endif
+
+/*
+ * Maximum frame depth used for schemas containing recursive types, for
+ * other schemas, the exact depth is calculated from the schema.
+ */
+#ifndef MDP_MAX_DEPTH
+#define MDP_MAX_DEPTH 128
+#endif
+
 /*
  * One can tweak this macro for more behaviors, such as saving current
  * __LINE__ macro to a certain place for more debugging hints.
@@ -95,6 +899,15 @@ int mdp_visit(mdp_context context);
 #define MDP_ERROR_SCHEMA_ENCODING (MDP_ERROR_BASE_CODE + 3)
 #define MDP_ERROR_SNPRINTF (MDP_ERROR_BASE_CODE + 4)
 #define MDP_ERROR_BECH32M (MDP_ERROR_BASE_CODE + 5)
+#define MDP_ERROR_ARENA (MDP_ERROR_BASE_CODE + 6)
+#define MDP_ERROR_PATH_NOT_FOUND (MDP_ERROR_BASE_CODE + 7)
+#define MDP_ERROR_HASHER (MDP_ERROR_BASE_CODE + 8)
+#define MDP_ERROR_BUDGET (MDP_ERROR_BASE_CODE + 9)
+/* Not an error, see mdp_visit_next */
+#define MDP_NEED_DATA (MDP_ERROR_BASE_CODE + 10)
+#define MDP_ERROR_FORMAT (MDP_ERROR_BASE_CODE + 11)
+#define MDP_ERROR_MISMATCH (MDP_ERROR_BASE_CODE + 12)
+#define MDP_ERROR_TRACE (MDP_ERROR_BASE_CODE + 13)
 
 /*
  * ----------------------------------------------------------------------
@@ -108,52 +921,230 @@ void _mdp_debug_print_cursor(mol2_cursor_t v, const char *prefix) {
   MDP_DEBUG("%s%s\n", prefix, buf);
 }
 
-int _mdp_cursor_cmp(mol2_cursor_t a, mol2_cursor_t b, int *result) {
-  if (a.size != b.size) {
-    *result = a.size - b.size;
+void mdp_arena_initialize(mdp_arena *arena, void *buffer, size_t size) {
+  arena->buffer = (uint8_t *)buffer;
+  arena->size = size;
+  arena->used = 0;
+  arena->last_used = 0;
+  arena->high_water = 0;
+}
+
+void *mdp_arena_alloc(mdp_arena *arena, size_t size) {
+  uintptr_t start = (uintptr_t)arena->buffer + arena->used;
+  size_t padding = (MDP_ARENA_ALIGNMENT - (start % MDP_ARENA_ALIGNMENT)) %
+                   MDP_ARENA_ALIGNMENT;
+  if (padding > arena->size - arena->used ||
+      size > arena->size - arena->used - padding) {
+    MDP_DEBUG("Arena of %lu bytes cannot allocate %lu more bytes!\n",
+              (unsigned long)arena->size, (unsigned long)size);
+    return NULL;
+  }
+  void *p = &arena->buffer[arena->used + padding];
+  arena->used += padding + size;
+  if (arena->used > arena->high_water) {
+    arena->high_water = arena->used;
+  }
+  return p;
+}
+
+int mdp_tee_feeder(const uint8_t *data, size_t length, void *feeder_context) {
+  mdp_tee *tee = (mdp_tee *)feeder_context;
+  for (size_t i = 0; i < tee->count; i++) {
+    mdp_tee_branch *branch = &tee->branches[i];
+    branch->result = branch->feeder(data, length, branch->feeder_context);
+    if (branch->result != 0) {
+      MDP_DEBUG("Tee branch %lu fails with %d\n", (unsigned long)i,
+                branch->result);
+      return branch->result;
+    }
+  }
+  return 0;
+}
+
+int mdp_comparator_feeder(const uint8_t *data, size_t length,
+                          void *feeder_context) {
+  mdp_comparator *comparator = (mdp_comparator *)feeder_context;
+  if (length > comparator->expected.size) {
+    MDP_DEBUG("Text runs past the end of expected!\n");
+    comparator->result = MDP_ERROR_MISMATCH;
+    return comparator->result;
+  }
+  uint8_t buf[MDP_BUFFER_LEN];
+  while (length > 0) {
+    uint32_t read = mol2_read_at(
+        &comparator->expected, buf,
+        length < MDP_BUFFER_LEN ? (uint32_t)length : MDP_BUFFER_LEN);
+    if (read == 0) {
+      comparator->result = MDP_ERROR_MOL2_IO;
+      return comparator->result;
+    }
+    if (memcmp(buf, data, read) != 0) {
+      MDP_DEBUG("Text differs from expected!\n");
+      comparator->result = MDP_ERROR_MISMATCH;
+      return comparator->result;
+    }
+    data += read;
+    length -= read;
+    mol2_add_offset(&comparator->expected, read);
+    mol2_sub_size(&comparator->expected, read);
+  }
+  return 0;
+}
+
+/* Tests if the content of a cursor equals to the provided bytes */
+int _mdp_cursor_equals(mol2_cursor_t a, const uint8_t *b, uint32_t b_length,
+                       int *result) {
+  if (a.size != b_length) {
+    *result = 0;
     return MDP_OK;
   }
 
-  uint8_t buf_a[MDP_BUFFER_LEN];
-  uint8_t buf_b[MDP_BUFFER_LEN];
+  uint8_t buf[MDP_BUFFER_LEN];
   while (a.size > 0) {
-    uint32_t read_a = mol2_read_at(&a, buf_a, MDP_BUFFER_LEN);
-    if (read_a == 0) {
+    uint32_t read = mol2_read_at(&a, buf, MDP_BUFFER_LEN);
+    if (read == 0) {
       return MDP_ERROR_MOL2_IO;
     }
-    uint32_t read_b = mol2_read_at(&b, buf_b, MDP_BUFFER_LEN);
-    if (read_b == 0) {
-      return MDP_ERROR_MOL2_IO;
+    if (memcmp(buf, b, read) != 0) {
+      *result = 0;
+      return MDP_OK;
     }
-    if (read_a != read_b) {
-      MDP_DEBUG("Cursor cmp reads different length of data from 2 cursors!\n");
+    b += read;
+    mol2_add_offset(&a, read);
+    mol2_sub_size(&a, read);
+  }
+
+  *result = 1;
+  return MDP_OK;
+}
+
+/* Compares the bytes of two cursors, which may use different data sources */
+int _mdp_cursors_equal(mol2_cursor_t a, mol2_cursor_t b, int *result) {
+  if (a.size != b.size) {
+    *result = 0;
+    return MDP_OK;
+  }
+
+  uint8_t a_buf[MDP_BUFFER_LEN];
+  uint8_t b_buf[MDP_BUFFER_LEN];
+  while (a.size > 0) {
+    uint32_t read = mol2_read_at(&a, a_buf, MDP_BUFFER_LEN);
+    if (read == 0 || mol2_read_at(&b, b_buf, read) != read) {
       return MDP_ERROR_MOL2_IO;
     }
-
-    int ret = memcmp(buf_a, buf_b, read_a);
-    if (ret != 0) {
-      *result = ret;
+    if (memcmp(a_buf, b_buf, read) != 0) {
+      *result = 0;
       return MDP_OK;
     }
-
-    mol2_add_offset(&a, read_a);
-    mol2_sub_size(&a, read_a);
-    mol2_add_offset(&b, read_b);
-    mol2_sub_size(&b, read_b);
+    mol2_add_offset(&a, read);
+    mol2_sub_size(&a, read);
+    mol2_add_offset(&b, read);
+    mol2_sub_size(&b, read);
   }
 
-  *result = 0;
+  *result = 1;
   return MDP_OK;
 }
 
-int _mdp_cursor_s_cmp(mol2_cursor_t a, const char *s, int *result) {
-  mol2_cursor_t b = mol2_make_cursor_from_memory(s, strlen(s));
-  return _mdp_cursor_cmp(a, b, result);
+int _mdp_bytes_equals(const uint8_t *a, uint32_t a_length, const char *s) {
+  size_t length = strlen(s);
+  return (a_length == length) && (memcmp(a, s, length) == 0);
 }
 
-int _mdp_find_union(struct UnionDefinitionType *t, mol2_num_t union_id,
-                    struct UnionPairType *out) {
-  struct UnionPairVecType vec = t->t->items(t);
+/*
+ * ----------------------------------------------------------------------
+ * Schema preparation
+ * ----------------------------------------------------------------------
+ */
+int _mdp_arena_copy_cursor(mdp_arena *arena, mol2_cursor_t c,
+                           const uint8_t **out, uint32_t *out_length) {
+  uint8_t *p = (uint8_t *)mdp_arena_alloc(arena, c.size);
+  if (p == NULL) {
+    return MDP_ERROR_ARENA;
+  }
+  *out = p;
+  *out_length = c.size;
+  while (c.size > 0) {
+    uint32_t read = mol2_read_at(&c, p, c.size);
+    if (read == 0) {
+      return MDP_ERROR_MOL2_IO;
+    }
+    p += read;
+    mol2_add_offset(&c, read);
+    mol2_sub_size(&c, read);
+  }
+  return MDP_OK;
+}
+
+/*
+ * Looks up a type name in the same way as the molecule compiler: byte is
+ * always the primitive type, otherwise the first definition with a matching
+ * name wins.
+ */
+int _mdp_resolve_type(const mdp_definition *definitions,
+                      uint32_t definition_count, mol2_cursor_t name,
+                      uint32_t *out) {
+  // Short names are read only once
+  uint8_t buf[MDP_BUFFER_LEN];
+  int buffered = 0;
+  if (name.size <= MDP_BUFFER_LEN) {
+    if (mol2_read_at(&name, buf, name.size) != name.size) {
+      return MDP_ERROR_MOL2_IO;
+    }
+    buffered = 1;
+  }
+  for (uint32_t i = 0; i < definition_count; i++) {
+    int match = 0;
+    if (buffered) {
+      match = (definitions[i].name_length == name.size) &&
+              (memcmp(definitions[i].name, buf, name.size) == 0);
+    } else {
+      int ret = _mdp_cursor_equals(name, definitions[i].name,
+                                   definitions[i].name_length, &match);
+      if (ret != MDP_OK) {
+        return ret;
+      }
+    }
+    if (match) {
+      *out = i;
+      return MDP_OK;
+    }
+  }
+  *out = MDP_TYPE_UNRESOLVED;
+  return MDP_OK;
+}
+
+int _mdp_prepare_fields(mdp_arena *arena, mdp_definition *definitions,
+                        uint32_t definition_count, struct FieldPairVecType vec,
+                        mdp_field *fields) {
+  for (uint32_t i = 0; i < vec.t->len(&vec); i++) {
+    bool found = false;
+    struct FieldPairType pair = vec.t->get(&vec, i, &found);
+    if (!found) {
+      MDP_DEBUG(
+          "Field definition has %u entries but accessing entry %u results in "
+          "failure\n",
+          vec.t->len(&vec), i);
+      return MDP_ERROR_SCHEMA_ENCODING;
+    }
+    int ret = _mdp_arena_copy_cursor(arena, pair.t->name(&pair),
+                                     &fields[i].name, &fields[i].name_length);
+    if (ret != MDP_OK) {
+      return ret;
+    }
+    ret = _mdp_resolve_type(definitions, definition_count, pair.t->typ(&pair),
+                            &fields[i].type);
+    if (ret != MDP_OK) {
+      return ret;
+    }
+    fields[i].id = 0;
+  }
+  return MDP_OK;
+}
+
+int _mdp_prepare_variants(mdp_arena *arena, mdp_definition *definitions,
+                          uint32_t definition_count,
+                          struct UnionPairVecType vec, mdp_field *fields) {
   for (uint32_t i = 0; i < vec.t->len(&vec); i++) {
     bool found = false;
     struct UnionPairType pair = vec.t->get(&vec, i, &found);
@@ -164,1072 +1155,4863 @@ int _mdp_find_union(struct UnionDefinitionType *t, mol2_num_t union_id,
           vec.t->len(&vec), i);
       return MDP_ERROR_SCHEMA_ENCODING;
     }
-    uint64_t id = pair.t->id(&pair);
-    if (id == (uint64_t)union_id) {
-      *out = pair;
-      return MDP_OK;
+    int ret = _mdp_arena_copy_cursor(arena, pair.t->typ(&pair),
+                                     &fields[i].name, &fields[i].name_length);
+    if (ret != MDP_OK) {
+      return ret;
+    }
+    ret = _mdp_resolve_type(definitions, definition_count, pair.t->typ(&pair),
+                            &fields[i].type);
+    if (ret != MDP_OK) {
+      return ret;
+    }
+    fields[i].id = pair.t->id(&pair);
+  }
+  return MDP_OK;
+}
+
+#define _MDP_DEPTH_IN_PROGRESS 0xFFFFFFFF
+
+/*
+ * Calculates the number of frames needed to visit a type. Returns 0 when
+ * the type is recursive.
+ */
+uint32_t _mdp_calculate_depth(mdp_definition *definitions,
+                              const mdp_field *fields, uint32_t type) {
+  mdp_definition *d = &definitions[type];
+  if (d->depth == _MDP_DEPTH_IN_PROGRESS) {
+    return 0;
+  }
+  if (d->depth != 0) {
+    return d->depth;
+  }
+  d->depth = _MDP_DEPTH_IN_PROGRESS;
+  uint32_t children = 0;
+  switch (d->kind) {
+    case MDP_KIND_OPTION:
+    case MDP_KIND_ARRAY:
+    case MDP_KIND_FIXVEC:
+    case MDP_KIND_DYNVEC: {
+      if (d->item != MDP_TYPE_UNRESOLVED) {
+        children = _mdp_calculate_depth(definitions, fields, d->item);
+        if (children == 0) {
+          return 0;
+        }
+      }
+    } break;
+    case MDP_KIND_UNION:
+    case MDP_KIND_STRUCT:
+    case MDP_KIND_TABLE: {
+      for (uint32_t i = 0; i < d->field_count; i++) {
+        uint32_t field_type = fields[d->first_field + i].type;
+        if (field_type == MDP_TYPE_UNRESOLVED) {
+          continue;
+        }
+        uint32_t depth = _mdp_calculate_depth(definitions, fields, field_type);
+        if (depth == 0) {
+          return 0;
+        }
+        if (depth > children) {
+          children = depth;
+        }
+      }
+    } break;
+    default:
+      break;
+  }
+  d->depth = children + 1;
+  return d->depth;
+}
+
+#define _MDP_FIXED_SIZE_IN_PROGRESS 0xFFFFFFFF
+
+/*
+ * Calculates the size of a fixed size type. Returns 0 for other types, as
+ * well as recursive or oversized ones.
+ */
+uint32_t _mdp_calculate_fixed_size(mdp_definition *definitions,
+                                   const mdp_field *fields, uint32_t type) {
+  if (type == MDP_TYPE_UNRESOLVED) {
+    return 0;
+  }
+  mdp_definition *d = &definitions[type];
+  if (d->fixed_size == _MDP_FIXED_SIZE_IN_PROGRESS) {
+    return 0;
+  }
+  if (d->fixed_size != 0) {
+    return d->fixed_size;
+  }
+  uint64_t size = 0;
+  d->fixed_size = _MDP_FIXED_SIZE_IN_PROGRESS;
+  switch (d->kind) {
+    case MDP_KIND_BYTE: {
+      size = 1;
+    } break;
+    case MDP_KIND_ARRAY: {
+      uint64_t item_size =
+          _mdp_calculate_fixed_size(definitions, fields, d->item);
+      if (d->item_count <= 0xFFFFFFFF) {
+        size = item_size * d->item_count;
+      }
+    } break;
+    case MDP_KIND_STRUCT: {
+      for (uint32_t i = 0; i < d->field_count; i++) {
+        uint64_t field_size = _mdp_calculate_fixed_size(
+            definitions, fields, fields[d->first_field + i].type);
+        if (field_size == 0) {
+          size = 0;
+          break;
+        }
+        size += field_size;
+      }
+    } break;
+    default:
+      break;
+  }
+  if (size >= _MDP_FIXED_SIZE_IN_PROGRESS) {
+    size = 0;
+  }
+  d->fixed_size = (uint32_t)size;
+  return d->fixed_size;
+}
+
+int _mdp_prepare_schema(mdp_arena *arena, mol2_cursor_t schema,
+                        mdp_schema *out) {
+  struct DefinitionsType defs = make_Definitions(&schema);
+  uint64_t syntax_version = defs.t->syntax_version(&defs);
+  if (syntax_version != 1) {
+    MDP_DEBUG("Expected syntax version: %d, actual syntax version: %ld\n", 1,
+              syntax_version);
+    return MDP_ERROR_SCHEMA_ENCODING;
+  }
+
+  struct DefinitionVecType vec = defs.t->definitions(&defs);
+  uint32_t definition_count = vec.t->len(&vec) + 1;
+  mdp_definition *definitions = (mdp_definition *)mdp_arena_alloc(
+      arena, sizeof(mdp_definition) * definition_count);
+  if (definitions == NULL) {
+    return MDP_ERROR_ARENA;
+  }
+  memset(definitions, 0, sizeof(mdp_definition) * definition_count);
+  definitions[MDP_TYPE_BYTE].name = (const uint8_t *)"byte";
+  definitions[MDP_TYPE_BYTE].name_length = 4;
+  definitions[MDP_TYPE_BYTE].kind = MDP_KIND_BYTE;
+
+  // The first pass gathers names, so types can be resolved in the second pass
+  uint32_t field_count = 0;
+  for (uint32_t i = 1; i < definition_count; i++) {
+    bool found = false;
+    struct DefinitionType d = vec.t->get(&vec, i - 1, &found);
+    if (!found) {
+      MDP_DEBUG(
+          "Definitions have %u entries but accessing entry %u results in "
+          "failure\n",
+          definition_count - 1, i - 1);
+      return MDP_ERROR_SCHEMA_ENCODING;
+    }
+    mdp_definition *t = &definitions[i];
+    mol2_cursor_t name;
+    switch (d.t->item_id(&d)) {
+      case 0: {
+        struct OptionDefinitionType dt = d.t->as_OptionDefinition(&d);
+        t->kind = MDP_KIND_OPTION;
+        name = dt.t->name(&dt);
+      } break;
+      case 1: {
+        struct UnionDefinitionType dt = d.t->as_UnionDefinition(&d);
+        struct UnionPairVecType items = dt.t->items(&dt);
+        t->kind = MDP_KIND_UNION;
+        t->field_count = items.t->len(&items);
+        name = dt.t->name(&dt);
+      } break;
+      case 2: {
+        struct ArrayDefinitionType dt = d.t->as_ArrayDefinition(&d);
+        t->kind = MDP_KIND_ARRAY;
+        t->item_count = dt.t->item_count(&dt);
+        name = dt.t->name(&dt);
+      } break;
+      case 3: {
+        struct StructDefinitionType dt = d.t->as_StructDefinition(&d);
+        struct FieldPairVecType fields = dt.t->fields(&dt);
+        t->kind = MDP_KIND_STRUCT;
+        t->field_count = fields.t->len(&fields);
+        name = dt.t->name(&dt);
+      } break;
+      case 4: {
+        struct FixvecDefinitionType dt = d.t->as_FixvecDefinition(&d);
+        t->kind = MDP_KIND_FIXVEC;
+        name = dt.t->name(&dt);
+      } break;
+      case 5: {
+        struct DynvecDefinitionType dt = d.t->as_DynvecDefinition(&d);
+        t->kind = MDP_KIND_DYNVEC;
+        name = dt.t->name(&dt);
+      } break;
+      case 6: {
+        struct TableDefinitionType dt = d.t->as_TableDefinition(&d);
+        struct FieldPairVecType fields = dt.t->fields(&dt);
+        t->kind = MDP_KIND_TABLE;
+        t->field_count = fields.t->len(&fields);
+        name = dt.t->name(&dt);
+      } break;
+      default: {
+        MDP_DEBUG("Invalid union for Definitions id: %u", d.t->item_id(&d));
+        return MDP_ERROR_SCHEMA_ENCODING;
+      } break;
+    }
+    int ret = _mdp_arena_copy_cursor(arena, name, &t->name, &t->name_length);
+    if (ret != MDP_OK) {
+      return ret;
+    }
+    t->first_field = field_count;
+    field_count += t->field_count;
+  }
+
+  mdp_field *fields =
+      (mdp_field *)mdp_arena_alloc(arena, sizeof(mdp_field) * field_count);
+  if (fields == NULL && field_count > 0) {
+    return MDP_ERROR_ARENA;
+  }
+  for (uint32_t i = 1; i < definition_count; i++) {
+    bool found = false;
+    struct DefinitionType d = vec.t->get(&vec, i - 1, &found);
+    mdp_definition *t = &definitions[i];
+    mol2_cursor_t item = {0};
+    int ret = MDP_OK;
+    switch (t->kind) {
+      case MDP_KIND_OPTION: {
+        struct OptionDefinitionType dt = d.t->as_OptionDefinition(&d);
+        item = dt.t->item(&dt);
+      } break;
+      case MDP_KIND_UNION: {
+        struct UnionDefinitionType dt = d.t->as_UnionDefinition(&d);
+        ret = _mdp_prepare_variants(arena, definitions, definition_count,
+                                    dt.t->items(&dt), &fields[t->first_field]);
+        if (_mdp_bytes_equals(t->name, t->name_length, "Address")) {
+          t->builtin = MDP_BUILTIN_ADDRESS;
+        }
+      } break;
+      case MDP_KIND_ARRAY: {
+        struct ArrayDefinitionType dt = d.t->as_ArrayDefinition(&d);
+        item = dt.t->item(&dt);
+        if (_mdp_bytes_equals(t->name, t->name_length, "Byte32")) {
+          t->builtin = MDP_BUILTIN_BYTE32;
+        } else if (_mdp_bytes_equals(t->name, t->name_length, "Uint64")) {
+          t->builtin = MDP_BUILTIN_UINT64;
+        }
+      } break;
+      case MDP_KIND_STRUCT: {
+        struct StructDefinitionType dt = d.t->as_StructDefinition(&d);
+        ret = _mdp_prepare_fields(arena, definitions, definition_count,
+                                  dt.t->fields(&dt), &fields[t->first_field]);
+      } break;
+      case MDP_KIND_FIXVEC: {
+        struct FixvecDefinitionType dt = d.t->as_FixvecDefinition(&d);
+        item = dt.t->item(&dt);
+        if (_mdp_bytes_equals(t->name, t->name_length, "String")) {
+          t->builtin = MDP_BUILTIN_STRING;
+        }
+      } break;
+      case MDP_KIND_DYNVEC: {
+        struct DynvecDefinitionType dt = d.t->as_DynvecDefinition(&d);
+        item = dt.t->item(&dt);
+      } break;
+      case MDP_KIND_TABLE: {
+        struct TableDefinitionType dt = d.t->as_TableDefinition(&d);
+        ret = _mdp_prepare_fields(arena, definitions, definition_count,
+                                  dt.t->fields(&dt), &fields[t->first_field]);
+      } break;
+    }
+    if (ret != MDP_OK) {
+      return ret;
+    }
+    if (t->kind == MDP_KIND_OPTION || t->kind == MDP_KIND_ARRAY ||
+        t->kind == MDP_KIND_FIXVEC || t->kind == MDP_KIND_DYNVEC) {
+      ret = _mdp_resolve_type(definitions, definition_count, item, &t->item);
+      if (ret != MDP_OK) {
+        return ret;
+      }
+    }
+  }
+
+  uint32_t top_level_type = MDP_TYPE_UNRESOLVED;
+  int ret = _mdp_resolve_type(definitions, definition_count,
+                              defs.t->top_level_type(&defs), &top_level_type);
+  if (ret != MDP_OK) {
+    return ret;
+  }
+
+  for (uint32_t i = 0; i < definition_count; i++) {
+    _mdp_calculate_fixed_size(definitions, fields, i);
+  }
+
+  uint32_t max_depth = MDP_MAX_DEPTH;
+  if (top_level_type != MDP_TYPE_UNRESOLVED) {
+    max_depth = _mdp_calculate_depth(definitions, fields, top_level_type);
+    if (max_depth == 0) {
+      // Recursive types are involved, the depth can only be checked at
+      // runtime.
+      for (uint32_t i = 0; i < definition_count; i++) {
+        definitions[i].depth = 0;
+      }
+      max_depth = MDP_MAX_DEPTH;
+    }
+  }
+
+  out->definitions = definitions;
+  out->definition_count = definition_count;
+  out->fields = fields;
+  out->field_count = field_count;
+  out->top_level_type = top_level_type;
+  out->max_depth = max_depth;
+  return MDP_OK;
+}
+
+int mdp_prepare_schema(mdp_arena *arena, mol2_cursor_t schema,
+                       mdp_schema *out) {
+  size_t mark = arena->used;
+  int ret = _mdp_prepare_schema(arena, schema, out);
+  arena->last_used = arena->used - mark;
+  if (ret != MDP_OK) {
+    arena->used = mark;
+  }
+  return ret;
+}
+
+int mdp_projection_initialize(mdp_arena *arena, const mdp_schema *schema,
+                              mdp_projection *out) {
+  size_t size = (schema->field_count + 7) / 8;
+  uint8_t *hidden = (uint8_t *)mdp_arena_alloc(arena, size);
+  if (hidden == NULL && size > 0) {
+    return MDP_ERROR_ARENA;
+  }
+  // A schema with no fields needs no bitmap, hidden may be NULL
+  if (size > 0) {
+    memset(hidden, 0, size);
+  }
+  out->hidden = hidden;
+  out->skip_hidden = 0;
+  return MDP_OK;
+}
+
+int mdp_projection_hide(mdp_projection *projection, const mdp_schema *schema,
+                        const char *definition, const char *field) {
+  for (uint32_t i = 0; i < schema->definition_count; i++) {
+    const mdp_definition *t = &schema->definitions[i];
+    if ((t->kind != MDP_KIND_STRUCT && t->kind != MDP_KIND_TABLE) ||
+        !_mdp_bytes_equals(t->name, t->name_length, definition)) {
+      continue;
+    }
+    for (uint32_t j = 0; j < t->field_count; j++) {
+      uint32_t index = t->first_field + j;
+      const mdp_field *f = &schema->fields[index];
+      if (_mdp_bytes_equals(f->name, f->name_length, field)) {
+        projection->hidden[index / 8] |= (uint8_t)(1 << (index % 8));
+        return MDP_OK;
+      }
+    }
+  }
+  MDP_DEBUG("Field %s of %s cannot be found!\n", field, definition);
+  return MDP_ERROR_PATH_NOT_FOUND;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ * Visitor
+ * ----------------------------------------------------------------------
+ */
+#define _MDP_PHASE_ENTER 0
+#define _MDP_PHASE_RESUME 1
+
+/*
+ * Visiting state of a single molecule value. Containers are resumed once
+ * each child finishes, the size consumed by the finished child is kept in
+ * _mdp_inner.
+ */
+typedef struct {
+  uint32_t type;
+  uint32_t phase;
+  mol2_cursor_t value;
+  mol2_num_t index;
+  mol2_num_t count;
+  mol2_num_t full_size;
+  mol2_num_t total_consumed;
+  /* Exact size of the child being visited, used by table and dynvec */
+  mol2_num_t expected;
+  /* Number of fields not hidden by projection, used by table */
+  mol2_num_t shown;
+  /* Node recording this value, when an index is built */
+  uint32_t node;
+} _mdp_frame;
+
+#define _MDP_OUTPUT_FEEDER 0
+#define _MDP_OUTPUT_NONE 1
+#define _MDP_OUTPUT_MEASURE 2
+/* Text is written to the caller's buffer, see mdp_visit_next */
+#define _MDP_OUTPUT_PULL 3
+/* Events are reported to the caller instead of generating text */
+#define _MDP_OUTPUT_EVENTS 4
+
+/*
+ * Set as last_error in pull mode once the caller's buffer is full, so the
+ * current step unwinds like on errors.
+ */
+#define _MDP_SUSPEND (-1)
+
+/*
+ * Stops the step once a read has failed the visit, a streaming visit reading
+ * data not received yet gets zeros, which must not be validated
+ */
+#define _MDP_CHECK_READ()              \
+  do {                                 \
+    if (inner->last_error != MDP_OK) { \
+      return inner->last_error;        \
+    }                                  \
+  } while (0)
+
+#define _MDP_HEX_DIGITS "0123456789abcdef"
+
+/*
+ * Ops of mdp_trace. Each op is a byte followed by 32 bit operands: literal
+ * has its length followed by the text, indent has the indent levels, all
+ * other ops have the offset and size of a span in data, byte lines also
+ * has indent levels shifted left by 1, with the lowest bit set for more.
+ * Addresses are kept as literal text, sparing bech32m encoding on replay.
+ */
+#define _MDP_TRACE_LITERAL 0
+#define _MDP_TRACE_INDENT 1
+#define _MDP_TRACE_RAW 2
+#define _MDP_TRACE_HEX 3
+#define _MDP_TRACE_ESCAPED 4
+#define _MDP_TRACE_BYTE_LINES 5
+
+/*
+ * A subtree missing from the fragment cache, whose text is captured while it
+ * is visited. Positions count text and indent marks captured since the
+ * outermost capture started.
+ */
+typedef struct {
+  mol2_cursor_t span;
+  uint64_t hash;
+  uint32_t frame;
+  /* Indent levels the subtree starts at */
+  uint32_t levels;
+  size_t text;
+  size_t mark;
+  uint64_t nodes;
+  uint32_t deepest;
+  /* Set once the text of the subtree no longer fits in scratch */
+  int dropped;
+} _mdp_capture;
+
+#ifdef MDP_PARALLEL
+/* Settings of mdp_visit_parallel */
+typedef struct {
+  uint32_t threads;
+  uint32_t min_items;
+} _mdp_parallel;
+#endif
+
+typedef struct {
+  mdp_context *context;
+  const mdp_schema *schema;
+  size_t indent_levels;
+  int last_error;
+  int output_mode;
+
+  uint8_t *output;
+  size_t output_length;
+  size_t output_capacity;
+  /* Length of text generated so far, including text counted in measure mode */
+  size_t output_total;
+  /* Number of values visited so far */
+  uint64_t node_count;
+  /* Size of the value being visited */
+  mol2_num_t data_size;
+  /* Data is read without a cache, as in streaming visits */
+  int uncached;
+  /*
+   * Text of the current step delivered by previous mdp_visit_next calls,
+   * which is skipped when the step is replayed.
+   */
+  size_t skip;
+  /* Only the value at path is visited when set */
+  const char *path;
+  /* Only the value recorded by node is visited when set */
+  const mdp_index_node *node;
+  /* Values visited are recorded when set */
+  mdp_index *index;
+  /* Node of the latest finished frame */
+  uint32_t index_last;
+  /*
+   * Output is disabled while visiting a hidden field, the original mode is
+   * restored once the frame at hidden_frame finishes. 0 means no hidden
+   * field is being visited.
+   */
+  uint32_t hidden_frame;
+  int hidden_output_mode;
+
+  _mdp_frame *frames;
+  uint32_t frame_count;
+  uint32_t frame_capacity;
+  /* Consumer of events, text is generated when not set */
+  const mdp_events *events;
+  void *events_context;
+
+  /* Bytes consumed by the latest finished frame */
+  mol2_num_t consumed;
+  /* Offset in data right after the latest finished frame */
+  mol2_num_t consumed_end;
+
+  /* Text generated is recorded when set, see mdp_visit_record */
+  mdp_trace *trace;
+  /* Offset of data, spans are recorded relative to it */
+  mol2_num_t trace_base;
+  /* Position of the length of the latest op when it is literal, or 0 */
+  size_t trace_literal;
+  /* Set while text of the span op just recorded is sent */
+  int trace_muted;
+
+  /* Subtrees are looked up and kept when set, see _mdp_fragment_enter */
+  mdp_fragment_cache *fragments;
+  /* Nested subtrees being captured, one record for each level at most */
+  _mdp_capture *captures;
+  uint32_t capture_count;
+  /*
+   * Scratch of fragments keeps captured text from position capture_base,
+   * and indent marks from mark_base. Output from capture_from is not
+   * copied to scratch yet.
+   */
+  size_t capture_base;
+  size_t capture_length;
+  size_t capture_from;
+  size_t mark_base;
+  size_t mark_count;
+  /* Most frames nested so far, tracked for the depth of captured subtrees */
+  uint32_t deepest;
+#ifdef MDP_PARALLEL
+  /* Large vectors are split when set, see mdp_visit_parallel */
+  const _mdp_parallel *parallel;
+#endif
+} _mdp_inner;
+
+/* Tests if text is actually generated in current output mode */
+int _mdp_generates_text(_mdp_inner *inner) {
+  return inner->output_mode == _MDP_OUTPUT_FEEDER ||
+         inner->output_mode == _MDP_OUTPUT_PULL;
+}
+
+/* Indentation sent while capturing, found at position of captured text */
+typedef struct {
+  size_t position;
+  size_t levels;
+} _mdp_mark;
+
+/* Marks follow slot_size bytes of text in scratch */
+_mdp_mark *_mdp_capture_marks(_mdp_inner *inner) {
+  return (_mdp_mark *)&inner->fragments->scratch[inner->fragments->slot_size];
+}
+
+/*
+ * Drops text before base from scratch, along with the captures it belongs
+ * to. All captures are dropped when base is past the text in scratch.
+ */
+void _mdp_capture_drop(_mdp_inner *inner, size_t base) {
+  size_t end = inner->capture_base + inner->capture_length;
+  for (uint32_t i = 0; i < inner->capture_count; i++) {
+    if (inner->captures[i].text < base) {
+      inner->captures[i].dropped = 1;
+    }
+  }
+  if (base >= end) {
+    inner->capture_length = 0;
+  } else {
+    memmove(inner->fragments->scratch,
+            &inner->fragments->scratch[base - inner->capture_base],
+            end - base);
+    inner->capture_length = end - base;
+  }
+  inner->capture_base = base;
+
+  _mdp_mark *marks = _mdp_capture_marks(inner);
+  size_t dropped = 0;
+  while (dropped < inner->mark_count && marks[dropped].position < base) {
+    dropped++;
+  }
+  memmove(marks, &marks[dropped],
+          (inner->mark_count - dropped) * sizeof(_mdp_mark));
+  inner->mark_base += dropped;
+  inner->mark_count -= dropped;
+}
+
+/* Copies output not copied yet into scratch */
+void _mdp_capture_output(_mdp_inner *inner) {
+  const uint8_t *data = &inner->output[inner->capture_from];
+  size_t length = inner->output_length - inner->capture_from;
+  inner->capture_from = inner->output_length;
+  size_t slot_size = inner->fragments->slot_size;
+  if (inner->capture_length + length > slot_size) {
+    // The outermost captures no longer fitting are dropped
+    size_t end = inner->capture_base + inner->capture_length + length;
+    size_t base = end;
+    for (uint32_t i = 0; i < inner->capture_count; i++) {
+      _mdp_capture *c = &inner->captures[i];
+      if (!c->dropped && end - c->text <= slot_size) {
+        base = c->text;
+        break;
+      }
+    }
+    size_t copied = end - length;
+    _mdp_capture_drop(inner, base);
+    if (base == end) {
+      return;
+    }
+    if (base > copied) {
+      data += base - copied;
+      length -= base - copied;
+    }
+  }
+  memcpy(&inner->fragments->scratch[inner->capture_length], data, length);
+  inner->capture_length += length;
+}
+
+/* Position of the next byte of text sent, among captured text */
+size_t _mdp_capture_position(_mdp_inner *inner) {
+  return inner->capture_base + inner->capture_length + inner->output_length -
+         inner->capture_from;
+}
+
+/* Remembers the indentation about to be sent */
+void _mdp_capture_indents(_mdp_inner *inner) {
+  size_t capacity = inner->fragments->slot_size / sizeof(_mdp_mark);
+  if (inner->mark_count == capacity) {
+    _mdp_capture_output(inner);
+    _mdp_capture_drop(inner, _mdp_capture_position(inner));
+  }
+  _mdp_mark *mark = &_mdp_capture_marks(inner)[inner->mark_count++];
+  mark->position = _mdp_capture_position(inner);
+  mark->levels = inner->indent_levels;
+}
+
+int _mdp_flush(_mdp_inner *inner) {
+  if (inner->last_error != MDP_OK) {
+    return inner->last_error;
+  }
+  if (inner->output_mode == _MDP_OUTPUT_PULL) {
+    // The caller's buffer is full
+    MDP_RETURN_ERROR(_MDP_SUSPEND);
+  }
+  if (inner->output_mode != _MDP_OUTPUT_FEEDER || inner->output_length == 0) {
+    return inner->last_error;
+  }
+
+  if (inner->capture_count > 0) {
+    _mdp_capture_output(inner);
+  }
+  int ret = inner->context->feeder(inner->output, inner->output_length,
+                                   inner->context->feeder_context);
+  inner->output_length = 0;
+  inner->capture_from = 0;
+  if (ret != 0) {
+    MDP_DEBUG("Feeder error when flushing output: %d\n", ret);
+    MDP_RETURN_ERROR(MDP_ERROR_FEEDER);
+  }
+  return inner->last_error;
+}
+
+/* Accounts for generated text, enforcing the output budget */
+int _mdp_count_output(_mdp_inner *inner, size_t length) {
+  size_t max_output = inner->context->budget.max_output;
+  inner->output_total += length;
+  if (max_output != 0 && inner->output_total > max_output) {
+    MDP_DEBUG("Output exceeds the budget of %lu bytes!\n",
+              (unsigned long)max_output);
+    MDP_RETURN_ERROR(MDP_ERROR_BUDGET);
+  }
+  return inner->last_error;
+}
+
+/* Appends bytes to the trace being recorded */
+int _mdp_trace_put(_mdp_inner *inner, const void *data, size_t length) {
+  mdp_trace *trace = inner->trace;
+  if (length > trace->capacity - trace->length) {
+    MDP_DEBUG("Trace exceeds the capacity of %lu bytes!\n",
+              (unsigned long)trace->capacity);
+    MDP_RETURN_ERROR(MDP_ERROR_ARENA);
+  }
+  memcpy(&trace->buffer[trace->length], data, length);
+  trace->length += length;
+  return inner->last_error;
+}
+
+/* Tests if text sent now is recorded as is */
+int _mdp_trace_records(_mdp_inner *inner) {
+  return inner->trace != NULL && !inner->trace_muted &&
+         inner->output_mode == _MDP_OUTPUT_FEEDER;
+}
+
+/*
+ * Records an op, text sent for it is not recorded again until
+ * _mdp_trace_end. Returns if the op is recorded.
+ */
+int _mdp_trace_begin(_mdp_inner *inner, uint8_t op, const uint32_t *operands,
+                     size_t count) {
+  if (!_mdp_trace_records(inner)) {
+    return 0;
+  }
+  inner->trace_literal = 0;
+  _mdp_trace_put(inner, &op, 1);
+  _mdp_trace_put(inner, operands, count * sizeof(uint32_t));
+  inner->trace_muted = 1;
+  return 1;
+}
+
+/* Records an op rendering value, see _mdp_trace_begin */
+int _mdp_trace_span(_mdp_inner *inner, uint8_t op, mol2_cursor_t value,
+                    uint32_t argument) {
+  uint32_t operands[3] = {value.offset - inner->trace_base, value.size,
+                          argument};
+  return _mdp_trace_begin(inner, op, operands,
+                          op == _MDP_TRACE_BYTE_LINES ? 3 : 2);
+}
+
+int _mdp_trace_end(_mdp_inner *inner, int recorded) {
+  if (recorded) {
+    inner->trace_muted = 0;
+  }
+  return inner->last_error;
+}
+
+/* Records literal text, extending the latest op when it is literal too */
+int _mdp_trace_literal(_mdp_inner *inner, const uint8_t *data,
+                       size_t length) {
+  mdp_trace *trace = inner->trace;
+  uint32_t total = 0;
+  if (inner->trace_literal != 0) {
+    memcpy(&total, &trace->buffer[inner->trace_literal], sizeof(uint32_t));
+  }
+  if (inner->trace_literal == 0 || length > UINT32_MAX - total) {
+    uint32_t zero = 0;
+    _mdp_trace_end(inner, _mdp_trace_begin(inner, _MDP_TRACE_LITERAL, &zero,
+                                           1));
+    inner->trace_literal = trace->length - sizeof(uint32_t);
+    total = 0;
+  }
+  if (_mdp_trace_put(inner, data, length) != MDP_OK) {
+    return inner->last_error;
+  }
+  total += (uint32_t)length;
+  memcpy(&trace->buffer[inner->trace_literal], &total, sizeof(uint32_t));
+  return inner->last_error;
+}
+
+int _mdp_send_bytes(_mdp_inner *inner, const uint8_t *data, size_t length) {
+  if (inner->last_error != MDP_OK) {
+    return inner->last_error;
+  }
+  if (inner->output_mode == _MDP_OUTPUT_MEASURE) {
+    return _mdp_count_output(inner, length);
+  }
+  if (!_mdp_generates_text(inner)) {
+    return inner->last_error;
+  }
+  if (_mdp_count_output(inner, length) != MDP_OK) {
+    return inner->last_error;
+  }
+  if (_mdp_trace_records(inner) &&
+      _mdp_trace_literal(inner, data, length) != MDP_OK) {
+    return inner->last_error;
+  }
+  if (inner->skip > 0) {
+    size_t skip = inner->skip < length ? inner->skip : length;
+    inner->skip -= skip;
+    data += skip;
+    length -= skip;
+  }
+
+  while (length > 0) {
+    if (inner->output_length == inner->output_capacity) {
+      if (_mdp_flush(inner) != MDP_OK) {
+        return inner->last_error;
+      }
+    }
+    size_t available = inner->output_capacity - inner->output_length;
+    if (available > length) {
+      available = length;
+    }
+    memcpy(&inner->output[inner->output_length], data, available);
+    inner->output_length += available;
+    data += available;
+    length -= available;
+  }
+  return inner->last_error;
+}
+
+/* Adapts the output buffer to feeder style APIs, such as bech32m & utf8 */
+int _mdp_buffered_feeder(const uint8_t *data, size_t length,
+                         void *feeder_context) {
+  return _mdp_send_bytes((_mdp_inner *)feeder_context, data, length);
+}
+
+int _mdp_send_cursor_to_feeder(_mdp_inner *inner, mol2_cursor_t c) {
+  if (inner->last_error != MDP_OK) {
+    return inner->last_error;
+  }
+  if (inner->output_mode == _MDP_OUTPUT_MEASURE) {
+    return _mdp_count_output(inner, c.size);
+  }
+  if (!_mdp_generates_text(inner)) {
+    return inner->last_error;
+  }
+  if (_mdp_count_output(inner, c.size) != MDP_OK) {
+    return inner->last_error;
+  }
+  if (inner->skip > 0) {
+    uint32_t skip = inner->skip < c.size ? (uint32_t)inner->skip : c.size;
+    inner->skip -= skip;
+    mol2_add_offset(&c, skip);
+    mol2_sub_size(&c, skip);
+  }
+
+  int recorded = _mdp_trace_span(inner, _MDP_TRACE_RAW, c, 0);
+  while (c.size > 0) {
+    if (inner->output_length == inner->output_capacity) {
+      if (_mdp_flush(inner) != MDP_OK) {
+        return inner->last_error;
+      }
+    }
+    uint32_t available =
+        (uint32_t)(inner->output_capacity - inner->output_length);
+    uint32_t read =
+        mol2_read_at(&c, &inner->output[inner->output_length], available);
+    if (read == 0) {
+      MDP_RETURN_ERROR(MDP_ERROR_MOL2_IO);
+    }
+    inner->output_length += read;
+    mol2_add_offset(&c, read);
+    mol2_sub_size(&c, read);
+  }
+  return _mdp_trace_end(inner, recorded);
+}
+
+int _mdp_send_literal(_mdp_inner *inner, const char *literal) {
+  return _mdp_send_bytes(inner, (const uint8_t *)literal, strlen(literal));
+}
+
+int _mdp_send_name(_mdp_inner *inner, const uint8_t *name,
+                   uint32_t name_length) {
+  return _mdp_send_bytes(inner, name, name_length);
+}
+
+int _mdp_send_newline(_mdp_inner *inner) {
+  return _mdp_send_literal(inner, "\n");
+}
+
+int _mdp_send_indents(_mdp_inner *inner) {
+  if (inner->last_error != MDP_OK) {
+    return inner->last_error;
+  }
+  if (inner->output_mode == _MDP_OUTPUT_MEASURE) {
+    return _mdp_count_output(
+        inner, inner->indent_levels * (sizeof(MDP_INDENT_VALUE) - 1));
+  }
+  if (!_mdp_generates_text(inner)) {
+    return inner->last_error;
+  }
+
+  if (inner->capture_count > 0) {
+    _mdp_capture_indents(inner);
+  }
+  uint32_t levels = (uint32_t)inner->indent_levels;
+  int recorded = _mdp_trace_begin(inner, _MDP_TRACE_INDENT, &levels, 1);
+  for (size_t i = 0; i < inner->indent_levels && inner->last_error == MDP_OK;
+       i++) {
+    _mdp_send_literal(inner, MDP_INDENT_VALUE);
+  }
+  return _mdp_trace_end(inner, recorded);
+}
+
+/* Number of digits in the decimal representation of value */
+size_t _mdp_decimal_length(uint64_t value) {
+  size_t length = 1;
+  while (value >= 10) {
+    value /= 10;
+    length++;
+  }
+  return length;
+}
+
+int _mdp_send_number(_mdp_inner *inner, uint64_t value) {
+  if (inner->last_error != MDP_OK) {
+    return inner->last_error;
+  }
+  if (inner->output_mode == _MDP_OUTPUT_MEASURE) {
+    return _mdp_count_output(inner, _mdp_decimal_length(value));
+  }
+
+  uint8_t buf[20];
+  size_t i = sizeof(buf);
+  do {
+    buf[--i] = (uint8_t)('0' + value % 10);
+    value /= 10;
+  } while (value > 0);
+  return _mdp_send_bytes(inner, &buf[i], sizeof(buf) - i);
+}
+
+/* Sends data as lowercase hex digits, 2 digits for each byte */
+int _mdp_send_hex(_mdp_inner *inner, const uint8_t *data, size_t length) {
+  if (inner->last_error != MDP_OK) {
+    return inner->last_error;
+  }
+  if (inner->output_mode == _MDP_OUTPUT_MEASURE) {
+    return _mdp_count_output(inner, length * 2);
+  }
+
+  uint8_t buf[64];
+  while (length > 0) {
+    size_t n = length;
+    if (n > sizeof(buf) / 2) {
+      n = sizeof(buf) / 2;
+    }
+    for (size_t i = 0; i < n; i++) {
+      buf[i * 2] = _MDP_HEX_DIGITS[data[i] >> 4];
+      buf[i * 2 + 1] = _MDP_HEX_DIGITS[data[i] & 0xF];
+    }
+    _mdp_send_bytes(inner, buf, n * 2);
+    data += n;
+    length -= n;
+  }
+  return inner->last_error;
+}
+
+/* Sends the content of a cursor as hex digits */
+int _mdp_send_hex_cursor(_mdp_inner *inner, mol2_cursor_t value) {
+  if (inner->last_error != MDP_OK) {
+    return inner->last_error;
+  }
+  if (inner->output_mode == _MDP_OUTPUT_MEASURE) {
+    return _mdp_count_output(inner, (size_t)value.size * 2);
+  }
+  if (!_mdp_generates_text(inner)) {
+    return inner->last_error;
+  }
+
+  int recorded = _mdp_trace_span(inner, _MDP_TRACE_HEX, value, 0);
+  while (value.size > 0) {
+    uint8_t data[32];
+    uint32_t n = value.size < 32 ? value.size : 32;
+    if (inner->skip >= (size_t)n * 2) {
+      // Digits delivered by previous mdp_visit_next calls are skipped
+      // without reading
+      if (_mdp_count_output(inner, (size_t)n * 2) != MDP_OK) {
+        return inner->last_error;
+      }
+      inner->skip -= (size_t)n * 2;
+    } else {
+      if (mol2_read_at(&value, data, n) != n) {
+        MDP_DEBUG("Reading %u bytes from cursor results in error!\n", n);
+        MDP_RETURN_ERROR(MDP_ERROR_MOL2_IO);
+      }
+      _MDP_CHECK_READ();
+      if (_mdp_send_hex(inner, data, n) != MDP_OK) {
+        return inner->last_error;
+      }
+    }
+    mol2_add_offset(&value, n);
+    mol2_sub_size(&value, n);
+  }
+  return _mdp_trace_end(inner, recorded);
+}
+
+/*
+ * Sends a validated utf8 string as the content of a JSON string, '"', '\'
+ * and control characters are escaped.
+ */
+int _mdp_send_escaped(_mdp_inner *inner, mol2_cursor_t value) {
+  int recorded = _mdp_trace_span(inner, _MDP_TRACE_ESCAPED, value, 0);
+  while (value.size > 0 && inner->last_error == MDP_OK) {
+    uint8_t data[32];
+    uint32_t n = value.size < 32 ? value.size : 32;
+    if (mol2_read_at(&value, data, n) != n) {
+      MDP_DEBUG("Reading %u bytes from cursor results in error!\n", n);
+      MDP_RETURN_ERROR(MDP_ERROR_MOL2_IO);
+    }
+    mol2_add_offset(&value, n);
+    mol2_sub_size(&value, n);
+
+    uint8_t escaped[32 * 6];
+    size_t length = 0;
+    for (uint32_t i = 0; i < n; i++) {
+      if (data[i] == '"' || data[i] == '\\') {
+        escaped[length++] = '\\';
+        escaped[length++] = data[i];
+      } else if (data[i] < 0x20) {
+        memcpy(&escaped[length], "\\u00", 4);
+        escaped[length + 4] = _MDP_HEX_DIGITS[data[i] >> 4];
+        escaped[length + 5] = _MDP_HEX_DIGITS[data[i] & 0xF];
+        length += 6;
+      } else {
+        escaped[length++] = data[i];
+      }
+    }
+    _mdp_send_bytes(inner, escaped, length);
+  }
+  return _mdp_trace_end(inner, recorded);
+}
+
+/*
+ * Sends bytes as lines of 8 "0x??" items separated by ", ", each line is
+ * indented and ends with a newline. When more is set, the last item is also
+ * followed by a separator, since more bytes come after.
+ */
+int _mdp_send_byte_lines(_mdp_inner *inner, mol2_cursor_t value, int more) {
+  if (inner->last_error != MDP_OK) {
+    return inner->last_error;
+  }
+  mol2_num_t item_count = value.size;
+  if (item_count == 0) {
+    return inner->last_error;
+  }
+  if (inner->output_mode == _MDP_OUTPUT_MEASURE) {
+    size_t lines = (item_count + 7) / 8;
+    size_t separators = more ? item_count : item_count - 1;
+    size_t indents = inner->indent_levels * (sizeof(MDP_INDENT_VALUE) - 1);
+    return _mdp_count_output(inner, (size_t)item_count * 4 + separators * 2 +
+                                        lines + lines * indents);
+  }
+  if (!_mdp_generates_text(inner)) {
+    return inner->last_error;
+  }
+
+  int recorded =
+      _mdp_trace_span(inner, _MDP_TRACE_BYTE_LINES, value,
+                      (uint32_t)inner->indent_levels << 1 | (more ? 1 : 0));
+  while (value.size > 0) {
+    uint8_t data[8];
+    uint32_t n = value.size < 8 ? value.size : 8;
+    if (inner->skip > 0) {
+      // Lines delivered by previous mdp_visit_next calls are skipped
+      // without reading
+      size_t separators = (n < value.size || more) ? n : n - 1;
+      size_t line_length =
+          inner->indent_levels * (sizeof(MDP_INDENT_VALUE) - 1) + n * 4 +
+          separators * 2 + 1;
+      if (inner->skip >= line_length) {
+        if (_mdp_count_output(inner, line_length) != MDP_OK) {
+          return inner->last_error;
+        }
+        inner->skip -= line_length;
+        mol2_add_offset(&value, n);
+        mol2_sub_size(&value, n);
+        continue;
+      }
+    }
+    if (mol2_read_at(&value, data, n) != n) {
+      MDP_DEBUG("Reading %u bytes from cursor results in error!\n", n);
+      MDP_RETURN_ERROR(MDP_ERROR_MOL2_IO);
+    }
+    _MDP_CHECK_READ();
+    mol2_add_offset(&value, n);
+    mol2_sub_size(&value, n);
+
+    uint8_t line[8 * 6 + 1];
+    size_t length = 0;
+    for (uint32_t i = 0; i < n; i++) {
+      line[length++] = '0';
+      line[length++] = 'x';
+      line[length++] = _MDP_HEX_DIGITS[data[i] >> 4];
+      line[length++] = _MDP_HEX_DIGITS[data[i] & 0xF];
+      if (i != n - 1 || value.size > 0 || more) {
+        line[length++] = ',';
+        line[length++] = ' ';
+      }
+    }
+    line[length++] = '\n';
+    _mdp_send_indents(inner);
+    _mdp_send_bytes(inner, line, length);
+  }
+
+  return _mdp_trace_end(inner, recorded);
+}
+
+/* Streams the content of a cursor into the hasher of elision */
+int _mdp_digest_cursor(_mdp_inner *inner, const mdp_elision *elision,
+                       mol2_cursor_t value, uint8_t *digest) {
+  if (elision->init(elision->hasher_context) != 0) {
+    MDP_RETURN_ERROR(MDP_ERROR_HASHER);
+  }
+  while (value.size > 0) {
+    uint8_t buf[MDP_BUFFER_LEN];
+    uint32_t read = mol2_read_at(&value, buf, MDP_BUFFER_LEN);
+    if (read == 0) {
+      MDP_RETURN_ERROR(MDP_ERROR_MOL2_IO);
+    }
+    _MDP_CHECK_READ();
+    if (elision->update(elision->hasher_context, buf, read) != 0) {
+      MDP_RETURN_ERROR(MDP_ERROR_HASHER);
+    }
+    mol2_add_offset(&value, read);
+    mol2_sub_size(&value, read);
+  }
+  if (elision->final(elision->hasher_context, digest) != 0) {
+    MDP_RETURN_ERROR(MDP_ERROR_HASHER);
+  }
+  return inner->last_error;
+}
+
+/* Sends the digest of a cursor as hex digits */
+int _mdp_send_digest(_mdp_inner *inner, const mdp_elision *elision,
+                     mol2_cursor_t value) {
+  if (inner->last_error != MDP_OK) {
+    return inner->last_error;
+  }
+  if (inner->output_mode == _MDP_OUTPUT_MEASURE) {
+    return _mdp_count_output(inner, MDP_DIGEST_LEN * 2);
+  }
+  uint8_t digest[MDP_DIGEST_LEN];
+  if (_mdp_digest_cursor(inner, elision, value, digest) != MDP_OK) {
+    return inner->last_error;
+  }
+  return _mdp_send_hex(inner, digest, MDP_DIGEST_LEN);
+}
+
+/* Tests if content of size bytes is elided */
+int _mdp_elides(const mdp_elision *elision, mol2_num_t size) {
+  return elision != NULL && elision->threshold != 0 &&
+         size > elision->threshold && size > elision->preview;
+}
+
+/*
+ * Sends the content of a byte array or byte vector, long content is elided
+ * when requested by context.
+ */
+int _mdp_send_raw_bytes(_mdp_inner *inner, mol2_cursor_t value) {
+  if (inner->last_error != MDP_OK) {
+    return inner->last_error;
+  }
+  const mdp_elision *elision = inner->context->elision;
+  if (!_mdp_elides(elision, value.size)) {
+    return _mdp_send_byte_lines(inner, value, 0);
+  }
+  if (inner->output_mode == _MDP_OUTPUT_NONE) {
+    return inner->last_error;
+  }
+
+  mol2_cursor_t preview = value;
+  preview.size = elision->preview;
+  _mdp_send_byte_lines(inner, preview, 1);
+
+  _mdp_send_indents(inner);
+  _mdp_send_literal(inner, "... ");
+  _mdp_send_number(inner, value.size - elision->preview);
+  _mdp_send_literal(inner, " more bytes, digest = 0x");
+  _mdp_send_digest(inner, elision, value);
+  return _mdp_send_newline(inner);
+}
+
+typedef struct {
+  const mol2_cursor_t *cursors;
+  size_t cursor_count;
+
+  size_t current_cursor;
+  uint32_t current_offset;
+} cursors_inputter_context;
+
+void cursors_inputter_context_initialize(cursors_inputter_context *context,
+                                         const mol2_cursor_t *cursors,
+                                         size_t cursor_count) {
+  context->cursors = cursors;
+  context->cursor_count = cursor_count;
+  context->current_cursor = 0;
+  context->current_offset = 0;
+}
+
+int cursors_inputter(uint8_t *buf, size_t *length, void *context) {
+  cursors_inputter_context *c = (cursors_inputter_context *)context;
+
+  size_t wrote = 0;
+  while (wrote < *length) {
+    if (c->current_cursor < c->cursor_count) {
+      if (c->current_offset < c->cursors[c->current_cursor].size) {
+        uint32_t available_data =
+            c->cursors[c->current_cursor].size - c->current_offset;
+        uint32_t available_space = (uint32_t)(*length - wrote);
+        if (available_space > available_data) {
+          available_space = available_data;
+        }
+        mol2_cursor_t target_cursor = c->cursors[c->current_cursor];
+        mol2_add_offset(&target_cursor, c->current_offset);
+        target_cursor.size = available_space;
+        uint32_t read =
+            mol2_read_at(&target_cursor, &buf[wrote], available_space);
+        if (read != available_space) {
+          MDP_DEBUG(
+              "Cursor inputter got less data than requested, actual: %u, "
+              "expected: %u!",
+              read, available_space);
+          return MDP_ERROR_MOL2_IO;
+        }
+        wrote += read;
+        c->current_offset += read;
+      } else {
+        // Switch to next cursor
+        c->current_cursor++;
+        c->current_offset = 0;
+      }
+    } else {
+      // Running out of data to use
+      break;
+    }
+  }
+  *length = wrote;
+  return 0;
+}
+
+mol2_data_source_t _mdp_make_memory_source(const void *memory, uint32_t size) {
+  mol2_data_source_t s_data_source = {0};
+
+  s_data_source.read = mol2_source_memory;
+  s_data_source.total_size = size;
+  s_data_source.args[0] = (uintptr_t)memory;
+  s_data_source.args[1] = (uintptr_t)size;
+
+  s_data_source.cache_size = 0;
+  s_data_source.start_point = 0;
+  s_data_source.total_size = size;
+  s_data_source.max_cache_size = MIN_CACHE_SIZE;
+  return s_data_source;
+}
+
+mol2_cursor_t _mdp_cursor_from_source(mol2_data_source_t *source) {
+  mol2_cursor_t cur;
+  cur.offset = 0;
+  cur.size = source->total_size;
+  cur.data_source = source;
+  return cur;
+}
+
+mol2_cursor_t mdp_cursor_from_memory(mol2_data_source_t *source,
+                                     const void *memory, uint32_t size) {
+  *source = _mdp_make_memory_source(memory, size);
+  return _mdp_cursor_from_source(source);
+}
+
+/* Points s to the data of source, dropping any cached data */
+void _mdp_retarget_source(mol2_data_source_t *s,
+                          const mol2_data_source_t *source) {
+  memcpy(s->args, source->args, sizeof(source->args));
+  s->total_size = source->total_size;
+  s->read = source->read;
+  s->start_point = 0;
+  s->cache_size = 0;
+}
+
+/*
+ * Creates a copy of a data source with a larger cache in the arena, the
+ * read function and its arguments are shared with the original source.
+ */
+mol2_data_source_t *_mdp_arena_clone_source(mdp_arena *arena,
+                                            const mol2_data_source_t *source,
+                                            uint32_t cache_size) {
+  mol2_data_source_t *s = (mol2_data_source_t *)mdp_arena_alloc(
+      arena, MOL2_DATA_SOURCE_LEN(cache_size));
+  if (s == NULL) {
+    return NULL;
+  }
+  s->max_cache_size = cache_size;
+  _mdp_retarget_source(s, source);
+  return s;
+}
+
+/*
+ * Records the value of a newly pushed frame, linking it to its parent. The
+ * previous sibling, if any, is the latest finished frame. Size is filled once
+ * the frame finishes.
+ */
+int _mdp_index_push(_mdp_inner *inner, _mdp_frame *f) {
+  mdp_index *index = inner->index;
+  if (index->count >= index->capacity) {
+    MDP_DEBUG("Index of %u nodes is exhausted!\n", index->capacity);
+    MDP_RETURN_ERROR(MDP_ERROR_ARENA);
+  }
+  uint32_t parent = MDP_INDEX_NONE;
+  if (inner->frame_count > 1) {
+    parent = inner->frames[inner->frame_count - 2].node;
+  }
+  f->node = index->count++;
+  mdp_index_node *node = &index->nodes[f->node];
+  node->type = f->type;
+  node->offset = f->value.offset - inner->context->data.offset;
+  node->size = 0;
+  node->parent = parent;
+  node->first_child = MDP_INDEX_NONE;
+  node->next_sibling = MDP_INDEX_NONE;
+  if (parent != MDP_INDEX_NONE) {
+    if (index->nodes[parent].first_child == MDP_INDEX_NONE) {
+      index->nodes[parent].first_child = f->node;
+    } else {
+      index->nodes[inner->index_last].next_sibling = f->node;
+    }
+  }
+  return inner->last_error;
+}
+
+int _mdp_push(_mdp_inner *inner, uint32_t type, mol2_cursor_t value) {
+  if (inner->last_error != MDP_OK) {
+    return inner->last_error;
+  }
+  if (type >= inner->schema->definition_count) {
+    MDP_DEBUG("Target type cannot be found!\n");
+    MDP_RETURN_ERROR(MDP_ERROR_SCHEMA_ENCODING);
+  }
+  if (inner->frame_count >= inner->frame_capacity) {
+    MDP_DEBUG("Frame stack of %u levels is exhausted!\n",
+              inner->frame_capacity);
+    MDP_RETURN_ERROR(MDP_ERROR_ARENA);
+  }
+  const mdp_budget *budget = &inner->context->budget;
+  if (budget->max_depth != 0 && inner->frame_count >= budget->max_depth) {
+    MDP_DEBUG("Depth exceeds the budget of %u!\n", budget->max_depth);
+    MDP_RETURN_ERROR(MDP_ERROR_BUDGET);
+  }
+  inner->node_count++;
+  if (budget->max_nodes != 0 && inner->node_count > budget->max_nodes) {
+    MDP_DEBUG("Visited values exceed the budget of %lu!\n",
+              (unsigned long)budget->max_nodes);
+    MDP_RETURN_ERROR(MDP_ERROR_BUDGET);
+  }
+
+  _mdp_frame *f = &inner->frames[inner->frame_count++];
+  if (inner->frame_count > inner->deepest) {
+    inner->deepest = inner->frame_count;
+  }
+  f->type = type;
+  f->phase = _MDP_PHASE_ENTER;
+  f->value = value;
+  if (inner->index != NULL) {
+    return _mdp_index_push(inner, f);
+  }
+  return inner->last_error;
+}
+
+/* Returns 0 for types with no fixed size, as well as unresolved types */
+uint32_t _mdp_fixed_size(const mdp_schema *schema, uint32_t type) {
+  if (type >= schema->definition_count) {
+    return 0;
+  }
+  return schema->definitions[type].fixed_size;
+}
+
+/* Tests if a field is hidden by the projection in context */
+int _mdp_field_hidden(_mdp_inner *inner, uint32_t field_index) {
+  const mdp_projection *projection = inner->context->projection;
+  return projection != NULL &&
+         (projection->hidden[field_index / 8] & (1 << (field_index % 8))) != 0;
+}
+
+/* Pushes a hidden field, which is validated without generating text */
+int _mdp_push_hidden(_mdp_inner *inner, uint32_t type, mol2_cursor_t value) {
+  if (inner->hidden_frame == 0 && inner->output_mode != _MDP_OUTPUT_NONE) {
+    inner->hidden_frame = inner->frame_count;
+    inner->hidden_output_mode = inner->output_mode;
+    inner->output_mode = _MDP_OUTPUT_NONE;
+  }
+  return _mdp_push(inner, type, value);
+}
+
+#define _MDP_HASH_INIT 0xcbf29ce484222325ULL
+
+/* FNV-1a, telling apart cached content before comparing it */
+uint64_t _mdp_hash_update(uint64_t hash, const uint8_t *data, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    hash ^= data[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+int mdp_fragment_cache_initialize(mdp_fragment_cache *cache, void *memory,
+                                  size_t size, uint32_t slot_size) {
+  memset(cache, 0, sizeof(mdp_fragment_cache));
+  // Marks kept in slots and scratch are aligned
+  size_t aligned_slot_size = ((size_t)slot_size + 7) & ~(size_t)7;
+  uintptr_t start = ((uintptr_t)memory + 7) & ~(uintptr_t)7;
+  size_t skipped = start - (uintptr_t)memory;
+  size_t set_size =
+      MDP_FRAGMENT_CACHE_WAYS * (sizeof(mdp_fragment) + aligned_slot_size);
+  if (slot_size == 0 || aligned_slot_size > 0xFFFFFFFF ||
+      size < skipped + aligned_slot_size * 2 + set_size) {
+    MDP_DEBUG("Memory of %lu bytes is not enough for fragment cache!\n",
+              (unsigned long)size);
+    return MDP_ERROR_ARENA;
+  }
+  size_t set_count = (size - skipped - aligned_slot_size * 2) / set_size;
+  if (set_count > 0xFFFFFFFF / MDP_FRAGMENT_CACHE_WAYS) {
+    set_count = 0xFFFFFFFF / MDP_FRAGMENT_CACHE_WAYS;
+  }
+  size_t count = set_count * MDP_FRAGMENT_CACHE_WAYS;
+  cache->entries = (mdp_fragment *)start;
+  cache->set_count = (uint32_t)set_count;
+  cache->slot_size = (uint32_t)aligned_slot_size;
+  cache->slots = (uint8_t *)&cache->entries[count];
+  cache->scratch = &cache->slots[count * aligned_slot_size];
+  memset(cache->entries, 0, sizeof(mdp_fragment) * count);
+  return MDP_OK;
+}
+
+/*
+ * Hashes the content of settings changing the text or the budget use of
+ * fragments, so settings changed in place are told apart from the ones
+ * entries were rendered with. The prepared schema is never modified.
+ */
+uint64_t _mdp_fragment_settings(const mdp_context *context) {
+  uint64_t hash = _mdp_hash_update(
+      _MDP_HASH_INIT, (const uint8_t *)&context->format, sizeof(int));
+  const char *hrp = context->hrp != NULL ? context->hrp : "";
+  // The terminating zero keeps the hrp apart from what follows
+  hash = _mdp_hash_update(hash, (const uint8_t *)hrp, strlen(hrp) + 1);
+
+  const mdp_projection *projection = context->projection;
+  uint8_t present = projection != NULL;
+  hash = _mdp_hash_update(hash, &present, 1);
+  if (projection != NULL) {
+    size_t size = (context->prepared_schema->field_count + 7) / 8;
+    uint8_t skip = projection->skip_hidden != 0;
+    hash = _mdp_hash_update(hash, &skip, 1);
+    if (size > 0) {
+      hash = _mdp_hash_update(hash, projection->hidden, size);
+    }
+  }
+
+  const mdp_elision *elision = context->elision;
+  present = elision != NULL;
+  hash = _mdp_hash_update(hash, &present, 1);
+  if (elision != NULL) {
+    // Fields are hashed one by one, padding is left out
+    hash = _mdp_hash_update(hash, (const uint8_t *)&elision->threshold, 4);
+    hash = _mdp_hash_update(hash, (const uint8_t *)&elision->preview, 4);
+    hash = _mdp_hash_update(hash, (const uint8_t *)&elision->init,
+                            sizeof(elision->init));
+    hash = _mdp_hash_update(hash, (const uint8_t *)&elision->update,
+                            sizeof(elision->update));
+    hash = _mdp_hash_update(hash, (const uint8_t *)&elision->final,
+                            sizeof(elision->final));
+    hash = _mdp_hash_update(hash, (const uint8_t *)&elision->hasher_context,
+                            sizeof(elision->hasher_context));
+  }
+  return hash;
+}
+
+/* Empties cache when its entries were rendered with other settings */
+void _mdp_fragment_bind(mdp_fragment_cache *cache,
+                        const mdp_context *context) {
+  uint64_t settings = _mdp_fragment_settings(context);
+  if (cache->schema == context->prepared_schema &&
+      cache->settings == settings) {
+    return;
+  }
+  memset(cache->entries, 0,
+         sizeof(mdp_fragment) * cache->set_count * MDP_FRAGMENT_CACHE_WAYS);
+  cache->schema = context->prepared_schema;
+  cache->settings = settings;
+}
+
+/*
+ * Keeps the text captured for the innermost capture in the fragment cache,
+ * once its frame finishes. Indentation is cut out of the text, marks keep
+ * where it goes and its levels relative to the start of the subtree.
+ */
+int _mdp_fragment_leave(_mdp_inner *inner, mol2_num_t consumed_size) {
+  mdp_fragment_cache *cache = inner->fragments;
+  _mdp_capture_output(inner);
+  _mdp_capture *c = &inner->captures[--inner->capture_count];
+  uint32_t depth = inner->deepest - (c->frame + 1);
+  if (inner->deepest < c->deepest) {
+    inner->deepest = c->deepest;
+  }
+
+  size_t end = inner->capture_base + inner->capture_length;
+  const _mdp_mark *marks = NULL;
+  size_t mark_count = 0;
+  size_t text_length = 0;
+  if (!c->dropped) {
+    marks = &_mdp_capture_marks(inner)[c->mark - inner->mark_base];
+    mark_count = inner->mark_base + inner->mark_count - c->mark;
+    text_length = end - c->text;
+  }
+  for (size_t i = 0; i < mark_count && !c->dropped; i++) {
+    size_t indents = marks[i].levels * (sizeof(MDP_INDENT_VALUE) - 1);
+    if (marks[i].levels < c->levels || marks[i].position + indents > end) {
+      c->dropped = 1;
+    }
+    text_length -= indents;
+  }
+  if (!c->dropped &&
+      c->span.size + mark_count * 8 + text_length > cache->slot_size) {
+    c->dropped = 1;
+  }
+
+  if (!c->dropped) {
+    mdp_fragment *set =
+        &cache->entries[(c->hash % cache->set_count) * MDP_FRAGMENT_CACHE_WAYS];
+    mdp_fragment *e = &set[0];
+    for (uint32_t i = 1; i < MDP_FRAGMENT_CACHE_WAYS; i++) {
+      if (set[i].last_used < e->last_used) {
+        e = &set[i];
+      }
+    }
+    if (e->last_used != 0) {
+      cache->evictions++;
+    }
+    e->last_used = 0;
+    uint8_t *slot =
+        &cache->slots[(size_t)(e - cache->entries) * cache->slot_size];
+    uint32_t *slot_marks = (uint32_t *)slot;
+    uint8_t *data = &slot[mark_count * 8];
+    uint8_t *text = &data[c->span.size];
+    if (mol2_read_at(&c->span, data, c->span.size) != c->span.size) {
+      MDP_RETURN_ERROR(MDP_ERROR_MOL2_IO);
+    }
+    const uint8_t *captured = &cache->scratch[c->text - inner->capture_base];
+    size_t from = c->text;
+    size_t length = 0;
+    for (size_t i = 0; i < mark_count; i++) {
+      size_t copied = marks[i].position - from;
+      memcpy(&text[length], &captured[from - c->text], copied);
+      length += copied;
+      slot_marks[i * 2] = (uint32_t)length;
+      slot_marks[i * 2 + 1] = (uint32_t)(marks[i].levels - c->levels);
+      from = marks[i].position +
+             marks[i].levels * (sizeof(MDP_INDENT_VALUE) - 1);
+    }
+    memcpy(&text[length], &captured[from - c->text], end - from);
+    e->hash = c->hash;
+    e->type = inner->frames[c->frame].type;
+    e->size = c->span.size;
+    e->consumed = consumed_size;
+    e->depth = depth;
+    e->nodes = inner->node_count - c->nodes;
+    e->mark_count = (uint32_t)mark_count;
+    e->text_length = (uint32_t)(length + end - from);
+    e->last_used = ++cache->clock;
+  } else {
+    cache->oversized++;
+  }
+
+  if (inner->capture_count == 0) {
+    inner->capture_length = 0;
+    inner->mark_count = 0;
+  }
+  return inner->last_error;
+}
+
+/* Finishes current frame, returning consumed size to the parent frame */
+int _mdp_pop(_mdp_inner *inner, mol2_num_t consumed_size) {
+  if (inner->last_error != MDP_OK) {
+    return inner->last_error;
+  }
+  if (inner->capture_count > 0 &&
+      inner->captures[inner->capture_count - 1].frame ==
+          inner->frame_count - 1 &&
+      _mdp_fragment_leave(inner, consumed_size) != MDP_OK) {
+    return inner->last_error;
+  }
+
+  inner->frame_count--;
+  if (inner->index != NULL) {
+    inner->index_last = inner->frames[inner->frame_count].node;
+    inner->index->nodes[inner->index_last].size = consumed_size;
+  }
+  inner->consumed = consumed_size;
+  inner->consumed_end =
+      inner->frames[inner->frame_count].value.offset + consumed_size;
+  if (inner->hidden_frame != 0 && inner->frame_count == inner->hidden_frame) {
+    inner->output_mode = inner->hidden_output_mode;
+    inner->hidden_frame = 0;
+  }
+  if (inner->frame_count > 0) {
+    inner->frames[inner->frame_count - 1].phase = _MDP_PHASE_RESUME;
+  }
+  return inner->last_error;
+}
+
+/*
+ * Calculates the length of text generated by bech32m_encode for raw data of
+ * data_length bytes, the same checks on hrp are performed.
+ */
+int _mdp_bech32m_length(const char *hrp, size_t data_length, size_t *length) {
+  size_t hrp_length = 0;
+  while (hrp[hrp_length] != 0) {
+    int ch = hrp[hrp_length];
+    if (ch < 33 || ch > 126) {
+      return 1;
+    }
+    if (ch >= 'A' && ch <= 'Z') {
+      // bech32m_encode stops with success here, generating nothing
+      *length = 0;
+      return 0;
+    }
+    hrp_length++;
+  }
+  // hrp, separator, 5 bits groups and 6 checksum characters
+  *length = hrp_length + 1 + (data_length * 8 + 4) / 5 + 6;
+  return 0;
+}
+
+/* Feeds a bech32m encoded address into feeder, with hrp from context */
+int _mdp_encode_address(_mdp_inner *inner, mol2_cursor_t code_hash,
+                        mol2_cursor_t hash_type, mol2_cursor_t args,
+                        mdp_text_feeder_t feeder, void *feeder_context) {
+  mol2_data_source_t index_source = _mdp_make_memory_source("\0", 1);
+  mol2_cursor_t index_cursor = _mdp_cursor_from_source(&index_source);
+  mol2_cursor_t cursors[4] = {index_cursor, code_hash, hash_type, args};
+  cursors_inputter_context inputter;
+  cursors_inputter_context_initialize(&inputter, cursors, 4);
+
+  bech32m_raw_to_5bits_inputter_context inputter2;
+  bech32m_initialize_raw_to_5bits_inputter(&inputter2, cursors_inputter,
+                                           &inputter);
+
+  return bech32m_encode(inner->context->hrp, bech32m_raw_to_5bits_inputter,
+                        &inputter2, feeder, feeder_context);
+}
+
+typedef struct {
+  uint8_t *text;
+  size_t length;
+  size_t capacity;
+} _mdp_text_buffer;
+
+int _mdp_text_buffer_feeder(const uint8_t *data, size_t length,
+                            void *feeder_context) {
+  _mdp_text_buffer *buffer = (_mdp_text_buffer *)feeder_context;
+  if (length > buffer->capacity - buffer->length) {
+    return 1;
+  }
+  memcpy(&buffer->text[buffer->length], data, length);
+  buffer->length += length;
+  return 0;
+}
+
+void mdp_address_cache_initialize(mdp_address_cache *cache,
+                                  mdp_address_cache_entry *entries,
+                                  uint32_t capacity) {
+  memset(entries, 0, sizeof(mdp_address_cache_entry) * capacity);
+  cache->entries = entries;
+  cache->capacity = capacity;
+  cache->clock = 0;
+  cache->hits = 0;
+  cache->misses = 0;
+}
+
+/*
+ * Sends an address of text_length bytes from cache, encoding it into the
+ * least recently used entry on a miss.
+ */
+int _mdp_send_cached_address(_mdp_inner *inner, mdp_address_cache *cache,
+                             mol2_cursor_t code_hash, mol2_cursor_t hash_type,
+                             mol2_cursor_t args, size_t text_length) {
+  uint8_t script[MDP_ADDRESS_CACHE_SCRIPT_LEN];
+  uint32_t script_length = 0;
+  mol2_cursor_t parts[3] = {code_hash, hash_type, args};
+  for (int i = 0; i < 3; i++) {
+    if (mol2_read_at(&parts[i], &script[script_length], parts[i].size) !=
+        parts[i].size) {
+      MDP_RETURN_ERROR(MDP_ERROR_MOL2_IO);
+    }
+    script_length += parts[i].size;
+  }
+  _MDP_CHECK_READ();
+  uint64_t hash = _mdp_hash_update(_MDP_HASH_INIT, script, script_length);
+  const char *hrp = inner->context->hrp;
+  size_t hrp_length = strlen(hrp);
+
+  // The hrp is the prefix of text, its length follows from text_length
+  mdp_address_cache_entry *victim = &cache->entries[0];
+  for (uint32_t i = 0; i < cache->capacity; i++) {
+    mdp_address_cache_entry *entry = &cache->entries[i];
+    if (entry->last_used != 0 && entry->hash == hash &&
+        entry->script_length == script_length &&
+        entry->text_length == text_length &&
+        memcmp(entry->script, script, script_length) == 0 &&
+        memcmp(entry->text, hrp, hrp_length) == 0) {
+      cache->hits++;
+      entry->last_used = ++cache->clock;
+      return _mdp_send_bytes(inner, entry->text, text_length);
+    }
+    if (entry->last_used < victim->last_used) {
+      victim = entry;
+    }
+  }
+
+  cache->misses++;
+  victim->last_used = 0;
+  _mdp_text_buffer buffer = {victim->text, 0, MDP_ADDRESS_CACHE_TEXT_LEN};
+  int ret = _mdp_encode_address(inner, code_hash, hash_type, args,
+                                _mdp_text_buffer_feeder, &buffer);
+  // A streaming visit suspends once it reads data not received yet
+  _MDP_CHECK_READ();
+  if (ret != 0 || buffer.length != text_length) {
+    MDP_DEBUG("bech32m encoding process throws an error: %d!", ret);
+    MDP_RETURN_ERROR(MDP_ERROR_BECH32M);
+  }
+  victim->hash = hash;
+  victim->script_length = script_length;
+  victim->text_length = (uint32_t)text_length;
+  memcpy(victim->script, script, script_length);
+  victim->last_used = ++cache->clock;
+  return _mdp_send_bytes(inner, victim->text, text_length);
+}
+
+/* Sends an address encoded by bech32m, with hrp from context */
+int _mdp_send_address(_mdp_inner *inner, mol2_cursor_t code_hash,
+                      mol2_cursor_t hash_type, mol2_cursor_t args) {
+  if (inner->last_error != MDP_OK) {
+    return inner->last_error;
+  }
+  if (inner->output_mode == _MDP_OUTPUT_MEASURE) {
+    // Encoded data: index, code hash, hash type and args
+    size_t length = 0;
+    int ret = _mdp_bech32m_length(inner->context->hrp,
+                                  1 + 32 + 1 + (size_t)args.size, &length);
+    if (ret != 0) {
+      MDP_DEBUG("bech32m encoding process throws an error: %d!", ret);
+      MDP_RETURN_ERROR(MDP_ERROR_BECH32M);
+    }
+    return _mdp_count_output(inner, length);
+  }
+
+  mdp_address_cache *cache = inner->context->address_cache;
+  size_t script_length = (size_t)code_hash.size + hash_type.size + args.size;
+  if (cache != NULL && cache->capacity > 0 && _mdp_generates_text(inner) &&
+      script_length <= MDP_ADDRESS_CACHE_SCRIPT_LEN) {
+    size_t text_length = 0;
+    if (_mdp_bech32m_length(inner->context->hrp, 1 + script_length,
+                            &text_length) == 0 &&
+        text_length > 0 && text_length <= MDP_ADDRESS_CACHE_TEXT_LEN) {
+      return _mdp_send_cached_address(inner, cache, code_hash, hash_type,
+                                      args, text_length);
+    }
+  }
+
+  int ret = _mdp_encode_address(inner, code_hash, hash_type, args,
+                                _mdp_buffered_feeder, inner);
+  if (ret != 0) {
+    // Output stopped, as pull mode suspends once the caller's buffer is full
+    if (inner->last_error != MDP_OK) {
+      return inner->last_error;
+    }
+    MDP_DEBUG("bech32m encoding process throws an error: %d!", ret);
+    MDP_RETURN_ERROR(MDP_ERROR_BECH32M);
+  }
+  return inner->last_error;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ * Text renderer, generating the fixated text format from visiting events.
+ * The context of all events is _mdp_inner.
+ * ----------------------------------------------------------------------
+ */
+
+int _mdp_text_on_byte(void *context, const mdp_definition *t, uint8_t value) {
+  _mdp_inner *inner = (_mdp_inner *)context;
+  _mdp_send_indents(inner);
+  // Byte leaves print hex digits without leading zero
+  _mdp_send_literal(inner, "0x");
+  if (value < 0x10) {
+    return _mdp_send_bytes(inner, (const uint8_t *)&_MDP_HEX_DIGITS[value], 1);
+  }
+  return _mdp_send_hex(inner, &value, 1);
+}
+
+int _mdp_text_on_uint(void *context, const mdp_definition *t,
+                      uint64_t value) {
+  _mdp_inner *inner = (_mdp_inner *)context;
+  _mdp_send_indents(inner);
+  _mdp_send_name(inner, t->name, t->name_length);
+  _mdp_send_literal(inner, ": ");
+  return _mdp_send_number(inner, value);
+}
+
+int _mdp_text_on_bytes(void *context, const mdp_definition *t,
+                       mol2_cursor_t value) {
+  _mdp_inner *inner = (_mdp_inner *)context;
+  _mdp_send_indents(inner);
+  _mdp_send_name(inner, t->name, t->name_length);
+  if (t->builtin == MDP_BUILTIN_BYTE32) {
+    _mdp_send_literal(inner, ": 0x");
+    return _mdp_send_hex_cursor(inner, value);
+  }
+
+  if (t->kind == MDP_KIND_ARRAY) {
+    _mdp_send_literal(inner, "(array, len = ");
+  } else {
+    _mdp_send_literal(inner, "(fixvec, len = ");
+  }
+  _mdp_send_number(inner, value.size);
+  _mdp_send_literal(inner, "): [\n");
+  inner->indent_levels++;
+  _mdp_send_raw_bytes(inner, value);
+  inner->indent_levels--;
+  _mdp_send_indents(inner);
+  return _mdp_send_literal(inner, "]");
+}
+
+int _mdp_text_on_string(void *context, const mdp_definition *t,
+                        mol2_cursor_t value) {
+  _mdp_inner *inner = (_mdp_inner *)context;
+  _mdp_send_indents(inner);
+  _mdp_send_name(inner, t->name, t->name_length);
+  _mdp_send_literal(inner, ": \"");
+
+  // Validate utf8 string, then send the utf8 bytes directly. Replaying the
+  // trace sends the bytes without validation.
+  mol2_cursor_t cursors[1] = {value};
+  cursors_inputter_context inputter;
+  cursors_inputter_context_initialize(&inputter, cursors, 1);
+  int recorded = _mdp_trace_span(inner, _MDP_TRACE_RAW, value, 0);
+  int ret = MDP_VALIDATE_UTF8(cursors_inputter, &inputter,
+                              _mdp_buffered_feeder, inner);
+  _mdp_trace_end(inner, recorded);
+  if (ret != 0) {
+    if (inner->last_error != MDP_OK) {
+      return inner->last_error;
+    }
+    MDP_DEBUG("UTF8 Validation error: %d", ret);
+    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+  }
+  return _mdp_send_literal(inner, "\"");
+}
+
+int _mdp_text_on_address(void *context, const mdp_definition *t,
+                         mol2_cursor_t code_hash, mol2_cursor_t hash_type,
+                         mol2_cursor_t args) {
+  _mdp_inner *inner = (_mdp_inner *)context;
+  _mdp_send_indents(inner);
+  _mdp_send_name(inner, t->name, t->name_length);
+  _mdp_send_literal(inner, ": ");
+  return _mdp_send_address(inner, code_hash, hash_type, args);
+}
+
+int _mdp_text_on_option_begin(void *context, const mdp_definition *t,
+                              int some) {
+  _mdp_inner *inner = (_mdp_inner *)context;
+  _mdp_send_indents(inner);
+  _mdp_send_name(inner, t->name, t->name_length);
+  _mdp_send_literal(inner, "(option):");
+  if (!some) {
+    return _mdp_send_literal(inner, " None");
+  }
+  inner->indent_levels++;
+  return _mdp_send_newline(inner);
+}
+
+int _mdp_text_on_option_end(void *context, const mdp_definition *t,
+                            int some) {
+  _mdp_inner *inner = (_mdp_inner *)context;
+  if (some) {
+    inner->indent_levels--;
+  }
+  return inner->last_error;
+}
+
+int _mdp_text_on_union_begin(void *context, const mdp_definition *t,
+                             const mdp_field *variant) {
+  _mdp_inner *inner = (_mdp_inner *)context;
+  _mdp_send_indents(inner);
+  _mdp_send_name(inner, t->name, t->name_length);
+  _mdp_send_literal(inner, "(variant ");
+  _mdp_send_name(inner, variant->name, variant->name_length);
+  _mdp_send_literal(inner, ", id = ");
+  _mdp_send_number(inner, variant->id);
+  _mdp_send_literal(inner, "):\n");
+  inner->indent_levels++;
+  return inner->last_error;
+}
+
+/* Shared by all containers printing nothing at the end */
+int _mdp_text_on_container_end(void *context, const mdp_definition *t) {
+  _mdp_inner *inner = (_mdp_inner *)context;
+  inner->indent_levels--;
+  return inner->last_error;
+}
+
+int _mdp_text_on_struct_begin(void *context, const mdp_definition *t) {
+  _mdp_inner *inner = (_mdp_inner *)context;
+  _mdp_send_indents(inner);
+  _mdp_send_name(inner, t->name, t->name_length);
+  _mdp_send_literal(inner, "(struct):\n");
+  inner->indent_levels++;
+  return inner->last_error;
+}
+
+int _mdp_text_on_table_begin(void *context, const mdp_definition *t) {
+  _mdp_inner *inner = (_mdp_inner *)context;
+  _mdp_send_indents(inner);
+  _mdp_send_name(inner, t->name, t->name_length);
+  _mdp_send_literal(inner, "(table): {\n");
+  inner->indent_levels++;
+  return inner->last_error;
+}
+
+int _mdp_text_on_table_end(void *context, const mdp_definition *t,
+                           uint32_t shown) {
+  _mdp_inner *inner = (_mdp_inner *)context;
+  if (shown > 0) {
+    _mdp_send_literal(inner, "\n");
+  }
+  inner->indent_levels--;
+  _mdp_send_indents(inner);
+  return _mdp_send_literal(inner, "}");
+}
+
+int _mdp_text_on_field(void *context, const mdp_definition *t,
+                       const mdp_field *field, uint32_t position) {
+  _mdp_inner *inner = (_mdp_inner *)context;
+  // Struct fields are not separated
+  if (t->kind == MDP_KIND_TABLE && position > 0) {
+    _mdp_send_literal(inner, ",\n");
+  }
+  _mdp_send_indents(inner);
+  _mdp_send_name(inner, field->name, field->name_length);
+  _mdp_send_literal(inner, ":\n");
+  inner->indent_levels++;
+  return inner->last_error;
+}
+
+int _mdp_text_on_field_end(void *context, const mdp_definition *t,
+                           const mdp_field *field) {
+  _mdp_inner *inner = (_mdp_inner *)context;
+  inner->indent_levels--;
+  return inner->last_error;
+}
+
+int _mdp_text_on_vector_begin(void *context, const mdp_definition *t,
+                              uint32_t count) {
+  _mdp_inner *inner = (_mdp_inner *)context;
+  if (t->kind == MDP_KIND_DYNVEC && count == 0) {
+    // Empty dynvecs print nothing
+    return inner->last_error;
+  }
+  _mdp_send_indents(inner);
+  _mdp_send_name(inner, t->name, t->name_length);
+  if (t->kind == MDP_KIND_ARRAY) {
+    _mdp_send_literal(inner, "(array, len = ");
+  } else if (t->kind == MDP_KIND_FIXVEC) {
+    _mdp_send_literal(inner, "(fixvec, len = ");
+  } else {
+    _mdp_send_literal(inner, "(dynvec, len = ");
+  }
+  _mdp_send_number(inner, count);
+  _mdp_send_literal(inner, "): [\n");
+  inner->indent_levels++;
+  return inner->last_error;
+}
+
+int _mdp_text_on_item(void *context, const mdp_definition *t,
+                      uint32_t index) {
+  _mdp_inner *inner = (_mdp_inner *)context;
+  if (index > 0) {
+    return _mdp_send_literal(inner, ",\n");
+  }
+  return inner->last_error;
+}
+
+int _mdp_text_on_vector_end(void *context, const mdp_definition *t,
+                            uint32_t count) {
+  _mdp_inner *inner = (_mdp_inner *)context;
+  if (count == 0) {
+    if (t->kind == MDP_KIND_DYNVEC) {
+      return inner->last_error;
+    }
+  } else {
+    _mdp_send_literal(inner, "\n");
+  }
+  inner->indent_levels--;
+  _mdp_send_indents(inner);
+  return _mdp_send_literal(inner, "]");
+}
+
+int _mdp_text_on_finish(void *context) {
+  return _mdp_send_literal((_mdp_inner *)context, "\n");
+}
+
+const mdp_events _mdp_text_events = {
+    _mdp_text_on_byte,          _mdp_text_on_uint,
+    _mdp_text_on_bytes,         _mdp_text_on_string,
+    _mdp_text_on_address,       _mdp_text_on_option_begin,
+    _mdp_text_on_option_end,    _mdp_text_on_union_begin,
+    _mdp_text_on_container_end, _mdp_text_on_struct_begin,
+    _mdp_text_on_container_end, _mdp_text_on_table_begin,
+    _mdp_text_on_table_end,     _mdp_text_on_field,
+    _mdp_text_on_field_end,     _mdp_text_on_vector_begin,
+    _mdp_text_on_item,          _mdp_text_on_vector_end,
+    _mdp_text_on_finish,
+};
+
+/*
+ * ----------------------------------------------------------------------
+ * JSON renderer, generating JSON without whitespace from visiting events.
+ * The context of all events is _mdp_inner.
+ * ----------------------------------------------------------------------
+ */
+
+/* Sends the content of a cursor as a "0x" prefixed hex string */
+int _mdp_json_send_hex(_mdp_inner *inner, mol2_cursor_t value) {
+  _mdp_send_literal(inner, "\"0x");
+  _mdp_send_hex_cursor(inner, value);
+  return _mdp_send_literal(inner, "\"");
+}
+
+int _mdp_json_on_byte(void *context, const mdp_definition *t,
+                      uint8_t value) {
+  _mdp_inner *inner = (_mdp_inner *)context;
+  _mdp_send_literal(inner, "\"0x");
+  _mdp_send_hex(inner, &value, 1);
+  return _mdp_send_literal(inner, "\"");
+}
+
+int _mdp_json_on_uint(void *context, const mdp_definition *t,
+                      uint64_t value) {
+  return _mdp_send_number((_mdp_inner *)context, value);
+}
+
+int _mdp_json_on_bytes(void *context, const mdp_definition *t,
+                       mol2_cursor_t value) {
+  _mdp_inner *inner = (_mdp_inner *)context;
+  const mdp_elision *elision = inner->context->elision;
+  // Like text, Byte32 values are never elided
+  if (t->builtin == MDP_BUILTIN_BYTE32 || !_mdp_elides(elision, value.size)) {
+    return _mdp_json_send_hex(inner, value);
+  }
+
+  mol2_cursor_t preview = value;
+  preview.size = elision->preview;
+  _mdp_send_literal(inner, "{\"preview\":");
+  _mdp_json_send_hex(inner, preview);
+  _mdp_send_literal(inner, ",\"more\":");
+  _mdp_send_number(inner, value.size - elision->preview);
+  _mdp_send_literal(inner, ",\"digest\":\"0x");
+  _mdp_send_digest(inner, elision, value);
+  return _mdp_send_literal(inner, "\"}");
+}
+
+int _mdp_json_on_string(void *context, const mdp_definition *t,
+                        mol2_cursor_t value) {
+  _mdp_inner *inner = (_mdp_inner *)context;
+  _mdp_send_literal(inner, "\"");
+  _mdp_send_escaped(inner, value);
+  return _mdp_send_literal(inner, "\"");
+}
+
+int _mdp_json_on_address(void *context, const mdp_definition *t,
+                         mol2_cursor_t code_hash, mol2_cursor_t hash_type,
+                         mol2_cursor_t args) {
+  _mdp_inner *inner = (_mdp_inner *)context;
+  _mdp_send_literal(inner, "\"");
+  _mdp_send_address(inner, code_hash, hash_type, args);
+  return _mdp_send_literal(inner, "\"");
+}
+
+int _mdp_json_on_option_begin(void *context, const mdp_definition *t,
+                              int some) {
+  _mdp_inner *inner = (_mdp_inner *)context;
+  if (!some) {
+    return _mdp_send_literal(inner, "null");
+  }
+  return inner->last_error;
+}
+
+int _mdp_json_on_union_begin(void *context, const mdp_definition *t,
+                             const mdp_field *variant) {
+  _mdp_inner *inner = (_mdp_inner *)context;
+  _mdp_send_literal(inner, "{\"");
+  _mdp_send_name(inner, variant->name, variant->name_length);
+  return _mdp_send_literal(inner, "\":");
+}
+
+/* Shared by containers rendered as JSON objects */
+int _mdp_json_on_object_begin(void *context, const mdp_definition *t) {
+  return _mdp_send_literal((_mdp_inner *)context, "{");
+}
+
+int _mdp_json_on_object_end(void *context, const mdp_definition *t) {
+  return _mdp_send_literal((_mdp_inner *)context, "}");
+}
+
+int _mdp_json_on_table_end(void *context, const mdp_definition *t,
+                           uint32_t shown) {
+  return _mdp_send_literal((_mdp_inner *)context, "}");
+}
+
+int _mdp_json_on_field(void *context, const mdp_definition *t,
+                       const mdp_field *field, uint32_t position) {
+  _mdp_inner *inner = (_mdp_inner *)context;
+  _mdp_send_literal(inner, position > 0 ? ",\"" : "\"");
+  _mdp_send_name(inner, field->name, field->name_length);
+  return _mdp_send_literal(inner, "\":");
+}
+
+int _mdp_json_on_vector_begin(void *context, const mdp_definition *t,
+                              uint32_t count) {
+  return _mdp_send_literal((_mdp_inner *)context, "[");
+}
+
+int _mdp_json_on_item(void *context, const mdp_definition *t,
+                      uint32_t index) {
+  _mdp_inner *inner = (_mdp_inner *)context;
+  if (index > 0) {
+    return _mdp_send_literal(inner, ",");
+  }
+  return inner->last_error;
+}
+
+int _mdp_json_on_vector_end(void *context, const mdp_definition *t,
+                            uint32_t count) {
+  return _mdp_send_literal((_mdp_inner *)context, "]");
+}
+
+const mdp_events _mdp_json_events = {
+    _mdp_json_on_byte,        _mdp_json_on_uint,
+    _mdp_json_on_bytes,       _mdp_json_on_string,
+    _mdp_json_on_address,     _mdp_json_on_option_begin,
+    NULL,                     _mdp_json_on_union_begin,
+    _mdp_json_on_object_end,  _mdp_json_on_object_begin,
+    _mdp_json_on_object_end,  _mdp_json_on_object_begin,
+    _mdp_json_on_table_end,   _mdp_json_on_field,
+    NULL,                     _mdp_json_on_vector_begin,
+    _mdp_json_on_item,        _mdp_json_on_vector_end,
+    NULL,
+};
+
+/*
+ * ----------------------------------------------------------------------
+ * Compact renderer, generating the canonical compact text format from
+ * visiting events. Strings, numbers, objects and arrays are rendered like
+ * JSON. The context of all events is _mdp_inner.
+ * ----------------------------------------------------------------------
+ */
+
+int _mdp_compact_on_byte(void *context, const mdp_definition *t,
+                         uint8_t value) {
+  _mdp_inner *inner = (_mdp_inner *)context;
+  _mdp_send_literal(inner, "0x");
+  return _mdp_send_hex(inner, &value, 1);
+}
+
+int _mdp_compact_on_bytes(void *context, const mdp_definition *t,
+                          mol2_cursor_t value) {
+  _mdp_inner *inner = (_mdp_inner *)context;
+  const mdp_elision *elision = inner->context->elision;
+  _mdp_send_literal(inner, "0x");
+  // Like text, Byte32 values are never elided
+  if (t->builtin == MDP_BUILTIN_BYTE32 || !_mdp_elides(elision, value.size)) {
+    return _mdp_send_hex_cursor(inner, value);
+  }
+
+  mol2_cursor_t preview = value;
+  preview.size = elision->preview;
+  _mdp_send_hex_cursor(inner, preview);
+  _mdp_send_literal(inner, "...(+");
+  _mdp_send_number(inner, value.size - elision->preview);
+  _mdp_send_literal(inner, " bytes, digest 0x");
+  _mdp_send_digest(inner, elision, value);
+  return _mdp_send_literal(inner, ")");
+}
+
+int _mdp_compact_on_address(void *context, const mdp_definition *t,
+                            mol2_cursor_t code_hash, mol2_cursor_t hash_type,
+                            mol2_cursor_t args) {
+  return _mdp_send_address((_mdp_inner *)context, code_hash, hash_type, args);
+}
+
+int _mdp_compact_on_option_begin(void *context, const mdp_definition *t,
+                                 int some) {
+  _mdp_inner *inner = (_mdp_inner *)context;
+  if (!some) {
+    return _mdp_send_literal(inner, "None");
+  }
+  return inner->last_error;
+}
+
+int _mdp_compact_on_union_begin(void *context, const mdp_definition *t,
+                                const mdp_field *variant) {
+  _mdp_inner *inner = (_mdp_inner *)context;
+  _mdp_send_name(inner, variant->name, variant->name_length);
+  return _mdp_send_literal(inner, "(");
+}
+
+int _mdp_compact_on_union_end(void *context, const mdp_definition *t) {
+  return _mdp_send_literal((_mdp_inner *)context, ")");
+}
+
+int _mdp_compact_on_field(void *context, const mdp_definition *t,
+                          const mdp_field *field, uint32_t position) {
+  _mdp_inner *inner = (_mdp_inner *)context;
+  if (position > 0) {
+    _mdp_send_literal(inner, ",");
+  }
+  _mdp_send_name(inner, field->name, field->name_length);
+  return _mdp_send_literal(inner, ":");
+}
+
+const mdp_events _mdp_compact_events = {
+    _mdp_compact_on_byte,        _mdp_json_on_uint,
+    _mdp_compact_on_bytes,       _mdp_json_on_string,
+    _mdp_compact_on_address,     _mdp_compact_on_option_begin,
+    NULL,                        _mdp_compact_on_union_begin,
+    _mdp_compact_on_union_end,   _mdp_json_on_object_begin,
+    _mdp_json_on_object_end,     _mdp_json_on_object_begin,
+    _mdp_json_on_table_end,      _mdp_compact_on_field,
+    NULL,                        _mdp_json_on_vector_begin,
+    _mdp_json_on_item,           _mdp_json_on_vector_end,
+    NULL,
+};
+
+/*
+ * ----------------------------------------------------------------------
+ * Visitors, validating data and emitting events.
+ * ----------------------------------------------------------------------
+ */
+
+/* Used when text is only validated */
+int _mdp_discarding_feeder(const uint8_t *data, size_t length,
+                           void *feeder_context) {
+  return 0;
+}
+
+/* Converts the result of an event to an error */
+int _mdp_emitted(_mdp_inner *inner, int ret) {
+  if (ret != 0 && inner->last_error == MDP_OK) {
+    MDP_DEBUG("Event consumer error: %d\n", ret);
+    MDP_SET_ERROR(MDP_ERROR_FEEDER);
+  }
+  return inner->last_error;
+}
+
+/* Emits an event, nothing is emitted while output is disabled */
+#define _MDP_EMIT(event, ...)                                     \
+  ((inner->last_error != MDP_OK ||                                \
+    inner->output_mode == _MDP_OUTPUT_NONE ||                     \
+    inner->events->event == NULL)                                 \
+       ? inner->last_error                                        \
+       : _mdp_emitted(inner, inner->events->event(                \
+                                 inner->events_context, __VA_ARGS__)))
+
+int _mdp_visit_byte(_mdp_inner *inner, _mdp_frame *f,
+                    const mdp_definition *t) {
+  if (inner->output_mode == _MDP_OUTPUT_NONE) {
+    if (f->value.size < 1) {
+      MDP_DEBUG("Reading a single byte from cursor results in error!\n");
+      MDP_RETURN_ERROR(MDP_ERROR_MOL2_IO);
+    }
+    return _mdp_pop(inner, 1);
+  }
+
+  uint8_t c;
+  if (mol2_read_at(&f->value, &c, 1) != 1) {
+    MDP_DEBUG("Reading a single byte from cursor results in error!\n");
+    MDP_RETURN_ERROR(MDP_ERROR_MOL2_IO);
+  }
+  _MDP_CHECK_READ();
+  _MDP_EMIT(on_byte, t, c);
+  return _mdp_pop(inner, 1);
+}
+
+int _mdp_visit_option(_mdp_inner *inner, _mdp_frame *f,
+                      const mdp_definition *t) {
+  if (f->phase == _MDP_PHASE_RESUME) {
+    _MDP_EMIT(on_option_end, t, 1);
+    return _mdp_pop(inner, inner->consumed);
+  }
+
+  if (f->value.size > 0) {
+    /* Some */
+    _MDP_EMIT(on_option_begin, t, 1);
+    return _mdp_push(inner, t->item, f->value);
+  }
+  /* None */
+  _MDP_EMIT(on_option_begin, t, 0);
+  _MDP_EMIT(on_option_end, t, 0);
+  return _mdp_pop(inner, 0);
+}
+
+int _mdp_visit_address(_mdp_inner *inner, _mdp_frame *f,
+                       const mdp_definition *t, mol2_num_t union_id) {
+  if (union_id != 0) {
+    MDP_DEBUG("Address type only supports Script variant for now");
+    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+  }
+  // Now we can simply treat the content of the cursor as a table
+  // of 3 items.
+  mol2_cursor_t script_table_value = f->value;
+  mol2_add_offset(&script_table_value, 4);
+  mol2_sub_size(&script_table_value, 4);
+  if (script_table_value.size < 16) {
+    MDP_DEBUG("Invalid address type!");
+    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+  }
+
+  mol2_num_t full_size = mol2_unpack_number(&script_table_value);
+  mol2_num_t offsets[3];
+  for (int i = 0; i < 3; i++) {
+    mol2_cursor_t c = script_table_value;
+    mol2_add_offset(&c, 4 + 4 * i);
+    offsets[i] = mol2_unpack_number(&c);
+  }
+  _MDP_CHECK_READ();
+  if (full_size > script_table_value.size || offsets[0] != 16 ||
+      offsets[1] < offsets[0] || offsets[2] < offsets[1] ||
+      full_size < offsets[2]) {
+    MDP_DEBUG("Invalid address type!");
+    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+  }
+  mol2_cursor_t code_hash = script_table_value;
+  mol2_add_offset(&code_hash, offsets[0]);
+  code_hash.size = offsets[1] - offsets[0];
+  if (code_hash.size != 32) {
+    MDP_DEBUG("Invalid code hash in address type!");
+    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+  }
+  mol2_cursor_t hash_type = script_table_value;
+  mol2_add_offset(&hash_type, offsets[1]);
+  hash_type.size = offsets[2] - offsets[1];
+  if (hash_type.size != 1) {
+    MDP_DEBUG("Invalid hash type in address type!");
+    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+  }
+  mol2_cursor_t args = script_table_value;
+  mol2_add_offset(&args, offsets[2]);
+  args.size = full_size - offsets[2];
+  if (args.size < 4) {
+    MDP_DEBUG("Invalid args in address type!");
+    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+  }
+  mol2_num_t args_length = mol2_unpack_number(&args);
+  _MDP_CHECK_READ();
+  if (args.size - 4 != args_length) {
+    MDP_DEBUG("Invalid args length in address type!");
+    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+  }
+
+  _MDP_EMIT(on_address, t, code_hash, hash_type, args);
+  return _mdp_pop(inner, full_size + 4);
+}
+
+int _mdp_visit_union(_mdp_inner *inner, _mdp_frame *f,
+                     const mdp_definition *t) {
+  if (f->phase == _MDP_PHASE_RESUME) {
+    mol2_num_t consumed_size = inner->consumed + 4;
+    _MDP_EMIT(on_union_end, t);
+    return _mdp_pop(inner, consumed_size);
+  }
+
+  if (f->value.size < 4) {
+    MDP_DEBUG(
+        "Union requires at least 4 bytes for ID but the value only has length: "
+        "%u\n",
+        f->value.size);
+    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+  }
+  mol2_num_t union_id = mol2_unpack_number(&f->value);
+  _MDP_CHECK_READ();
+  const mdp_field *variant = NULL;
+  for (uint32_t i = 0; i < t->field_count; i++) {
+    if (inner->schema->fields[t->first_field + i].id == (uint64_t)union_id) {
+      variant = &inner->schema->fields[t->first_field + i];
+      break;
+    }
+  }
+  if (variant == NULL) {
+    MDP_DEBUG("Cannot find union variant with ID %u\n", union_id);
+    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+  }
+
+  if (t->builtin == MDP_BUILTIN_ADDRESS) {
+    return _mdp_visit_address(inner, f, t, union_id);
+  }
+
+  mol2_cursor_t value2 = f->value;
+  mol2_add_offset(&value2, 4);
+  mol2_sub_size(&value2, 4);
+
+  _MDP_EMIT(on_union_begin, t, variant);
+  return _mdp_push(inner, variant->type, value2);
+}
+
+int _mdp_visit_array(_mdp_inner *inner, _mdp_frame *f,
+                     const mdp_definition *t) {
+  if (f->phase == _MDP_PHASE_ENTER) {
+    uint64_t item_count64 = t->item_count;
+    if (item_count64 > 0xFFFFFFFF || item_count64 == 0) {
+      MDP_DEBUG("Item count %ld is invalid!\n", item_count64);
+      MDP_RETURN_ERROR(MDP_ERROR_SCHEMA_ENCODING);
+    }
+    mol2_num_t item_count = (mol2_num_t)item_count64;
+    if ((f->value.size % item_count) != 0) {
+      MDP_DEBUG(
+          "Array should have %u items, but the length %u cannot be divided by "
+          "item count\n",
+          item_count, f->value.size);
+      MDP_RETURN_ERROR(MDP_ERROR_SCHEMA_ENCODING);
+    }
+
+    // handle builtin types here
+    if (t->builtin == MDP_BUILTIN_BYTE32) {
+      if (item_count != 32) {
+        MDP_DEBUG(
+            "Byte32 must be an array of 32 bytes, but the schema differs");
+        MDP_RETURN_ERROR(MDP_ERROR_SCHEMA_ENCODING);
+      }
+      if (f->value.size < 32) {
+        MDP_DEBUG("Byte32 has invalid length %u!\n", f->value.size);
+        MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+      }
+      mol2_cursor_t value2 = f->value;
+      value2.size = 32;
+      _MDP_EMIT(on_bytes, t, value2);
+      return _mdp_pop(inner, 32);
+    }
+    if (t->builtin == MDP_BUILTIN_UINT64) {
+      if (item_count != 8) {
+        MDP_DEBUG("Uint64 must be an array of 8 bytes, but the schema differs");
+        MDP_RETURN_ERROR(MDP_ERROR_SCHEMA_ENCODING);
+      }
+      if (f->value.size < 8) {
+        MDP_DEBUG("Uint64 has invalid length %u!\n", f->value.size);
+        MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+      }
+      if (inner->output_mode == _MDP_OUTPUT_NONE) {
+        return _mdp_pop(inner, 8);
+      }
+      // Assuming little-endian here
+      uint64_t data;
+      if (mol2_read_at(&f->value, (uint8_t *)(&data), 8) != 8) {
+        MDP_DEBUG("Reading 8 bytes from cursor results in error!\n");
+        MDP_RETURN_ERROR(MDP_ERROR_MOL2_IO);
+      }
+      _MDP_CHECK_READ();
+      _MDP_EMIT(on_uint, t, data);
+      return _mdp_pop(inner, 8);
+    }
+
+    // Sub-type is not a builtin one, visit its content recursively
+    if (t->item == MDP_TYPE_BYTE) {
+      if (f->value.size < item_count) {
+        MDP_DEBUG("Byte array of %u items has invalid length %u!\n",
+                  item_count, f->value.size);
+        MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+      }
+
+      mol2_cursor_t value2 = f->value;
+      value2.size = item_count;
+      _MDP_EMIT(on_bytes, t, value2);
+      return _mdp_pop(inner, item_count);
+    }
+    _MDP_EMIT(on_vector_begin, t, item_count);
+    f->total_consumed = 0;
+    f->index = 0;
+    f->count = item_count;
+  } else {
+    mol2_num_t current_consumed = inner->consumed;
+    mol2_num_t available = f->value.size - f->total_consumed;
+    if (current_consumed > available) {
+      MDP_DEBUG(
+          "Array item %u consumed %u bytes but buffer only has %u bytes\n",
+          f->index, current_consumed, available);
+      MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+    }
+    f->total_consumed += current_consumed;
+    f->index++;
+  }
+
+  if (f->index < f->count) {
+    mol2_cursor_t value2 = f->value;
+    mol2_add_offset(&value2, f->total_consumed);
+    mol2_sub_size(&value2, f->total_consumed);
+    _MDP_EMIT(on_item, t, f->index);
+    return _mdp_push(inner, t->item, value2);
+  }
+  _MDP_EMIT(on_vector_end, t, f->count);
+  return _mdp_pop(inner, f->total_consumed);
+}
+
+int _mdp_visit_struct(_mdp_inner *inner, _mdp_frame *f,
+                      const mdp_definition *t) {
+  if (f->phase == _MDP_PHASE_ENTER) {
+    _MDP_EMIT(on_struct_begin, t);
+    f->total_consumed = 0;
+    f->index = 0;
+    f->shown = 0;
+  } else {
+    mol2_num_t current_consumed = inner->consumed;
+    mol2_num_t available = f->value.size - f->total_consumed;
+    if (current_consumed > available) {
+      MDP_DEBUG(
+          "Struct item #%u consumed %u bytes but buffer only has %u bytes\n",
+          f->index, current_consumed, available);
+      MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+    }
+    f->total_consumed += current_consumed;
+    uint32_t field_index = t->first_field + f->index;
+    if (!_mdp_field_hidden(inner, field_index)) {
+      _MDP_EMIT(on_field_end, t, &inner->schema->fields[field_index]);
+    }
+    f->index++;
+  }
+
+  while (f->index < t->field_count) {
+    uint32_t field_index = t->first_field + f->index;
+    const mdp_field *field = &inner->schema->fields[field_index];
+    mol2_cursor_t value2 = f->value;
+    mol2_add_offset(&value2, f->total_consumed);
+    mol2_sub_size(&value2, f->total_consumed);
+    if (!_mdp_field_hidden(inner, field_index)) {
+      _MDP_EMIT(on_field, t, field, f->shown);
+      f->shown++;
+      return _mdp_push(inner, field->type, value2);
+    }
+
+    uint32_t size = _mdp_fixed_size(inner->schema, field->type);
+    if (!inner->context->projection->skip_hidden || size == 0) {
+      return _mdp_push_hidden(inner, field->type, value2);
+    }
+    // Skipped by size without validation
+    if (size > value2.size) {
+      MDP_DEBUG("Struct item #%u requires %u bytes but buffer only has %u\n",
+                f->index, size, value2.size);
+      MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+    }
+    f->total_consumed += size;
+    f->index++;
+  }
+  _MDP_EMIT(on_struct_end, t);
+  return _mdp_pop(inner, f->total_consumed);
+}
+
+#ifdef MDP_PARALLEL
+/*
+ * Called once items of vector f are about to be pushed. When the vector
+ * qualifies, all its items are rendered in parts on multiple threads, leaving
+ * f past its last item. Otherwise nothing is done.
+ */
+int _mdp_split_vector(_mdp_inner *inner, _mdp_frame *f,
+                      const mdp_definition *t);
+#endif
+
+/* Checks the size consumed by a finished fixvec item */
+int _mdp_finish_fixvec_item(_mdp_inner *inner, _mdp_frame *f) {
+  mol2_num_t current_consumed = inner->consumed;
+  mol2_num_t available = f->value.size - f->total_consumed;
+  if (current_consumed > available) {
+    MDP_DEBUG(
+        "Fixvec item %u consumed %u bytes but buffer only has %u bytes\n",
+        f->index, current_consumed, available);
+    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+  }
+  f->total_consumed += current_consumed;
+  return inner->last_error;
+}
+
+int _mdp_visit_fixvec(_mdp_inner *inner, _mdp_frame *f,
+                      const mdp_definition *t) {
+  if (f->phase == _MDP_PHASE_ENTER) {
+    if (f->value.size < 4) {
+      MDP_DEBUG(
+          "Fixvec requires at least 4 bytes for item count but the value only "
+          "has length: "
+          "%u\n",
+          f->value.size);
+      MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+    }
+    mol2_num_t item_count = mol2_unpack_number(&f->value);
+    _MDP_CHECK_READ();
+
+    // Handle String builtin type
+    if (t->builtin == MDP_BUILTIN_STRING) {
+      // String is a vector of byte
+      if (t->item != MDP_TYPE_BYTE) {
+        MDP_DEBUG("String is a vector of bytes but schema differs!\n");
+        MDP_RETURN_ERROR(MDP_ERROR_SCHEMA_ENCODING);
+      }
+      if ((uint64_t)f->value.size < (uint64_t)item_count + 4) {
+        MDP_DEBUG("String of %u items has invalid length %u!\n", item_count,
+                  f->value.size);
+        MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+      }
+
+      mol2_cursor_t value2 = f->value;
+      mol2_add_offset(&value2, 4);
+      value2.size = item_count;
+
+      // Text is validated by the text renderer while generated
+      if (inner->output_mode == _MDP_OUTPUT_NONE ||
+          inner->events != &_mdp_text_events) {
+        mol2_cursor_t cursors[1] = {value2};
+        cursors_inputter_context inputter;
+        cursors_inputter_context_initialize(&inputter, cursors, 1);
+        int ret = MDP_VALIDATE_UTF8(cursors_inputter, &inputter,
+                                    _mdp_discarding_feeder, NULL);
+        if (ret != 0) {
+          _MDP_CHECK_READ();
+          MDP_DEBUG("UTF8 Validation error: %d", ret);
+          MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+        }
+      }
+      _MDP_EMIT(on_string, t, value2);
+      return _mdp_pop(inner, item_count + 4);
+    }
+
+    if (t->item == MDP_TYPE_BYTE) {
+      if ((uint64_t)f->value.size < (uint64_t)item_count + 4) {
+        MDP_DEBUG("Byte vec of %u items has invalid length %u!\n", item_count,
+                  f->value.size);
+        MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+      }
+
+      mol2_cursor_t value2 = f->value;
+      mol2_add_offset(&value2, 4);
+      value2.size = item_count;
+      _MDP_EMIT(on_bytes, t, value2);
+      return _mdp_pop(inner, item_count + 4);
+    }
+    _MDP_EMIT(on_vector_begin, t, item_count);
+    f->total_consumed = 4;
+    f->index = 0;
+    f->count = item_count;
+#ifdef MDP_PARALLEL
+    if (_mdp_split_vector(inner, f, t) != MDP_OK) {
+      return inner->last_error;
+    }
+#endif
+  } else {
+    if (_mdp_finish_fixvec_item(inner, f) != MDP_OK) {
+      return inner->last_error;
+    }
+    f->index++;
+  }
+
+  if (f->index < f->count) {
+    mol2_cursor_t value2 = f->value;
+    mol2_add_offset(&value2, f->total_consumed);
+    mol2_sub_size(&value2, f->total_consumed);
+    _MDP_EMIT(on_item, t, f->index);
+    return _mdp_push(inner, t->item, value2);
+  }
+  _MDP_EMIT(on_vector_end, t, f->count);
+  return _mdp_pop(inner, f->total_consumed);
+}
+
+/*
+ * Locates the next item of a dynvec or table via the offsets header, the
+ * exact size of the item is kept in the frame so it can be checked once the
+ * item finishes.
+ */
+int _mdp_next_dynamic_item(_mdp_inner *inner, _mdp_frame *f,
+                           const char *kind, mol2_cursor_t *value) {
+  mol2_num_t end;
+  if (f->index < f->count - 1) {
+    mol2_cursor_t tvalue = f->value;
+    mol2_add_offset(&tvalue, 4 + 4 * (f->index + 1));
+    end = mol2_unpack_number(&tvalue);
+    _MDP_CHECK_READ();
+  } else {
+    end = f->full_size;
+  }
+  if (end < f->total_consumed || end > f->value.size) {
+    MDP_DEBUG("%s %u has invalid offset: (%u, %u)!\n", kind, f->index,
+              f->total_consumed, end);
+    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+  }
+
+  *value = f->value;
+  mol2_add_offset(value, f->total_consumed);
+  value->size = end - f->total_consumed;
+  f->expected = value->size;
+  return inner->last_error;
+}
+
+/* Pushes the next item of a dynvec or table */
+int _mdp_push_dynamic_item(_mdp_inner *inner, _mdp_frame *f, uint32_t type,
+                           const char *kind) {
+  mol2_cursor_t value2;
+  if (_mdp_next_dynamic_item(inner, f, kind, &value2) != MDP_OK) {
+    return inner->last_error;
+  }
+  return _mdp_push(inner, type, value2);
+}
+
+/*
+ * Parses the offsets header shared by dynvec and table, the number of
+ * items is kept in the frame.
+ */
+int _mdp_parse_dynamic_header(_mdp_inner *inner, _mdp_frame *f,
+                              const char *kind) {
+  mol2_cursor_t tvalue = f->value;
+  mol2_add_offset(&tvalue, 4);
+  mol2_num_t first_offset = mol2_unpack_number(&tvalue);
+  _MDP_CHECK_READ();
+  if ((first_offset % 4) != 0 || first_offset < 8) {
+    MDP_DEBUG("Invalid %s first offset: %u!\n", kind, first_offset);
+    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+  }
+
+  f->count = first_offset / 4 - 1;
+  if (f->value.size < 4 * (f->count + 1)) {
+    MDP_DEBUG(
+        "A %s of %u items requires minimal %u bytes, but actual length is "
+        "%u!\n",
+        kind, f->count, 4 * (f->count + 1), f->value.size);
+    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+  }
+  f->total_consumed = first_offset;
+  f->index = 0;
+  return inner->last_error;
+}
+
+/* Checks a finished dynvec item consumed exactly its size in the header */
+int _mdp_finish_dynvec_item(_mdp_inner *inner, _mdp_frame *f) {
+  mol2_num_t current_consumed = inner->consumed;
+  if (current_consumed != f->expected) {
+    MDP_DEBUG(
+        "Dynvec item %u consumed incorrect bytes, actual: %u, expected: %u\n",
+        f->index, current_consumed, f->expected);
+    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+  }
+  f->total_consumed += current_consumed;
+  return inner->last_error;
+}
+
+int _mdp_visit_dynvec(_mdp_inner *inner, _mdp_frame *f,
+                      const mdp_definition *t) {
+  if (f->phase == _MDP_PHASE_ENTER) {
+    if (f->value.size < 4) {
+      MDP_DEBUG(
+          "Dynvec requires at least 4 bytes for full size but the value only "
+          "has length: "
+          "%u\n",
+          f->value.size);
+      MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+    }
+    f->full_size = mol2_unpack_number(&f->value);
+    _MDP_CHECK_READ();
+    if (f->full_size > f->value.size) {
+      MDP_DEBUG("Dynvec requires %u bytes but buffer only has %u bytes!\n",
+                f->full_size, f->value.size);
+      MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+    }
+
+    if (f->full_size == 4) {
+      // Empty vec
+      _MDP_EMIT(on_vector_begin, t, 0);
+      _MDP_EMIT(on_vector_end, t, 0);
+      return _mdp_pop(inner, 4);
+    }
+    if (f->full_size < 8) {
+      MDP_DEBUG(
+          "Non-empty dynvec requires an offset at least, but length %u is not "
+          "enough!\n",
+          f->full_size);
+      MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+    }
+    if (_mdp_parse_dynamic_header(inner, f, "dynvec") != MDP_OK) {
+      return inner->last_error;
+    }
+
+    _MDP_EMIT(on_vector_begin, t, f->count);
+#ifdef MDP_PARALLEL
+    if (_mdp_split_vector(inner, f, t) != MDP_OK) {
+      return inner->last_error;
+    }
+#endif
+  } else {
+    if (_mdp_finish_dynvec_item(inner, f) != MDP_OK) {
+      return inner->last_error;
+    }
+    f->index++;
+  }
+
+  if (f->index < f->count) {
+    _MDP_EMIT(on_item, t, f->index);
+    return _mdp_push_dynamic_item(inner, f, t->item, "Dynvec item");
+  }
+  if (f->total_consumed != f->full_size) {
+    MDP_DEBUG("Dynvec's full size is %u but only consumed %u bytes!\n",
+              f->full_size, f->total_consumed);
+    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+  }
+
+  _MDP_EMIT(on_vector_end, t, f->count);
+  return _mdp_pop(inner, f->total_consumed);
+}
+
+int _mdp_visit_table(_mdp_inner *inner, _mdp_frame *f,
+                     const mdp_definition *t) {
+  if (f->phase == _MDP_PHASE_ENTER) {
+    if (f->value.size < 8) {
+      MDP_DEBUG(
+          "Table requires at least 8 bytes for full size but the value only "
+          "has length: "
+          "%u\n",
+          f->value.size);
+      MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+    }
+    f->full_size = mol2_unpack_number(&f->value);
+    _MDP_CHECK_READ();
+    if (f->full_size > f->value.size) {
+      MDP_DEBUG("Table requires %u bytes but buffer only has %u bytes!\n",
+                f->full_size, f->value.size);
+      MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+    }
+
+    if (f->full_size < 8) {
+      MDP_DEBUG(
+          "Table requires an offset at least, but length %u is not "
+          "enough!\n",
+          f->full_size);
+      MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+    }
+    if (_mdp_parse_dynamic_header(inner, f, "table") != MDP_OK) {
+      return inner->last_error;
+    }
+
+    if (f->count != t->field_count) {
+      /* TODO: do we need compatible support? */
+      MDP_DEBUG("Table requires %u fields, but actual data has %u fields!\n",
+                t->field_count, f->count);
+      MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+    }
+
+    _MDP_EMIT(on_table_begin, t);
+    f->shown = 0;
+  } else {
+    mol2_num_t current_consumed = inner->consumed;
+    if (current_consumed != f->expected) {
+      MDP_DEBUG(
+          "Table field %u consumed incorrect bytes, actual: %u, expected: "
+          "%u\n",
+          f->index, current_consumed, f->expected);
+      MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+    }
+    f->total_consumed += current_consumed;
+    uint32_t field_index = t->first_field + f->index;
+    if (!_mdp_field_hidden(inner, field_index)) {
+      _MDP_EMIT(on_field_end, t, &inner->schema->fields[field_index]);
+    }
+    f->index++;
+  }
+
+  while (f->index < f->count) {
+    uint32_t field_index = t->first_field + f->index;
+    const mdp_field *field = &inner->schema->fields[field_index];
+    mol2_cursor_t value2;
+    if (_mdp_next_dynamic_item(inner, f, "Table field", &value2) != MDP_OK) {
+      return inner->last_error;
+    }
+    if (!_mdp_field_hidden(inner, field_index)) {
+      _MDP_EMIT(on_field, t, field, f->shown);
+      f->shown++;
+      return _mdp_push(inner, field->type, value2);
+    }
+    if (!inner->context->projection->skip_hidden) {
+      return _mdp_push_hidden(inner, field->type, value2);
     }
+    // Skipped by offsets without validation
+    f->total_consumed += value2.size;
+    f->index++;
   }
-  MDP_DEBUG("Cannot find union variant with ID %u\n", union_id);
-  return MDP_ERROR_MOLECULE_ENCODING;
+  if (f->total_consumed != f->full_size) {
+    MDP_DEBUG("Table's full size is %u but only consumed %u bytes!\n",
+              f->full_size, f->total_consumed);
+    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+  }
+  _MDP_EMIT(on_table_end, t, f->shown);
+  return _mdp_pop(inner, f->total_consumed);
 }
 
-typedef struct {
-  mdp_context *context;
-  struct DefinitionsType defs;
-  size_t indent_levels;
-  int last_error;
-} _mdp_inner;
+/*
+ * Locates the bytes spanned by the value of f. Returns 0 when the value is
+ * too small to be worth caching, or its size is only known once visited.
+ */
+int _mdp_fragment_span(_mdp_inner *inner, _mdp_frame *f,
+                       const mdp_definition *t, mol2_cursor_t *span) {
+  uint64_t size = 0;
+  switch (t->kind) {
+    case MDP_KIND_ARRAY:
+    case MDP_KIND_STRUCT:
+      if (t->builtin == MDP_BUILTIN_BYTE32 ||
+          t->builtin == MDP_BUILTIN_UINT64) {
+        return 0;
+      }
+      size = t->fixed_size;
+      break;
+    case MDP_KIND_FIXVEC: {
+      uint32_t item_size = _mdp_fixed_size(inner->schema, t->item);
+      if (f->value.size < 4 || item_size == 0) {
+        return 0;
+      }
+      size = 4 + (uint64_t)mol2_unpack_number(&f->value) * item_size;
+    } break;
+    case MDP_KIND_DYNVEC:
+    case MDP_KIND_TABLE:
+      if (f->value.size < 4) {
+        return 0;
+      }
+      size = mol2_unpack_number(&f->value);
+      break;
+    case MDP_KIND_OPTION:
+    case MDP_KIND_UNION:
+      size = f->value.size;
+      break;
+    default:
+      return 0;
+  }
+  if (size < MDP_FRAGMENT_MIN_SIZE || size > f->value.size) {
+    return 0;
+  }
+  *span = f->value;
+  span->size = (mol2_num_t)size;
+  return 1;
+}
 
-int _mdp_send_cursor_to_feeder(_mdp_inner *inner, mol2_cursor_t c) {
-  if (inner->last_error != MDP_OK) {
-    return inner->last_error;
+/* Sends the text of a fragment, indented from current indent levels */
+int _mdp_fragment_send(_mdp_inner *inner, const mdp_fragment *e,
+                       const uint8_t *slot) {
+  const uint32_t *marks = (const uint32_t *)slot;
+  const uint8_t *text = &slot[e->mark_count * 8 + e->size];
+  size_t levels = inner->indent_levels;
+  uint32_t sent = 0;
+  for (uint32_t i = 0; i < e->mark_count; i++) {
+    _mdp_send_bytes(inner, &text[sent], marks[i * 2] - sent);
+    sent = marks[i * 2];
+    inner->indent_levels = levels + marks[i * 2 + 1];
+    _mdp_send_indents(inner);
   }
+  inner->indent_levels = levels;
+  return _mdp_send_bytes(inner, &text[sent], e->text_length - sent);
+}
 
-  uint8_t buf[MDP_BUFFER_LEN];
-  while (c.size > 0) {
-    uint32_t read = mol2_read_at(&c, buf, MDP_BUFFER_LEN);
+/*
+ * Looks up the value of f in the fragment cache before it is visited. When
+ * found, its text is sent and f finishes at once, returning 1. Otherwise
+ * its text starts being captured, to be kept once f finishes.
+ */
+int _mdp_fragment_enter(_mdp_inner *inner, _mdp_frame *f,
+                        const mdp_definition *t) {
+  mdp_fragment_cache *cache = inner->fragments;
+  mol2_cursor_t span;
+  if (!_mdp_fragment_span(inner, f, t, &span)) {
+    return 0;
+  }
+  if (span.size > cache->slot_size) {
+    cache->oversized++;
+    return 0;
+  }
+  uint64_t hash =
+      _mdp_hash_update(_MDP_HASH_INIT, (const uint8_t *)&f->type, 4);
+  mol2_cursor_t rest = span;
+  while (rest.size > 0) {
+    uint8_t buf[MDP_BUFFER_LEN];
+    uint32_t read = mol2_read_at(&rest, buf, MDP_BUFFER_LEN);
     if (read == 0) {
-      MDP_RETURN_ERROR(MDP_ERROR_MOL2_IO);
+      // Left to the visitor to report
+      return 0;
     }
-    int ret = inner->context->feeder(buf, (size_t)read,
-                                     inner->context->feeder_context);
-    if (ret != 0) {
-      MDP_DEBUG("Feeder error when sending a full cursor: %d\n", ret);
-      MDP_RETURN_ERROR(MDP_ERROR_FEEDER);
-      return inner->last_error;
+    hash = _mdp_hash_update(hash, buf, read);
+    mol2_add_offset(&rest, read);
+    mol2_sub_size(&rest, read);
+  }
+
+  mdp_fragment *set =
+      &cache->entries[(hash % cache->set_count) * MDP_FRAGMENT_CACHE_WAYS];
+  const mdp_budget *budget = &inner->context->budget;
+  for (uint32_t i = 0; i < MDP_FRAGMENT_CACHE_WAYS; i++) {
+    mdp_fragment *e = &set[i];
+    if (e->last_used == 0 || e->hash != hash || e->type != f->type ||
+        e->size != span.size) {
+      continue;
     }
-    mol2_add_offset(&c, read);
-    mol2_sub_size(&c, read);
+    const uint8_t *slot =
+        &cache->slots[(size_t)(e - cache->entries) * cache->slot_size];
+    int equal = 0;
+    if (_mdp_cursor_equals(span, &slot[e->mark_count * 8], e->size,
+                           &equal) != MDP_OK ||
+        !equal) {
+      continue;
+    }
+    // Exceeded limits are left to the visitor to report
+    uint32_t deepest = inner->frame_count + e->depth;
+    if (deepest > inner->frame_capacity ||
+        (budget->max_depth != 0 && deepest > budget->max_depth) ||
+        (budget->max_nodes != 0 &&
+         inner->node_count + e->nodes > budget->max_nodes)) {
+      break;
+    }
+    cache->hits++;
+    e->last_used = ++cache->clock;
+    inner->node_count += e->nodes;
+    if (deepest > inner->deepest) {
+      inner->deepest = deepest;
+    }
+    if (_mdp_fragment_send(inner, e, slot) == MDP_OK) {
+      _mdp_pop(inner, e->consumed);
+    }
+    return 1;
   }
-  return inner->last_error;
+
+  cache->misses++;
+  if (inner->capture_count == 0) {
+    inner->capture_base = 0;
+    inner->capture_length = 0;
+    inner->capture_from = inner->output_length;
+    inner->mark_base = 0;
+    inner->mark_count = 0;
+  }
+  _mdp_capture *c = &inner->captures[inner->capture_count++];
+  c->span = span;
+  c->hash = hash;
+  c->frame = inner->frame_count - 1;
+  c->levels = (uint32_t)inner->indent_levels;
+  c->text = _mdp_capture_position(inner);
+  c->mark = inner->mark_base + inner->mark_count;
+  c->nodes = inner->node_count;
+  c->deepest = inner->deepest;
+  c->dropped = 0;
+  inner->deepest = inner->frame_count;
+  return 0;
 }
 
-int _mdp_send_literal(_mdp_inner *inner, const char *literal) {
-  if (inner->last_error != MDP_OK) {
+int _mdp_step(_mdp_inner *inner) {
+  _mdp_frame *f = &inner->frames[inner->frame_count - 1];
+  const mdp_definition *t = &inner->schema->definitions[f->type];
+  if (f->phase == _MDP_PHASE_ENTER && inner->fragments != NULL &&
+      inner->output_mode == _MDP_OUTPUT_FEEDER &&
+      _mdp_fragment_enter(inner, f, t)) {
     return inner->last_error;
   }
+  switch (t->kind) {
+    case MDP_KIND_BYTE:
+      return _mdp_visit_byte(inner, f, t);
+    case MDP_KIND_OPTION:
+      return _mdp_visit_option(inner, f, t);
+    case MDP_KIND_UNION:
+      return _mdp_visit_union(inner, f, t);
+    case MDP_KIND_ARRAY:
+      return _mdp_visit_array(inner, f, t);
+    case MDP_KIND_STRUCT:
+      return _mdp_visit_struct(inner, f, t);
+    case MDP_KIND_FIXVEC:
+      return _mdp_visit_fixvec(inner, f, t);
+    case MDP_KIND_DYNVEC:
+      return _mdp_visit_dynvec(inner, f, t);
+    case MDP_KIND_TABLE:
+      return _mdp_visit_table(inner, f, t);
+  }
+  MDP_DEBUG("Invalid definition kind: %u", t->kind);
+  MDP_RETURN_ERROR(MDP_ERROR_SCHEMA_ENCODING);
+}
 
-  int ret = inner->context->feeder((const uint8_t *)literal, strlen(literal),
-                                   inner->context->feeder_context);
-  if (ret != 0) {
-    MDP_DEBUG("Feeder error when sending literal %s: %d\n", literal, ret);
-    MDP_SET_ERROR(MDP_ERROR_FEEDER);
+/*
+ * Tests if a path segment names a field. Returns the field, or NULL when
+ * nothing matches.
+ */
+const mdp_field *_mdp_find_field(const mdp_schema *schema,
+                                 const mdp_definition *t, const char *segment,
+                                 size_t segment_length) {
+  for (uint32_t i = 0; i < t->field_count; i++) {
+    const mdp_field *field = &schema->fields[t->first_field + i];
+    if (field->name_length == segment_length &&
+        memcmp(field->name, segment, segment_length) == 0) {
+      return field;
+    }
   }
-  return inner->last_error;
+  return NULL;
 }
 
-int _mdp_send_newline(_mdp_inner *inner) {
-  return _mdp_send_literal(inner, "\n");
+/* Parses a path segment as an item index */
+int _mdp_parse_index(const char *segment, size_t segment_length,
+                     mol2_num_t *index) {
+  if (segment_length == 0 || segment_length > 10) {
+    return 0;
+  }
+  uint64_t value = 0;
+  for (size_t i = 0; i < segment_length; i++) {
+    if (segment[i] < '0' || segment[i] > '9') {
+      return 0;
+    }
+    value = value * 10 + (uint64_t)(segment[i] - '0');
+  }
+  if (value > 0xFFFFFFFF) {
+    return 0;
+  }
+  *index = (mol2_num_t)value;
+  return 1;
 }
 
-int _mdp_send_indents(_mdp_inner *inner) {
-  if (inner->last_error != MDP_OK) {
+/*
+ * Reads the full size and item count of a dynvec or table from the offsets
+ * header.
+ */
+int _mdp_dynamic_header(_mdp_inner *inner, mol2_cursor_t value,
+                        mol2_num_t *full_size, mol2_num_t *count) {
+  if (value.size < 4) {
+    MDP_DEBUG("Value of %u bytes has no full size!\n", value.size);
+    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+  }
+  *full_size = mol2_unpack_number(&value);
+  if (*full_size > value.size || *full_size < 4) {
+    MDP_DEBUG("Invalid full size %u, buffer has %u bytes!\n", *full_size,
+              value.size);
+    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+  }
+  if (*full_size == 4) {
+    // Empty dynvec
+    *count = 0;
     return inner->last_error;
   }
-
-  for (size_t i = 0; i < inner->indent_levels; i++) {
-    _mdp_send_literal(inner, MDP_INDENT_VALUE);
+  if (*full_size < 8) {
+    MDP_DEBUG("Invalid full size %u!\n", *full_size);
+    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+  }
+  mol2_add_offset(&value, 4);
+  mol2_num_t first_offset = mol2_unpack_number(&value);
+  if ((first_offset % 4) != 0 || first_offset < 8 ||
+      first_offset > *full_size) {
+    MDP_DEBUG("Invalid first offset: %u!\n", first_offset);
+    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
   }
+  *count = first_offset / 4 - 1;
   return inner->last_error;
 }
 
-int _mdp_send_printf(_mdp_inner *inner, const char *format, ...) {
-  if (inner->last_error != MDP_OK) {
+/*
+ * Narrows value down to item index of a dynvec or table, using the offsets
+ * header.
+ */
+int _mdp_select_dynamic_item(_mdp_inner *inner, mol2_cursor_t *value,
+                             mol2_num_t index, mol2_num_t expected_count) {
+  mol2_num_t full_size = 0;
+  mol2_num_t count = 0;
+  if (_mdp_dynamic_header(inner, *value, &full_size, &count) != MDP_OK) {
     return inner->last_error;
   }
+  if (count == 0) {
+    MDP_RETURN_ERROR(MDP_ERROR_PATH_NOT_FOUND);
+  }
+  mol2_num_t first_offset = (count + 1) * 4;
+  if (expected_count != 0 && count != expected_count) {
+    MDP_DEBUG("Table requires %u fields, but actual data has %u fields!\n",
+              expected_count, count);
+    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+  }
+  if (index >= count) {
+    MDP_RETURN_ERROR(MDP_ERROR_PATH_NOT_FOUND);
+  }
 
-  char buf[MDP_BUFFER_LEN];
-  va_list va;
-  va_start(va, format);
-  int ret = MDP_VSNPRINTF(buf, MDP_BUFFER_LEN, format, va);
-  va_end(va);
-  if (ret <= 0 || ret > MDP_BUFFER_LEN) {
-    MDP_DEBUG("sprintf error: %d\n", ret);
-    MDP_RETURN_ERROR(MDP_ERROR_SNPRINTF);
-  }
-  ret = inner->context->feeder((const uint8_t *)buf, (size_t)ret,
-                               inner->context->feeder_context);
-  if (ret != 0) {
-    MDP_DEBUG("Feeder error when sending printf text %s: %d\n", buf, ret);
-    MDP_RETURN_ERROR(MDP_ERROR_FEEDER);
+  mol2_cursor_t tvalue = *value;
+  mol2_add_offset(&tvalue, 4 + 4 * index);
+  mol2_num_t start = mol2_unpack_number(&tvalue);
+  mol2_num_t end = full_size;
+  if (index < count - 1) {
+    mol2_add_offset(&tvalue, 4);
+    end = mol2_unpack_number(&tvalue);
   }
+  if (start < first_offset || end < start || end > full_size) {
+    MDP_DEBUG("Item %u has invalid offset: (%u, %u)!\n", index, start, end);
+    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+  }
+  mol2_add_offset(value, start);
+  value->size = end - start;
   return inner->last_error;
 }
 
-int _mdp_send_raw_bytes(_mdp_inner *inner, mol2_cursor_t value) {
-  if (inner->last_error != MDP_OK) {
-    return inner->last_error;
+/* Narrows value down to a fixed size part of it */
+int _mdp_select_fixed_item(_mdp_inner *inner, mol2_cursor_t *value,
+                           uint64_t offset, uint32_t size) {
+  if (size == 0) {
+    MDP_DEBUG("Item size cannot be calculated from schema!\n");
+    MDP_RETURN_ERROR(MDP_ERROR_SCHEMA_ENCODING);
+  }
+  if (offset + size > value->size) {
+    MDP_DEBUG("Item at (%lu, %u) exceeds value of %u bytes!\n",
+              (unsigned long)offset, size, value->size);
+    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
   }
+  mol2_add_offset(value, (mol2_num_t)offset);
+  value->size = size;
+  return inner->last_error;
+}
 
-  mol2_num_t item_count = value.size;
-  for (mol2_num_t i = 0; i < item_count; i++) {
-    if (i % 8 == 0) {
-      _mdp_send_indents(inner);
+/*
+ * Walks down the path from a value of type, only headers and offsets along
+ * the path are read.
+ */
+int _mdp_select(_mdp_inner *inner, const char *path, mol2_cursor_t *value,
+                uint32_t *type) {
+  const mdp_schema *schema = inner->schema;
+  // Guards against options referring to themselves in broken schemas
+  uint32_t options = 0;
+  while (*path != '\0') {
+    if (*path == '/') {
+      path++;
+      continue;
+    }
+    size_t segment_length = 0;
+    while (path[segment_length] != '\0' && path[segment_length] != '/') {
+      segment_length++;
+    }
+    if (*type >= schema->definition_count) {
+      MDP_DEBUG("Target type cannot be found!\n");
+      MDP_RETURN_ERROR(MDP_ERROR_SCHEMA_ENCODING);
     }
+    const mdp_definition *t = &schema->definitions[*type];
+    mol2_num_t index = 0;
 
-    uint8_t c;
-    if (mol2_read_at(&value, &c, 1) != 1) {
-      MDP_DEBUG("Reading a single byte from cursor results in error!\n");
-      MDP_RETURN_ERROR(MDP_ERROR_MOL2_IO);
+    switch (t->kind) {
+      case MDP_KIND_OPTION: {
+        if (value->size == 0 || options++ > schema->definition_count) {
+          MDP_RETURN_ERROR(MDP_ERROR_PATH_NOT_FOUND);
+        }
+        *type = t->item;
+        // No segment is used by options
+        continue;
+      }
+      case MDP_KIND_UNION: {
+        if (t->builtin == MDP_BUILTIN_ADDRESS) {
+          MDP_RETURN_ERROR(MDP_ERROR_PATH_NOT_FOUND);
+        }
+        if (value->size < 4) {
+          MDP_DEBUG("Union requires at least 4 bytes for ID!\n");
+          MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+        }
+        mol2_num_t union_id = mol2_unpack_number(value);
+        const mdp_field *variant =
+            _mdp_find_field(schema, t, path, segment_length);
+        if (variant == NULL || variant->id != (uint64_t)union_id) {
+          MDP_RETURN_ERROR(MDP_ERROR_PATH_NOT_FOUND);
+        }
+        mol2_add_offset(value, 4);
+        mol2_sub_size(value, 4);
+        *type = variant->type;
+      } break;
+      case MDP_KIND_TABLE: {
+        const mdp_field *field =
+            _mdp_find_field(schema, t, path, segment_length);
+        if (field == NULL) {
+          MDP_RETURN_ERROR(MDP_ERROR_PATH_NOT_FOUND);
+        }
+        index = (mol2_num_t)(field - &schema->fields[t->first_field]);
+        if (_mdp_select_dynamic_item(inner, value, index, t->field_count) !=
+            MDP_OK) {
+          return inner->last_error;
+        }
+        *type = field->type;
+      } break;
+      case MDP_KIND_STRUCT: {
+        const mdp_field *field =
+            _mdp_find_field(schema, t, path, segment_length);
+        if (field == NULL) {
+          MDP_RETURN_ERROR(MDP_ERROR_PATH_NOT_FOUND);
+        }
+        // Preceding fields are skipped by their sizes
+        uint64_t offset = 0;
+        for (const mdp_field *f = &schema->fields[t->first_field]; f < field;
+             f++) {
+          uint32_t size = _mdp_fixed_size(schema, f->type);
+          if (size == 0) {
+            MDP_DEBUG("Struct field size cannot be calculated from schema!\n");
+            MDP_RETURN_ERROR(MDP_ERROR_SCHEMA_ENCODING);
+          }
+          offset += size;
+        }
+        if (_mdp_select_fixed_item(inner, value, offset,
+                                   _mdp_fixed_size(schema, field->type)) !=
+            MDP_OK) {
+          return inner->last_error;
+        }
+        *type = field->type;
+      } break;
+      case MDP_KIND_ARRAY: {
+        if (!_mdp_parse_index(path, segment_length, &index) ||
+            index >= t->item_count) {
+          MDP_RETURN_ERROR(MDP_ERROR_PATH_NOT_FOUND);
+        }
+        uint32_t item_size = _mdp_fixed_size(schema, t->item);
+        if (_mdp_select_fixed_item(inner, value, (uint64_t)index * item_size,
+                                   item_size) != MDP_OK) {
+          return inner->last_error;
+        }
+        *type = t->item;
+      } break;
+      case MDP_KIND_FIXVEC: {
+        if (value->size < 4) {
+          MDP_DEBUG("Fixvec requires at least 4 bytes for item count!\n");
+          MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+        }
+        mol2_num_t item_count = mol2_unpack_number(value);
+        if (!_mdp_parse_index(path, segment_length, &index) ||
+            index >= item_count) {
+          MDP_RETURN_ERROR(MDP_ERROR_PATH_NOT_FOUND);
+        }
+        uint32_t item_size = _mdp_fixed_size(schema, t->item);
+        if (_mdp_select_fixed_item(inner, value,
+                                   4 + (uint64_t)index * item_size,
+                                   item_size) != MDP_OK) {
+          return inner->last_error;
+        }
+        *type = t->item;
+      } break;
+      case MDP_KIND_DYNVEC: {
+        if (!_mdp_parse_index(path, segment_length, &index)) {
+          MDP_RETURN_ERROR(MDP_ERROR_PATH_NOT_FOUND);
+        }
+        if (_mdp_select_dynamic_item(inner, value, index, 0) != MDP_OK) {
+          return inner->last_error;
+        }
+        *type = t->item;
+      } break;
+      default: {
+        MDP_RETURN_ERROR(MDP_ERROR_PATH_NOT_FOUND);
+      }
+    }
+    path += segment_length;
+    options = 0;
+  }
+  return inner->last_error;
+}
+
+/* Uses the prepared schema in context, or prepares one in arena */
+int _mdp_load_schema(_mdp_inner *inner, mdp_arena *arena,
+                     mdp_schema *prepared) {
+  mdp_context *context = inner->context;
+  if (context->prepared_schema != NULL) {
+    inner->schema = context->prepared_schema;
+    return inner->last_error;
+  }
+  int ret = _mdp_prepare_schema(arena, context->schema, prepared);
+  if (ret != MDP_OK) {
+    MDP_RETURN_ERROR(ret);
+  }
+  inner->schema = prepared;
+  return inner->last_error;
+}
+
+/*
+ * Sets up everything needed in arena, the schema is prepared into prepared
+ * when not provided in context. data is set to the data in context, read
+ * through a cache in arena.
+ */
+int _mdp_setup(_mdp_inner *inner, mdp_arena *arena, mdp_schema *prepared,
+               mol2_cursor_t *data) {
+  mdp_context *context = inner->context;
+  if (_mdp_load_schema(inner, arena, prepared) != MDP_OK) {
+    return inner->last_error;
+  }
+  if (inner->events == NULL) {
+    if (context->format == MDP_FORMAT_TEXT) {
+      inner->events = &_mdp_text_events;
+    } else if (context->format == MDP_FORMAT_JSON) {
+      inner->events = &_mdp_json_events;
+    } else if (context->format == MDP_FORMAT_COMPACT) {
+      inner->events = &_mdp_compact_events;
+    } else {
+      MDP_DEBUG("Invalid format: %d\n", context->format);
+      MDP_RETURN_ERROR(MDP_ERROR_FORMAT);
     }
-    mol2_add_offset(&value, 1);
-    mol2_sub_size(&value, 1);
+    inner->events_context = inner;
+  }
 
-    _mdp_send_printf(inner, "0x%02x", c);
-    if (i != item_count - 1) {
-      _mdp_send_literal(inner, ", ");
+  *data = context->data;
+  if (MDP_DATA_CACHE_SIZE > 0 && !inner->uncached) {
+    data->data_source = _mdp_arena_clone_source(
+        arena, context->data.data_source, MDP_DATA_CACHE_SIZE);
+    if (data->data_source == NULL) {
+      MDP_RETURN_ERROR(MDP_ERROR_ARENA);
     }
-    if ((i + 1) % 8 == 0) {
-      _mdp_send_literal(inner, "\n");
+  }
+  if (inner->output_mode == _MDP_OUTPUT_FEEDER) {
+    inner->output_capacity = MDP_OUTPUT_BUFFER_LEN;
+    inner->output = (uint8_t *)mdp_arena_alloc(arena, inner->output_capacity);
+    if (inner->output == NULL) {
+      MDP_RETURN_ERROR(MDP_ERROR_ARENA);
     }
   }
-  if (item_count % 8 != 0) {
-    _mdp_send_literal(inner, "\n");
+  inner->frame_capacity = inner->schema->max_depth;
+  inner->frames = (_mdp_frame *)mdp_arena_alloc(
+      arena, sizeof(_mdp_frame) * inner->frame_capacity);
+  if (inner->frames == NULL) {
+    MDP_RETURN_ERROR(MDP_ERROR_ARENA);
+  }
+  if (context->fragment_cache != NULL && context->prepared_schema != NULL &&
+      inner->output_mode == _MDP_OUTPUT_FEEDER) {
+    inner->captures = (_mdp_capture *)mdp_arena_alloc(
+        arena, sizeof(_mdp_capture) * inner->frame_capacity);
+    if (inner->captures == NULL) {
+      MDP_RETURN_ERROR(MDP_ERROR_ARENA);
+    }
+    _mdp_fragment_bind(context->fragment_cache, context);
+    inner->fragments = context->fragment_cache;
   }
-
   return inner->last_error;
 }
 
-typedef struct {
-  const mol2_cursor_t *cursors;
-  size_t cursor_count;
+/* Pushes the value to visit in data */
+int _mdp_start(_mdp_inner *inner, mol2_cursor_t data) {
+  uint32_t type = inner->schema->top_level_type;
+  if (inner->path != NULL) {
+    if (_mdp_select(inner, inner->path, &data, &type) != MDP_OK) {
+      return inner->last_error;
+    }
+  }
+  if (inner->node != NULL) {
+    mol2_add_offset(&data, inner->node->offset);
+    data.size = inner->node->size;
+    type = inner->node->type;
+  }
+  inner->data_size = data.size;
+  return _mdp_push(inner, type, data);
+}
 
-  size_t current_cursor;
-  uint32_t current_offset;
-} cursors_inputter_context;
+/* Sets up everything needed in arena and pushes the value to visit */
+int _mdp_begin(_mdp_inner *inner, mdp_arena *arena, mdp_schema *prepared) {
+  mol2_cursor_t data;
+  if (_mdp_setup(inner, arena, prepared, &data) != MDP_OK) {
+    return inner->last_error;
+  }
+  return _mdp_start(inner, data);
+}
 
-void cursors_inputter_context_initialize(cursors_inputter_context *context,
-                                         const mol2_cursor_t *cursors,
-                                         size_t cursor_count) {
-  context->cursors = cursors;
-  context->cursor_count = cursor_count;
-  context->current_cursor = 0;
-  context->current_offset = 0;
+/* Checks the whole value is consumed, then finishes text with a newline */
+int _mdp_finish(_mdp_inner *inner) {
+  if (inner->consumed != inner->data_size) {
+    MDP_DEBUG("Value has %u bytes but only consumed %u bytes!",
+              inner->data_size, inner->consumed);
+    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+  }
+  if (inner->output_mode == _MDP_OUTPUT_NONE ||
+      inner->events->on_finish == NULL) {
+    return inner->last_error;
+  }
+  return _mdp_emitted(inner, inner->events->on_finish(inner->events_context));
 }
 
-int cursors_inputter(uint8_t *buf, size_t *length, void *context) {
-  cursors_inputter_context *c = (cursors_inputter_context *)context;
+/* Visits all pushed values to the end */
+int _mdp_run(_mdp_inner *inner) {
+  while (inner->frame_count > 0 && inner->last_error == MDP_OK) {
+    _mdp_step(inner);
+  }
+  if (inner->last_error != MDP_OK) {
+    return inner->last_error;
+  }
+  if (_mdp_finish(inner) != MDP_OK) {
+    return inner->last_error;
+  }
+  return _mdp_flush(inner);
+}
 
-  size_t wrote = 0;
-  while (wrote < *length) {
-    if (c->current_cursor < c->cursor_count) {
-      if (c->current_offset < c->cursors[c->current_cursor].size) {
-        uint32_t available_data =
-            c->cursors[c->current_cursor].size - c->current_offset;
-        uint32_t available_space = (uint32_t)(*length - wrote);
-        if (available_space > available_data) {
-          available_space = available_data;
-        }
-        mol2_cursor_t target_cursor = c->cursors[c->current_cursor];
-        mol2_add_offset(&target_cursor, c->current_offset);
-        target_cursor.size = available_space;
-        uint32_t read =
-            mol2_read_at(&target_cursor, &buf[wrote], available_space);
-        if (read != available_space) {
-          MDP_DEBUG(
-              "Cursor inputter got less data than requested, actual: %u, "
-              "expected: %u!",
-              read, available_space);
-          return MDP_ERROR_MOL2_IO;
-        }
-        wrote += read;
-        c->current_offset += read;
-      } else {
-        // Switch to next cursor
-        c->current_cursor++;
-        c->current_offset = 0;
-      }
-    } else {
-      // Running out of data to use
-      break;
-    }
+int _mdp_visit(_mdp_inner *inner, mdp_arena *arena) {
+  mdp_schema prepared;
+  if (_mdp_begin(inner, arena, &prepared) != MDP_OK) {
+    return inner->last_error;
   }
-  *length = wrote;
-  return 0;
+  return _mdp_run(inner);
 }
 
-mol2_data_source_t _mdp_make_memory_source(const void *memory, uint32_t size) {
-  mol2_data_source_t s_data_source = {0};
+void mdp_context_initialize(mdp_context *context) {
+  memset(context, 0, sizeof(mdp_context));
+  context->version = MDP_CONTEXT_VERSION;
+}
 
-  s_data_source.read = mol2_source_memory;
-  s_data_source.total_size = size;
-  s_data_source.args[0] = (uintptr_t)memory;
-  s_data_source.args[1] = (uintptr_t)size;
+/* Zeroes optional fields of a context not set up by mdp_context_initialize */
+void _mdp_context_defaults(mdp_context *context) {
+  if (context->version == MDP_CONTEXT_VERSION) {
+    return;
+  }
+  context->version = MDP_CONTEXT_VERSION;
+  context->prepared_schema = NULL;
+  context->arena = NULL;
+  context->projection = NULL;
+  context->elision = NULL;
+  memset(&context->budget, 0, sizeof(mdp_budget));
+  context->format = MDP_FORMAT_TEXT;
+  context->address_cache = NULL;
+  context->fragment_cache = NULL;
+}
 
-  s_data_source.cache_size = 0;
-  s_data_source.start_point = 0;
-  s_data_source.total_size = size;
-  s_data_source.max_cache_size = MIN_CACHE_SIZE;
-  return s_data_source;
+void _mdp_initialize_inner(_mdp_inner *inner, mdp_context *context,
+                           int output_mode) {
+  _mdp_context_defaults(context);
+  memset(inner, 0, sizeof(_mdp_inner));
+  inner->context = context;
+  inner->last_error = MDP_OK;
+  inner->output_mode = output_mode;
+}
+
+int _mdp_visit_with_arena(_mdp_inner *inner, mdp_arena *arena) {
+  size_t mark = arena->used;
+  int ret = _mdp_visit(inner, arena);
+  arena->last_used = arena->used - mark;
+  arena->used = mark;
+  return ret;
+}
+
+/* Uses the arena in context, or a stack allocated one */
+int _mdp_visit_with_context_arena(_mdp_inner *inner) {
+  if (inner->context->arena != NULL) {
+    return _mdp_visit_with_arena(inner, inner->context->arena);
+  }
+  uint8_t buffer[MDP_DEFAULT_ARENA_SIZE];
+  mdp_arena arena;
+  mdp_arena_initialize(&arena, buffer, MDP_DEFAULT_ARENA_SIZE);
+  return _mdp_visit_with_arena(inner, &arena);
+}
+
+int mdp_visit(mdp_context context) {
+  _mdp_inner inner;
+  _mdp_initialize_inner(&inner, &context, _MDP_OUTPUT_FEEDER);
+  return _mdp_visit_with_context_arena(&inner);
+}
+
+int mdp_verify(mdp_context context) {
+  _mdp_inner inner;
+  _mdp_initialize_inner(&inner, &context, _MDP_OUTPUT_NONE);
+  return _mdp_visit_with_context_arena(&inner);
+}
+
+int mdp_measure(mdp_context context, size_t *length) {
+  _mdp_inner inner;
+  _mdp_initialize_inner(&inner, &context, _MDP_OUTPUT_MEASURE);
+  int ret = _mdp_visit_with_context_arena(&inner);
+  if (ret == MDP_OK) {
+    *length = inner.output_total;
+  }
+  return ret;
+}
+
+int mdp_compare(mdp_context context, mol2_cursor_t expected) {
+  mdp_comparator comparator;
+  comparator.expected = expected;
+  comparator.result = 0;
+  context.feeder = mdp_comparator_feeder;
+  context.feeder_context = &comparator;
+  int ret = mdp_visit(context);
+  if (ret == MDP_ERROR_FEEDER) {
+    return comparator.result;
+  }
+  if (ret == MDP_OK && comparator.expected.size != 0) {
+    MDP_DEBUG("Text is shorter than the expected %u bytes!\n",
+              expected.size);
+    return MDP_ERROR_MISMATCH;
+  }
+  return ret;
 }
 
-mol2_cursor_t _mdp_cursor_from_source(mol2_data_source_t *source) {
-  mol2_cursor_t cur;
-  cur.offset = 0;
-  cur.size = source->total_size;
-  cur.data_source = source;
-  return cur;
+int mdp_visit_record(mdp_context context, mdp_trace *trace) {
+  _mdp_inner inner;
+  _mdp_initialize_inner(&inner, &context, _MDP_OUTPUT_FEEDER);
+  trace->length = 0;
+  inner.trace = trace;
+  inner.trace_base = context.data.offset;
+  return _mdp_visit_with_context_arena(&inner);
 }
 
-int _mdp_visit_subtype(_mdp_inner *inner, mol2_cursor_t value,
-                       mol2_cursor_t sub_type_name, mol2_num_t *consumed_size);
+/* Sends the text of the op at position of trace, advancing position */
+int _mdp_replay_op(_mdp_inner *inner, const mdp_trace *trace,
+                   size_t *position) {
+  uint8_t op = trace->buffer[(*position)++];
+  size_t count = 2;
+  if (op == _MDP_TRACE_LITERAL || op == _MDP_TRACE_INDENT) {
+    count = 1;
+  } else if (op == _MDP_TRACE_BYTE_LINES) {
+    count = 3;
+  } else if (op > _MDP_TRACE_BYTE_LINES) {
+    MDP_DEBUG("Invalid trace op: %u\n", op);
+    MDP_RETURN_ERROR(MDP_ERROR_TRACE);
+  }
+  uint32_t operands[3];
+  if (trace->length - *position < count * sizeof(uint32_t)) {
+    MDP_RETURN_ERROR(MDP_ERROR_TRACE);
+  }
+  memcpy(operands, &trace->buffer[*position], count * sizeof(uint32_t));
+  *position += count * sizeof(uint32_t);
 
-int _mdp_visit_option(_mdp_inner *inner, mol2_cursor_t value,
-                      struct OptionDefinitionType *t,
-                      mol2_num_t *consumed_size) {
-  if (inner->last_error != MDP_OK) {
+  if (op == _MDP_TRACE_LITERAL) {
+    if (trace->length - *position < operands[0]) {
+      MDP_RETURN_ERROR(MDP_ERROR_TRACE);
+    }
+    _mdp_send_bytes(inner, &trace->buffer[*position], operands[0]);
+    *position += operands[0];
     return inner->last_error;
   }
+  if (op == _MDP_TRACE_INDENT) {
+    inner->indent_levels = operands[0];
+    return _mdp_send_indents(inner);
+  }
 
-  _mdp_send_indents(inner);
-  _mdp_send_cursor_to_feeder(inner, t->t->name(t));
-  _mdp_send_literal(inner, "(option):");
+  mol2_cursor_t value = inner->context->data;
+  if ((uint64_t)operands[0] + operands[1] > value.size) {
+    MDP_DEBUG("Trace refers past the end of data!\n");
+    MDP_RETURN_ERROR(MDP_ERROR_TRACE);
+  }
+  mol2_add_offset(&value, operands[0]);
+  value.size = operands[1];
+  switch (op) {
+    case _MDP_TRACE_RAW:
+      return _mdp_send_cursor_to_feeder(inner, value);
+    case _MDP_TRACE_HEX:
+      return _mdp_send_hex_cursor(inner, value);
+    case _MDP_TRACE_ESCAPED:
+      return _mdp_send_escaped(inner, value);
+    default:
+      inner->indent_levels = operands[2] >> 1;
+      return _mdp_send_byte_lines(inner, value, operands[2] & 1);
+  }
+}
 
-  if (value.size > 0) {
-    /* Some */
-    mol2_cursor_t sub_type = t->t->item(t);
-    _mdp_send_newline(inner);
-    inner->indent_levels++;
-    _mdp_visit_subtype(inner, value, sub_type, consumed_size);
-    inner->indent_levels--;
-  } else {
-    /* None */
-    _mdp_send_literal(inner, " None");
-    *consumed_size = 0;
+int mdp_replay(mdp_context context, const mdp_trace *trace) {
+  _mdp_inner inner;
+  _mdp_initialize_inner(&inner, &context, _MDP_OUTPUT_FEEDER);
+  uint8_t output[MDP_OUTPUT_BUFFER_LEN];
+  inner.output = output;
+  inner.output_capacity = MDP_OUTPUT_BUFFER_LEN;
+  size_t position = 0;
+  while (position < trace->length && inner.last_error == MDP_OK) {
+    _mdp_replay_op(&inner, trace, &position);
   }
-  return inner->last_error;
+  return _mdp_flush(&inner);
 }
 
-int _mdp_visit_union(_mdp_inner *inner, mol2_cursor_t value,
-                     struct UnionDefinitionType *t, mol2_num_t *consumed_size) {
-  if (inner->last_error != MDP_OK) {
+int mdp_visit_path(mdp_context context, const char *path) {
+  _mdp_inner inner;
+  _mdp_initialize_inner(&inner, &context, _MDP_OUTPUT_FEEDER);
+  inner.path = path;
+  return _mdp_visit_with_context_arena(&inner);
+}
+
+int mdp_visit_events(mdp_context context, const mdp_events *events,
+                     void *events_context) {
+  _mdp_inner inner;
+  _mdp_initialize_inner(&inner, &context, _MDP_OUTPUT_EVENTS);
+  inner.events = events;
+  inner.events_context = events_context;
+  return _mdp_visit_with_context_arena(&inner);
+}
+
+int _mdp_visit_batch(_mdp_inner *inner, mdp_arena *arena,
+                     const mol2_cursor_t *items, size_t count,
+                     const mdp_batch_sink *sink) {
+  size_t mark = arena->used;
+  mdp_schema prepared;
+  mol2_cursor_t data;
+  if (_mdp_setup(inner, arena, &prepared, &data) != MDP_OK) {
+    arena->used = mark;
     return inner->last_error;
   }
+  // Each item starts from the state right after setup
+  _mdp_inner initial = *inner;
+  const mol2_data_source_t *source = inner->context->data.data_source;
+  int cached = data.data_source != source;
+
+  for (size_t i = 0; i < count; i++) {
+    *inner = initial;
+    if (sink->begin != NULL && sink->begin(sink->batch_context, i) != 0) {
+      MDP_DEBUG("Batch sink error at begin of item %lu\n", (unsigned long)i);
+      MDP_SET_ERROR(MDP_ERROR_FEEDER);
+      break;
+    }
+    mol2_cursor_t item = items[i];
+    if (cached) {
+      if (item.data_source != source) {
+        _mdp_retarget_source(data.data_source, item.data_source);
+        source = item.data_source;
+      }
+      item.data_source = data.data_source;
+    }
+    inner->context->data = items[i];
+    if (_mdp_start(inner, item) == MDP_OK) {
+      _mdp_run(inner);
+    }
+    int result = inner->last_error;
+    inner->last_error = MDP_OK;
+    if (sink->end != NULL && sink->end(sink->batch_context, i, result) != 0) {
+      MDP_DEBUG("Batch sink error at end of item %lu\n", (unsigned long)i);
+      MDP_SET_ERROR(MDP_ERROR_FEEDER);
+      break;
+    }
+  }
+  arena->last_used = arena->used - mark;
+  arena->used = mark;
+  return inner->last_error;
+}
 
-  if (value.size < 4) {
-    MDP_DEBUG(
-        "Union requires at least 4 bytes for ID but the value only has length: "
-        "%u\n",
-        value.size);
-    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+int mdp_visit_batch(mdp_context context, const mol2_cursor_t *items,
+                    size_t count, const mdp_batch_sink *sink) {
+  if (count == 0) {
+    return MDP_OK;
   }
-  mol2_num_t union_id = mol2_unpack_number(&value);
-  struct UnionPairType pair;
-  int ret = _mdp_find_union(t, union_id, &pair);
-  if (ret != MDP_OK) {
-    MDP_RETURN_ERROR(ret);
+  // Setup is done against the first item
+  context.data = items[0];
+  _mdp_inner inner;
+  _mdp_initialize_inner(&inner, &context, _MDP_OUTPUT_FEEDER);
+  if (context.arena != NULL) {
+    return _mdp_visit_batch(&inner, context.arena, items, count, sink);
   }
+  uint8_t buffer[MDP_DEFAULT_ARENA_SIZE];
+  mdp_arena arena;
+  mdp_arena_initialize(&arena, buffer, MDP_DEFAULT_ARENA_SIZE);
+  return _mdp_visit_batch(&inner, &arena, items, count, sink);
+}
 
-  _mdp_send_indents(inner);
-  _mdp_send_cursor_to_feeder(inner, t->t->name(t));
-
-  {
-    // handle Address builtin type
-    int match = 1;
-    int ret = _mdp_cursor_s_cmp(t->t->name(t), "Address", &match);
-    if (ret != 0) {
-      MDP_RETURN_ERROR(ret);
+#ifdef MDP_PARALLEL
+/* A range of items of a vector being split, rendered by one thread */
+typedef struct {
+  _mdp_inner inner;
+  mdp_context context;
+  mdp_arena arena;
+  /* The vector positioned at the first item of this part */
+  _mdp_frame vector;
+  mol2_num_t end;
+  const mdp_definition *t;
+  uint8_t *text;
+  size_t length;
+  size_t capacity;
+  pthread_t thread;
+  int started;
+} _mdp_part;
+
+int _mdp_part_feeder(const uint8_t *data, size_t length,
+                     void *feeder_context) {
+  _mdp_part *part = (_mdp_part *)feeder_context;
+  if (part->length + length > part->capacity) {
+    size_t capacity = part->capacity == 0 ? 4096 : part->capacity;
+    while (capacity < part->length + length) {
+      capacity *= 2;
     }
-    if (match == 0) {
-      if (union_id != 0) {
-        MDP_DEBUG("Address type only supports Script variant for now");
-        MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
-      }
-      // Now we can simply treat the content of the cursor as a table
-      // of 3 items.
-      mol2_cursor_t script_table_value = value;
-      mol2_add_offset(&script_table_value, 4);
-      mol2_sub_size(&script_table_value, 4);
-
-      mol2_num_t full_size = mol2_unpack_number(&script_table_value);
-      mol2_cursor_t code_hash =
-          mol2_table_slice_by_index(&script_table_value, 0);
-      if (code_hash.size != 32) {
-        MDP_DEBUG("Invalid code hash in address type!");
-        MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
-      }
-      mol2_cursor_t hash_type =
-          mol2_table_slice_by_index(&script_table_value, 1);
-      if (hash_type.size != 1) {
-        MDP_DEBUG("Invalid hash type in address type!");
-        MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
-      }
-      mol2_cursor_t args = mol2_table_slice_by_index(&script_table_value, 2);
-      if (args.size < 4) {
-        MDP_DEBUG("Invalid args in address type!");
-        MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
-      }
-      mol2_num_t args_length = mol2_unpack_number(&args);
-      if (args.size != args_length + 4) {
-        MDP_DEBUG("Invalid args length in address type!");
-        MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
-      }
-      if (code_hash.size + hash_type.size + args.size + 16 != full_size) {
-        MDP_DEBUG("Invalid address type!");
-        MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
-      }
-      mol2_cursor_t actual_args = args;
-      mol2_add_offset(&actual_args, 4);
-      mol2_sub_size(&actual_args, 4);
-
-      // Actual visit CKB address
-      _mdp_send_literal(inner, ": ");
-
-      mol2_data_source_t index_source = _mdp_make_memory_source("\0", 1);
-      mol2_cursor_t index_cursor = _mdp_cursor_from_source(&index_source);
-      mol2_cursor_t cursors[4] = {index_cursor, code_hash, hash_type, args};
-      cursors_inputter_context inputter;
-      cursors_inputter_context_initialize(&inputter, cursors, 4);
-
-      bech32m_raw_to_5bits_inputter_context inputter2;
-      bech32m_initialize_raw_to_5bits_inputter(&inputter2, cursors_inputter,
-                                               &inputter);
-
-      int ret = bech32m_encode(
-          inner->context->hrp, bech32m_raw_to_5bits_inputter, &inputter2,
-          inner->context->feeder, inner->context->feeder_context);
-      if (ret != 0) {
-        MDP_DEBUG("bech32m encoding process throws an error: %d!", ret);
-        MDP_RETURN_ERROR(MDP_ERROR_BECH32M);
-      }
+    uint8_t *text = (uint8_t *)realloc(part->text, capacity);
+    if (text == NULL) {
+      return 1;
+    }
+    part->text = text;
+    part->capacity = capacity;
+  }
+  memcpy(&part->text[part->length], data, length);
+  part->length += length;
+  return 0;
+}
 
-      *consumed_size = full_size + 4;
+/*
+ * Renders items of vector f up to end, with the same checks on each item as
+ * _mdp_visit_fixvec and _mdp_visit_dynvec.
+ */
+int _mdp_render_items(_mdp_inner *inner, _mdp_frame *f,
+                      const mdp_definition *t, mol2_num_t end) {
+  for (; f->index < end; f->index++) {
+    mol2_cursor_t value2 = f->value;
+    _MDP_EMIT(on_item, t, f->index);
+    if (t->kind == MDP_KIND_FIXVEC) {
+      mol2_add_offset(&value2, f->total_consumed);
+      mol2_sub_size(&value2, f->total_consumed);
+    } else if (_mdp_next_dynamic_item(inner, f, "Dynvec item", &value2) !=
+               MDP_OK) {
+      return inner->last_error;
+    }
+    if (_mdp_push(inner, t->item, value2) != MDP_OK) {
+      return inner->last_error;
+    }
+    while (inner->frame_count > 0 && inner->last_error == MDP_OK) {
+      _mdp_step(inner);
+    }
+    if (inner->last_error != MDP_OK) {
+      return inner->last_error;
+    }
+    if (t->kind == MDP_KIND_FIXVEC) {
+      _mdp_finish_fixvec_item(inner, f);
+    } else {
+      _mdp_finish_dynvec_item(inner, f);
+    }
+    if (inner->last_error != MDP_OK) {
       return inner->last_error;
     }
   }
+  return _mdp_flush(inner);
+}
 
-  _mdp_send_literal(inner, "(variant ");
-  mol2_cursor_t subtype = pair.t->typ(&pair);
-  _mdp_send_cursor_to_feeder(inner, subtype);
-  _mdp_send_printf(inner, ", id = %u):\n", union_id);
-
-  mol2_cursor_t value2 = value;
-  mol2_add_offset(&value2, 4);
-  mol2_sub_size(&value2, 4);
+void *_mdp_part_main(void *argument) {
+  _mdp_part *part = (_mdp_part *)argument;
+  _mdp_render_items(&part->inner, &part->vector, part->t, part->end);
+  return NULL;
+}
 
-  inner->indent_levels++;
-  mol2_num_t inner_consumed_size = 0;
-  ret = _mdp_visit_subtype(inner, value2, subtype, &inner_consumed_size);
-  if (ret != MDP_OK) {
-    MDP_RETURN_ERROR(ret);
+/*
+ * Prepares part to render items from first up to end of vector f, reading
+ * data through its own cache, with text indented as in inner.
+ */
+int _mdp_setup_part(_mdp_inner *inner, _mdp_frame *f, const mdp_definition *t,
+                    _mdp_part *part, mol2_num_t first, mol2_num_t end) {
+  part->context = *inner->context;
+  part->context.data = f->value;
+  part->context.prepared_schema = inner->schema;
+  part->context.feeder = _mdp_part_feeder;
+  part->context.feeder_context = part;
+  // Caches of context are only used by the calling thread
+  part->context.address_cache = NULL;
+  part->context.fragment_cache = NULL;
+  part->t = t;
+  part->end = end;
+  _mdp_initialize_inner(&part->inner, &part->context, _MDP_OUTPUT_FEEDER);
+  part->inner.indent_levels = inner->indent_levels;
+
+  uint8_t *buffer = (uint8_t *)malloc(MDP_DEFAULT_ARENA_SIZE);
+  if (buffer == NULL) {
+    MDP_RETURN_ERROR(MDP_ERROR_ARENA);
+  }
+  mdp_arena_initialize(&part->arena, buffer, MDP_DEFAULT_ARENA_SIZE);
+  mdp_schema prepared;
+  mol2_cursor_t data;
+  if (_mdp_setup(&part->inner, &part->arena, &prepared, &data) != MDP_OK) {
+    MDP_RETURN_ERROR(part->inner.last_error);
   }
-  *consumed_size = inner_consumed_size + 4;
-  inner->indent_levels--;
 
+  part->vector = *f;
+  part->vector.value = data;
+  part->vector.index = first;
+  if (first == 0) {
+    return inner->last_error;
+  }
+  if (t->kind == MDP_KIND_FIXVEC) {
+    part->vector.total_consumed +=
+        first * _mdp_fixed_size(inner->schema, t->item);
+  } else {
+    // Offsets are checked by the part rendering the previous item
+    mol2_cursor_t tvalue = f->value;
+    mol2_add_offset(&tvalue, 4 + 4 * first);
+    part->vector.total_consumed = mol2_unpack_number(&tvalue);
+  }
   return inner->last_error;
 }
 
-int _mdp_visit_array(_mdp_inner *inner, mol2_cursor_t value,
-                     struct ArrayDefinitionType *t, mol2_num_t *consumed_size) {
-  if (inner->last_error != MDP_OK) {
+int _mdp_split_vector(_mdp_inner *inner, _mdp_frame *f,
+                      const mdp_definition *t) {
+  const _mdp_parallel *parallel = inner->parallel;
+  if (parallel == NULL || parallel->threads < 2 || f->count < 2 ||
+      f->count < parallel->min_items ||
+      inner->output_mode != _MDP_OUTPUT_FEEDER) {
     return inner->last_error;
   }
+  if (t->kind == MDP_KIND_FIXVEC) {
+    // Parts start at fixed offsets, anything else is left to the serial loop
+    uint32_t item_size = _mdp_fixed_size(inner->schema, t->item);
+    if (item_size == 0 ||
+        (uint64_t)f->value.size < 4 + (uint64_t)item_size * f->count) {
+      return inner->last_error;
+    }
+  }
 
-  uint64_t item_count64 = t->t->item_count(t);
-  if (item_count64 > 0xFFFFFFFF) {
-    MDP_DEBUG("Item count %ld is too large!\n", item_count64);
-    MDP_RETURN_ERROR(MDP_ERROR_SCHEMA_ENCODING);
+  if (inner->capture_count > 0) {
+    // Text of parts is indented by each part, it cannot be captured
+    _mdp_capture_output(inner);
+    _mdp_capture_drop(inner, _mdp_capture_position(inner) + 1);
   }
-  mol2_num_t item_count = (mol2_num_t)item_count64;
-  if ((value.size % item_count) != 0) {
-    MDP_DEBUG(
-        "Array should have %u items, but the length %u cannot be divided by "
-        "item count\n",
-        item_count, value.size);
-    MDP_RETURN_ERROR(MDP_ERROR_SCHEMA_ENCODING);
+  size_t count = parallel->threads < f->count ? parallel->threads : f->count;
+  _mdp_part *parts = (_mdp_part *)calloc(count, sizeof(_mdp_part));
+  if (parts == NULL) {
+    MDP_RETURN_ERROR(MDP_ERROR_ARENA);
+  }
+  size_t prepared = 0;
+  while (prepared < count && inner->last_error == MDP_OK) {
+    mol2_num_t first = (mol2_num_t)((uint64_t)f->count * prepared / count);
+    mol2_num_t end =
+        (mol2_num_t)((uint64_t)f->count * (prepared + 1) / count);
+    _mdp_setup_part(inner, f, t, &parts[prepared], first, end);
+    prepared++;
   }
 
-  _mdp_send_indents(inner);
-  _mdp_send_cursor_to_feeder(inner, t->t->name(t));
-
-  {
-    // handle builtin types here
-    int match = 1;
-    int ret = _mdp_cursor_s_cmp(t->t->name(t), "Byte32", &match);
-    if (ret != 0) {
-      MDP_RETURN_ERROR(ret);
+  if (inner->last_error == MDP_OK) {
+    // The calling thread renders the first part, as well as parts whose
+    // thread cannot be created
+    for (size_t i = 1; i < count; i++) {
+      parts[i].started = pthread_create(&parts[i].thread, NULL,
+                                        _mdp_part_main, &parts[i]) == 0;
     }
-    if (match == 0) {
-      if (item_count != 32) {
-        MDP_DEBUG(
-            "Byte32 must be an array of 32 bytes, but the schema differs");
-        MDP_RETURN_ERROR(MDP_ERROR_SCHEMA_ENCODING);
-      }
-      if (value.size < 32) {
-        MDP_DEBUG("Byte32 has invalid length %u!\n", value.size);
-        MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
-      }
-      uint8_t data[32];
-      if (mol2_read_at(&value, data, 32) != 32) {
-        MDP_DEBUG("Reading 32 bytes from cursor results in error!\n");
-        MDP_RETURN_ERROR(MDP_ERROR_MOL2_IO);
-      }
-      _mdp_send_literal(inner, ": 0x");
-      for (int i = 0; i < 8; i++) {
-        _mdp_send_printf(inner, "%02x%02x%02x%02x", data[i * 4],
-                         data[i * 4 + 1], data[i * 4 + 2], data[i * 4 + 3]);
+    for (size_t i = 0; i < count; i++) {
+      if (!parts[i].started) {
+        _mdp_part_main(&parts[i]);
       }
-
-      *consumed_size = 32;
-      return inner->last_error;
     }
-    match = 1;
-    ret = _mdp_cursor_s_cmp(t->t->name(t), "Uint64", &match);
-    if (ret != 0) {
-      MDP_RETURN_ERROR(ret);
-    }
-    if (match == 0) {
-      if (item_count != 8) {
-        MDP_DEBUG("Uint64 must be an array of 8 bytes, but the schema differs");
-        MDP_RETURN_ERROR(MDP_ERROR_SCHEMA_ENCODING);
-      }
-      if (value.size < 8) {
-        MDP_DEBUG("Uint64 has invalid length %u!\n", value.size);
-        MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
-      }
-      // Assuming little-endian here
-      uint64_t data;
-      if (mol2_read_at(&value, (uint8_t *)(&data), 8) != 8) {
-        MDP_DEBUG("Reading 8 bytes from cursor results in error!\n");
-        MDP_RETURN_ERROR(MDP_ERROR_MOL2_IO);
+    for (size_t i = 1; i < count; i++) {
+      if (parts[i].started) {
+        pthread_join(parts[i].thread, NULL);
       }
-      _mdp_send_printf(inner, ": %lu", data);
+    }
+  }
 
-      *consumed_size = 8;
-      return inner->last_error;
+  for (size_t i = 0; i < prepared; i++) {
+    _mdp_part *part = &parts[i];
+    if (inner->last_error == MDP_OK) {
+      _mdp_send_bytes(inner, part->text, part->length);
+      inner->node_count += part->inner.node_count;
+      if (part->inner.last_error != MDP_OK) {
+        MDP_SET_ERROR(part->inner.last_error);
+      }
+      f->index = part->vector.index;
+      f->total_consumed = part->vector.total_consumed;
     }
+    free(part->text);
+    free(part->arena.buffer);
   }
+  free(parts);
+  return inner->last_error;
+}
 
-  // Sub-type is not a builtin one, visit its content recursively
-  _mdp_send_printf(inner, "(array, len = %u): [\n", item_count);
-  inner->indent_levels++;
-  mol2_cursor_t subtype = t->t->item(t);
-  int match = 1;
-  int ret = _mdp_cursor_s_cmp(subtype, "byte", &match);
-  if (ret != 0) {
-    MDP_RETURN_ERROR(ret);
+int mdp_visit_parallel(mdp_context context, uint32_t threads,
+                       uint32_t min_items) {
+  _mdp_parallel parallel = {threads, min_items};
+  _mdp_inner inner;
+  _mdp_initialize_inner(&inner, &context, _MDP_OUTPUT_FEEDER);
+  const mdp_budget *budget = &context.budget;
+  if (MDP_DATA_CACHE_SIZE > 0 && context.elision == NULL &&
+      budget->max_output == 0 && budget->max_nodes == 0 &&
+      budget->max_depth == 0 &&
+      context.data.data_source->read == mol2_source_memory) {
+    inner.parallel = &parallel;
   }
-  if (match == 0) {
-    if (value.size < item_count) {
-      MDP_DEBUG("Byte array of %u items has invalid length %u!\n", item_count,
-                value.size);
-      MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
-    }
+  return _mdp_visit_with_context_arena(&inner);
+}
+#endif
 
-    mol2_cursor_t value2 = value;
-    value2.size = item_count;
-    _mdp_send_raw_bytes(inner, value2);
-    *consumed_size = item_count;
-  } else {
-    mol2_num_t total_consumed = 0;
-    for (mol2_num_t i = 0; i < item_count; i++) {
-      mol2_cursor_t value2 = value;
-      mol2_add_offset(&value2, total_consumed);
-      mol2_sub_size(&value2, total_consumed);
-
-      mol2_num_t current_consumed = 0;
-      ret = _mdp_visit_subtype(inner, value2, subtype, &current_consumed);
-      if (ret != 0) {
-        MDP_RETURN_ERROR(ret);
-      }
-      if (current_consumed > value2.size) {
-        MDP_DEBUG(
-            "Array item %u consumed %u bytes but buffer only has %u bytes\n", i,
-            current_consumed, value2.size);
-        MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
-      }
-      total_consumed += current_consumed;
+int _mdp_select_with_arena(mdp_context *context, mdp_arena *arena,
+                           const char *path, mol2_cursor_t *value,
+                           uint32_t *type) {
+  _mdp_inner inner_s;
+  _mdp_initialize_inner(&inner_s, context, _MDP_OUTPUT_NONE);
+  _mdp_inner *inner = &inner_s;
 
-      if (i != item_count - 1) {
-        _mdp_send_literal(inner, ",");
-      }
-      _mdp_send_literal(inner, "\n");
+  size_t mark = arena->used;
+  mdp_schema prepared;
+  // The caller's data source is used, so value stays valid after returning
+  mol2_cursor_t selected = context->data;
+  uint32_t selected_type = MDP_TYPE_UNRESOLVED;
+  if (_mdp_load_schema(inner, arena, &prepared) == MDP_OK) {
+    selected_type = inner->schema->top_level_type;
+    _mdp_select(inner, path, &selected, &selected_type);
+  }
+  arena->last_used = arena->used - mark;
+  arena->used = mark;
+  if (inner->last_error == MDP_OK) {
+    *value = selected;
+    if (type != NULL) {
+      *type = selected_type;
     }
-    *consumed_size = total_consumed;
   }
-  inner->indent_levels--;
-
-  _mdp_send_indents(inner);
-  _mdp_send_literal(inner, "]");
-
   return inner->last_error;
 }
 
-int _mdp_visit_struct(_mdp_inner *inner, mol2_cursor_t value,
-                      struct StructDefinitionType *t,
-                      mol2_num_t *consumed_size) {
-  if (inner->last_error != MDP_OK) {
-    return inner->last_error;
+int mdp_select(mdp_context context, const char *path, mol2_cursor_t *value,
+               uint32_t *type) {
+  _mdp_context_defaults(&context);
+  if (context.arena != NULL) {
+    return _mdp_select_with_arena(&context, context.arena, path, value, type);
   }
+  uint8_t buffer[MDP_DEFAULT_ARENA_SIZE];
+  mdp_arena arena;
+  mdp_arena_initialize(&arena, buffer, MDP_DEFAULT_ARENA_SIZE);
+  return _mdp_select_with_arena(&context, &arena, path, value, type);
+}
 
-  _mdp_send_indents(inner);
-  _mdp_send_cursor_to_feeder(inner, t->t->name(t));
-  _mdp_send_literal(inner, "(struct):\n");
+int mdp_build_index(mdp_context context, mdp_index *index) {
+  context.projection = NULL;
+  index->count = 0;
+  _mdp_inner inner;
+  _mdp_initialize_inner(&inner, &context, _MDP_OUTPUT_NONE);
+  inner.index = index;
+  return _mdp_visit_with_context_arena(&inner);
+}
 
-  inner->indent_levels++;
-  mol2_num_t total_consumed = 0;
-  struct FieldPairVecType fields = t->t->fields(t);
-  for (mol2_num_t i = 0; i < fields.t->len(&fields); i++) {
-    bool found = false;
-    struct FieldPairType field = fields.t->get(&fields, i, &found);
-    if (!found) {
-      MDP_DEBUG(
-          "Struct definition has %u entries but accessing entry %u results in "
-          "failure\n",
-          fields.t->len(&fields), i);
-      MDP_RETURN_ERROR(MDP_ERROR_SCHEMA_ENCODING);
+int mdp_index_select(const mdp_index *index, const mdp_schema *schema,
+                     const char *path, uint32_t *node) {
+  if (index->count == 0) {
+    return MDP_ERROR_PATH_NOT_FOUND;
+  }
+  uint32_t current = 0;
+  while (*path != '\0') {
+    if (*path == '/') {
+      path++;
+      continue;
     }
-    _mdp_send_indents(inner);
-    _mdp_send_cursor_to_feeder(inner, field.t->name(&field));
-    _mdp_send_literal(inner, ":\n");
+    size_t segment_length = 0;
+    while (path[segment_length] != '\0' && path[segment_length] != '/') {
+      segment_length++;
+    }
+    const mdp_index_node *n = &index->nodes[current];
+    if (n->type >= schema->definition_count) {
+      MDP_DEBUG("Target type cannot be found!\n");
+      return MDP_ERROR_SCHEMA_ENCODING;
+    }
+    const mdp_definition *t = &schema->definitions[n->type];
+    mol2_num_t position = 0;
 
-    inner->indent_levels++;
-    mol2_cursor_t value2 = value;
-    mol2_add_offset(&value2, total_consumed);
-    mol2_sub_size(&value2, total_consumed);
+    switch (t->kind) {
+      case MDP_KIND_OPTION: {
+        if (n->first_child == MDP_INDEX_NONE) {
+          return MDP_ERROR_PATH_NOT_FOUND;
+        }
+        // No segment is used by options
+        current = n->first_child;
+        continue;
+      }
+      case MDP_KIND_UNION: {
+        const mdp_field *variant =
+            _mdp_find_field(schema, t, path, segment_length);
+        if (variant == NULL || n->first_child == MDP_INDEX_NONE ||
+            index->nodes[n->first_child].type != variant->type) {
+          return MDP_ERROR_PATH_NOT_FOUND;
+        }
+      } break;
+      case MDP_KIND_TABLE:
+      case MDP_KIND_STRUCT: {
+        const mdp_field *field =
+            _mdp_find_field(schema, t, path, segment_length);
+        if (field == NULL) {
+          return MDP_ERROR_PATH_NOT_FOUND;
+        }
+        position = (mol2_num_t)(field - &schema->fields[t->first_field]);
+      } break;
+      case MDP_KIND_ARRAY:
+      case MDP_KIND_FIXVEC:
+      case MDP_KIND_DYNVEC: {
+        if (!_mdp_parse_index(path, segment_length, &position)) {
+          return MDP_ERROR_PATH_NOT_FOUND;
+        }
+      } break;
+      default: {
+        return MDP_ERROR_PATH_NOT_FOUND;
+      }
+    }
 
-    mol2_num_t current_consumed = 0;
-    int ret = _mdp_visit_subtype(inner, value2, field.t->typ(&field),
-                                 &current_consumed);
-    if (ret != 0) {
-      MDP_RETURN_ERROR(ret);
+    uint32_t child = n->first_child;
+    while (child != MDP_INDEX_NONE && position > 0) {
+      child = index->nodes[child].next_sibling;
+      position--;
     }
-    if (current_consumed > value2.size) {
-      MDP_DEBUG(
-          "Struct item #%u consumed %u bytes but buffer only has %u bytes\n", i,
-          current_consumed, value2.size);
-      MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+    if (child == MDP_INDEX_NONE) {
+      return MDP_ERROR_PATH_NOT_FOUND;
     }
-    total_consumed += current_consumed;
-    inner->indent_levels--;
+    current = child;
+    path += segment_length;
   }
-  inner->indent_levels--;
-
-  *consumed_size = total_consumed;
-
-  return inner->last_error;
+  *node = current;
+  return MDP_OK;
 }
 
-int _mdp_visit_fixvec(_mdp_inner *inner, mol2_cursor_t value,
-                      struct FixvecDefinitionType *t,
-                      mol2_num_t *consumed_size) {
-  if (inner->last_error != MDP_OK) {
-    return inner->last_error;
-  }
-
-  if (value.size < 4) {
-    MDP_DEBUG(
-        "Fixvec requires at least 4 bytes for item count but the value only "
-        "has length: "
-        "%u\n",
-        value.size);
-    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+int mdp_visit_node(mdp_context context, const mdp_index *index,
+                   uint32_t node) {
+  if (node >= index->count) {
+    return MDP_ERROR_PATH_NOT_FOUND;
   }
-  mol2_num_t item_count = mol2_unpack_number(&value);
-  mol2_cursor_t subtype = t->t->item(t);
-
-  _mdp_send_indents(inner);
-  _mdp_send_cursor_to_feeder(inner, t->t->name(t));
+  _mdp_inner inner;
+  _mdp_initialize_inner(&inner, &context, _MDP_OUTPUT_FEEDER);
+  inner.node = &index->nodes[node];
+  return _mdp_visit_with_context_arena(&inner);
+}
 
-  {
-    // Handle String builtin type
-    int match = 1;
-    int ret = _mdp_cursor_s_cmp(t->t->name(t), "String", &match);
-    if (ret != 0) {
-      MDP_RETURN_ERROR(ret);
-    }
-    if (match == 0) {
-      // String is a vector of byte
-      match = 1;
-      ret = _mdp_cursor_s_cmp(subtype, "byte", &match);
-      if (ret != 0) {
-        MDP_RETURN_ERROR(ret);
-      }
-      if (match != 0) {
-        MDP_DEBUG("String is a vector of bytes but schema differs!\n");
-        MDP_RETURN_ERROR(MDP_ERROR_SCHEMA_ENCODING);
-      }
-      if (value.size < item_count + 4) {
-        MDP_DEBUG("String of %u items has invalid length %u!\n", item_count,
-                  value.size);
-        MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
-      }
+/* A pair of values compared by mdp_visit_diff */
+typedef struct {
+  uint32_t type;
+  mol2_cursor_t old_value;
+  mol2_cursor_t new_value;
+  /* Length of the path of the values */
+  size_t path_length;
+  /*
+   * Values reported when they differ as a whole. Options use no segment, so
+   * values reached through options are reported as the outermost option.
+   */
+  uint32_t shown_type;
+  mol2_cursor_t shown_old;
+  mol2_cursor_t shown_new;
+  /* Set once split into parts, next is the next part to compare */
+  int split;
+  mol2_num_t next;
+  mol2_num_t old_count;
+  mol2_num_t new_count;
+  /* Offset of the next field of a struct */
+  uint64_t offset;
+} _mdp_diff_frame;
 
-      _mdp_send_literal(inner, ": \"");
-      mol2_cursor_t value2 = value;
-      mol2_add_offset(&value2, 4);
-      value2.size = item_count;
+typedef struct {
+  _mdp_inner *inner;
+  mdp_arena *arena;
+  const mdp_context *context;
+  /* Context rendering changed values, feeding _mdp_diff_feeder */
+  mdp_context render;
+  mol2_cursor_t old_data;
+  _mdp_diff_frame *frames;
+  uint32_t frame_count;
+  uint32_t frame_capacity;
+  char path[MDP_DIFF_PATH_LEN];
+  size_t path_length;
+  /* Prefix of lines being sent, line_start is set when one is due */
+  uint8_t prefix;
+  int line_start;
+  /* Most bytes of arena used at once */
+  size_t peak;
+} _mdp_diff;
+
+/* Sends text to the feeder of the caller */
+int _mdp_diff_send(_mdp_diff *diff, const void *data, size_t length) {
+  _mdp_inner *inner = diff->inner;
+  if (diff->context->feeder((const uint8_t *)data, length,
+                            diff->context->feeder_context) != 0) {
+    MDP_RETURN_ERROR(MDP_ERROR_FEEDER);
+  }
+  return inner->last_error;
+}
 
-      // Validate utf8 string, then send the utf8 bytes directly
-      mol2_cursor_t cursors[1] = {value2};
-      cursors_inputter_context inputter;
-      cursors_inputter_context_initialize(&inputter, cursors, 1);
-      ret =
-          MDP_VALIDATE_UTF8(cursors_inputter, &inputter, inner->context->feeder,
-                            inner->context->feeder_context);
-      if (ret != 0) {
-        MDP_DEBUG("UTF8 Validation error: %d", ret);
-        MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+/* Passes on the text of a changed value, prefixing each line */
+int _mdp_diff_feeder(const uint8_t *data, size_t length,
+                     void *feeder_context) {
+  _mdp_diff *diff = (_mdp_diff *)feeder_context;
+  while (length > 0) {
+    if (diff->line_start) {
+      if (_mdp_diff_send(diff, &diff->prefix, 1) != MDP_OK) {
+        return 1;
       }
-      _mdp_send_literal(inner, "\"");
-
-      *consumed_size = item_count + 4;
-      return inner->last_error;
+      diff->line_start = 0;
     }
+    const uint8_t *newline = (const uint8_t *)memchr(data, '\n', length);
+    size_t line = newline != NULL ? (size_t)(newline - data) + 1 : length;
+    if (_mdp_diff_send(diff, data, line) != MDP_OK) {
+      return 1;
+    }
+    diff->line_start = newline != NULL;
+    data += line;
+    length -= line;
   }
+  return 0;
+}
 
-  _mdp_send_printf(inner, "(fixvec, len = %u): [\n", item_count);
-
-  inner->indent_levels++;
-  int match = 1;
-  int ret = _mdp_cursor_s_cmp(subtype, "byte", &match);
-  if (ret != 0) {
+/* Sends the text of value, found in data, with lines prefixed by prefix */
+int _mdp_diff_send_value(_mdp_diff *diff, mol2_cursor_t data, uint32_t type,
+                         mol2_cursor_t value, uint8_t prefix) {
+  _mdp_inner *inner = diff->inner;
+  mdp_context context = diff->render;
+  context.data = data;
+  mdp_index_node node;
+  node.type = type;
+  node.offset = value.offset - data.offset;
+  node.size = value.size;
+  node.parent = MDP_INDEX_NONE;
+  node.first_child = MDP_INDEX_NONE;
+  node.next_sibling = MDP_INDEX_NONE;
+  _mdp_inner value_inner;
+  _mdp_initialize_inner(&value_inner, &context, _MDP_OUTPUT_FEEDER);
+  value_inner.node = &node;
+
+  diff->prefix = prefix;
+  diff->line_start = 1;
+  size_t used = diff->arena->used;
+  int ret = _mdp_visit_with_arena(&value_inner, diff->arena);
+  if (used + diff->arena->last_used > diff->peak) {
+    diff->peak = used + diff->arena->last_used;
+  }
+  if (ret != MDP_OK) {
     MDP_RETURN_ERROR(ret);
   }
-  if (match == 0) {
-    if (value.size < item_count + 4) {
-      MDP_DEBUG("Byte vec of %u items has invalid length %u!\n", item_count,
-                value.size);
-      MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
-    }
-
-    mol2_cursor_t value2 = value;
-    mol2_add_offset(&value2, 4);
-    value2.size = item_count;
-    _mdp_send_raw_bytes(inner, value2);
-    *consumed_size = item_count + 4;
-  } else {
-    mol2_num_t total_consumed = 4;
-    for (mol2_num_t i = 0; i < item_count; i++) {
-      mol2_cursor_t value2 = value;
-      mol2_add_offset(&value2, total_consumed);
-      mol2_sub_size(&value2, total_consumed);
-
-      mol2_num_t current_consumed = 0;
-      int ret = _mdp_visit_subtype(inner, value2, subtype, &current_consumed);
-      if (ret != 0) {
-        MDP_RETURN_ERROR(ret);
-      }
-      if (current_consumed > value2.size) {
-        MDP_DEBUG(
-            "Fixvec item %u consumed %u bytes but buffer only has %u bytes\n",
-            i, current_consumed, value2.size);
-        MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
-      }
-      total_consumed += current_consumed;
+  if (!diff->line_start) {
+    return _mdp_diff_send(diff, "\n", 1);
+  }
+  return inner->last_error;
+}
 
-      if (i != item_count - 1) {
-        _mdp_send_literal(inner, ",");
-      }
-      _mdp_send_literal(inner, "\n");
+/* Reports a change at the current path, a missing value has no text */
+int _mdp_diff_report(_mdp_diff *diff, uint32_t type,
+                     const mol2_cursor_t *old_value,
+                     const mol2_cursor_t *new_value) {
+  _mdp_inner *inner = diff->inner;
+  if (_mdp_diff_send(diff, "@@ ", 3) != MDP_OK) {
+    return inner->last_error;
+  }
+  // The top level value has an empty path, shown as "/"
+  if (diff->path_length == 0) {
+    if (_mdp_diff_send(diff, "/", 1) != MDP_OK) {
+      return inner->last_error;
     }
-    *consumed_size = total_consumed;
+  } else if (_mdp_diff_send(diff, diff->path, diff->path_length) != MDP_OK) {
+    return inner->last_error;
+  }
+  if (_mdp_diff_send(diff, "\n", 1) != MDP_OK) {
+    return inner->last_error;
+  }
+  if (old_value != NULL &&
+      _mdp_diff_send_value(diff, diff->old_data, type, *old_value, '-') !=
+          MDP_OK) {
+    return inner->last_error;
+  }
+  if (new_value != NULL) {
+    return _mdp_diff_send_value(diff, diff->render.data, type, *new_value,
+                                '+');
   }
-  inner->indent_levels--;
-
-  _mdp_send_indents(inner);
-  _mdp_send_literal(inner, "]");
-
   return inner->last_error;
 }
 
-int _mdp_visit_dynvec(_mdp_inner *inner, mol2_cursor_t value,
-                      struct DynvecDefinitionType *t,
-                      mol2_num_t *consumed_size) {
-  if (inner->last_error != MDP_OK) {
-    return inner->last_error;
+/* Appends a segment to the current path */
+int _mdp_diff_append(_mdp_diff *diff, const uint8_t *segment,
+                     size_t length) {
+  _mdp_inner *inner = diff->inner;
+  if (length >= MDP_DIFF_PATH_LEN - diff->path_length) {
+    MDP_DEBUG("Path exceeds %d bytes!\n", MDP_DIFF_PATH_LEN);
+    MDP_RETURN_ERROR(MDP_ERROR_ARENA);
   }
+  diff->path[diff->path_length++] = '/';
+  memcpy(&diff->path[diff->path_length], segment, length);
+  diff->path_length += length;
+  return inner->last_error;
+}
 
-  if (value.size < 4) {
-    MDP_DEBUG(
-        "Dynvec requires at least 4 bytes for full size but the value only "
-        "has length: "
-        "%u\n",
-        value.size);
-    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+int _mdp_diff_append_index(_mdp_diff *diff, mol2_num_t index) {
+  uint8_t digits[10];
+  size_t length = _mdp_decimal_length(index);
+  for (size_t i = length; i > 0; i--) {
+    digits[i - 1] = (uint8_t)('0' + index % 10);
+    index /= 10;
   }
-  mol2_num_t full_size = mol2_unpack_number(&value);
-  if (full_size > value.size) {
-    MDP_DEBUG("Dynvec requires %u bytes but buffer only has %u bytes!\n",
-              full_size, value.size);
-    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+  return _mdp_diff_append(diff, digits, length);
+}
+
+int _mdp_diff_push(_mdp_diff *diff, uint32_t type, mol2_cursor_t old_value,
+                   mol2_cursor_t new_value) {
+  _mdp_inner *inner = diff->inner;
+  if (diff->frame_count >= diff->frame_capacity) {
+    MDP_DEBUG("Frame stack of %u levels is exhausted!\n",
+              diff->frame_capacity);
+    MDP_RETURN_ERROR(MDP_ERROR_ARENA);
   }
+  _mdp_diff_frame *f = &diff->frames[diff->frame_count++];
+  memset(f, 0, sizeof(_mdp_diff_frame));
+  f->type = type;
+  f->old_value = old_value;
+  f->new_value = new_value;
+  f->path_length = diff->path_length;
+  f->shown_type = type;
+  f->shown_old = old_value;
+  f->shown_new = new_value;
+  return inner->last_error;
+}
 
-  if (full_size == 4) {
-    // Empty vec
-    *consumed_size = 4;
+/*
+ * Compares the values of f. f is finished when they are equal, or when they
+ * can only be reported as a whole, otherwise f is split into parts.
+ */
+int _mdp_diff_enter(_mdp_diff *diff, _mdp_diff_frame *f) {
+  _mdp_inner *inner = diff->inner;
+  const mdp_schema *schema = inner->schema;
+  int equal = 0;
+  int ret = _mdp_cursors_equal(f->old_value, f->new_value, &equal);
+  if (ret != MDP_OK) {
+    MDP_RETURN_ERROR(ret);
+  }
+  if (equal) {
+    diff->frame_count--;
     return inner->last_error;
   }
-  if (full_size < 8) {
-    MDP_DEBUG(
-        "Non-empty dynvec requires an offset at least, but length %u is not "
-        "enough!\n",
-        full_size);
-    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+  if (f->type >= schema->definition_count) {
+    MDP_DEBUG("Target type cannot be found!\n");
+    MDP_RETURN_ERROR(MDP_ERROR_SCHEMA_ENCODING);
   }
 
-  mol2_cursor_t tvalue = value;
-  mol2_add_offset(&tvalue, 4);
-  mol2_num_t first_offset = mol2_unpack_number(&tvalue);
-  if ((first_offset % 4) != 0 || first_offset < 8) {
-    MDP_DEBUG("Invalid dynvec first offset: %u!\n", first_offset);
-    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+  const mdp_definition *t = &schema->definitions[f->type];
+  mol2_num_t full_size = 0;
+  int whole = t->builtin != MDP_BUILTIN_NONE;
+  switch (t->kind) {
+    case MDP_KIND_TABLE:
+    case MDP_KIND_STRUCT:
+      f->old_count = t->field_count;
+      f->new_count = t->field_count;
+      break;
+    case MDP_KIND_ARRAY:
+      if (t->item_count > 0xFFFFFFFF) {
+        MDP_DEBUG("Item count %lu is invalid!\n",
+                  (unsigned long)t->item_count);
+        MDP_RETURN_ERROR(MDP_ERROR_SCHEMA_ENCODING);
+      }
+      whole = whole || t->item == MDP_TYPE_BYTE;
+      f->old_count = (mol2_num_t)t->item_count;
+      f->new_count = (mol2_num_t)t->item_count;
+      break;
+    case MDP_KIND_FIXVEC:
+      whole = whole || t->item == MDP_TYPE_BYTE;
+      if (!whole) {
+        if (f->old_value.size < 4 || f->new_value.size < 4) {
+          MDP_DEBUG("Fixvec requires at least 4 bytes for item count!\n");
+          MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+        }
+        f->old_count = mol2_unpack_number(&f->old_value);
+        f->new_count = mol2_unpack_number(&f->new_value);
+      }
+      break;
+    case MDP_KIND_DYNVEC:
+      if (_mdp_dynamic_header(inner, f->old_value, &full_size,
+                              &f->old_count) != MDP_OK ||
+          _mdp_dynamic_header(inner, f->new_value, &full_size,
+                              &f->new_count) != MDP_OK) {
+        return inner->last_error;
+      }
+      break;
+    case MDP_KIND_UNION:
+      if (!whole) {
+        if (f->old_value.size < 4 || f->new_value.size < 4) {
+          MDP_DEBUG("Union requires at least 4 bytes for ID!\n");
+          MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+        }
+        // A union switching variants is reported as a whole
+        whole = mol2_unpack_number(&f->old_value) !=
+                mol2_unpack_number(&f->new_value);
+        f->old_count = 1;
+        f->new_count = 1;
+      }
+      break;
+    case MDP_KIND_OPTION:
+      whole = f->old_value.size == 0 || f->new_value.size == 0;
+      f->old_count = 1;
+      f->new_count = 1;
+      break;
+    default:
+      whole = 1;
+      break;
   }
 
-  mol2_num_t item_count = first_offset / 4 - 1;
-  if (value.size < 4 * (item_count + 1)) {
-    MDP_DEBUG(
-        "A dynvec of %u items requires minimal %u bytes, but actual length is "
-        "%u!\n",
-        item_count, 4 * (item_count + 1), value.size);
-    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+  if (whole) {
+    uint32_t type = f->shown_type;
+    mol2_cursor_t old_value = f->shown_old;
+    mol2_cursor_t new_value = f->shown_new;
+    diff->path_length = f->path_length;
+    diff->frame_count--;
+    return _mdp_diff_report(diff, type, &old_value, &new_value);
   }
+  f->split = 1;
+  return inner->last_error;
+}
 
-  _mdp_send_indents(inner);
-  _mdp_send_cursor_to_feeder(inner, t->t->name(t));
-  _mdp_send_printf(inner, "(dynvec, len = %u): [\n", item_count);
-
-  inner->indent_levels++;
-  mol2_num_t total_consumed = first_offset;
-  mol2_cursor_t subtype = t->t->item(t);
-  for (mol2_num_t i = 0; i < item_count; i++) {
-    mol2_num_t end;
-    if (i < item_count - 1) {
-      tvalue = value;
-      mol2_add_offset(&tvalue, 4 + 4 * (i + 1));
-      end = mol2_unpack_number(&tvalue);
-    } else {
-      end = full_size;
-    }
-    if (end < total_consumed || end > value.size) {
-      MDP_DEBUG("Dynvec item %u has invalid offset: (%u, %u)!\n", i,
-                total_consumed, end);
-      MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+/* Compares the next part of the values of f */
+int _mdp_diff_next(_mdp_diff *diff, _mdp_diff_frame *f) {
+  _mdp_inner *inner = diff->inner;
+  const mdp_schema *schema = inner->schema;
+  const mdp_definition *t = &schema->definitions[f->type];
+  mol2_num_t index = f->next++;
+  int has_old = index < f->old_count;
+  int has_new = index < f->new_count;
+  mol2_cursor_t old_value = f->old_value;
+  mol2_cursor_t new_value = f->new_value;
+  uint32_t type = t->item;
+  diff->path_length = f->path_length;
+
+  switch (t->kind) {
+    case MDP_KIND_TABLE: {
+      uint32_t field_index = t->first_field + index;
+      const mdp_field *field = &schema->fields[field_index];
+      if (_mdp_field_hidden(inner, field_index)) {
+        return inner->last_error;
+      }
+      if (_mdp_select_dynamic_item(inner, &old_value, index,
+                                   t->field_count) != MDP_OK ||
+          _mdp_select_dynamic_item(inner, &new_value, index,
+                                   t->field_count) != MDP_OK) {
+        return inner->last_error;
+      }
+      type = field->type;
+      _mdp_diff_append(diff, field->name, field->name_length);
+    } break;
+    case MDP_KIND_STRUCT: {
+      uint32_t field_index = t->first_field + index;
+      const mdp_field *field = &schema->fields[field_index];
+      uint32_t size = _mdp_fixed_size(schema, field->type);
+      uint64_t offset = f->offset;
+      f->offset += size;
+      if (_mdp_field_hidden(inner, field_index)) {
+        return inner->last_error;
+      }
+      if (_mdp_select_fixed_item(inner, &old_value, offset, size) !=
+              MDP_OK ||
+          _mdp_select_fixed_item(inner, &new_value, offset, size) !=
+              MDP_OK) {
+        return inner->last_error;
+      }
+      type = field->type;
+      _mdp_diff_append(diff, field->name, field->name_length);
+    } break;
+    case MDP_KIND_ARRAY:
+    case MDP_KIND_FIXVEC: {
+      uint32_t item_size = _mdp_fixed_size(schema, t->item);
+      uint64_t offset = (uint64_t)index * item_size;
+      if (t->kind == MDP_KIND_FIXVEC) {
+        offset += 4;
+      }
+      if ((has_old && _mdp_select_fixed_item(inner, &old_value, offset,
+                                             item_size) != MDP_OK) ||
+          (has_new && _mdp_select_fixed_item(inner, &new_value, offset,
+                                             item_size) != MDP_OK)) {
+        return inner->last_error;
+      }
+      _mdp_diff_append_index(diff, index);
+    } break;
+    case MDP_KIND_DYNVEC: {
+      if ((has_old && _mdp_select_dynamic_item(inner, &old_value, index,
+                                               0) != MDP_OK) ||
+          (has_new && _mdp_select_dynamic_item(inner, &new_value, index,
+                                               0) != MDP_OK)) {
+        return inner->last_error;
+      }
+      _mdp_diff_append_index(diff, index);
+    } break;
+    case MDP_KIND_UNION: {
+      mol2_num_t union_id = mol2_unpack_number(&old_value);
+      const mdp_field *variant = NULL;
+      for (uint32_t i = 0; i < t->field_count; i++) {
+        if (schema->fields[t->first_field + i].id == (uint64_t)union_id) {
+          variant = &schema->fields[t->first_field + i];
+          break;
+        }
+      }
+      if (variant == NULL) {
+        MDP_DEBUG("Cannot find union variant with ID %u\n", union_id);
+        MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+      }
+      mol2_add_offset(&old_value, 4);
+      mol2_sub_size(&old_value, 4);
+      mol2_add_offset(&new_value, 4);
+      mol2_sub_size(&new_value, 4);
+      type = variant->type;
+      _mdp_diff_append(diff, variant->name, variant->name_length);
+    } break;
+    default:
+      // No segment is used by options
+      break;
+  }
+  if (inner->last_error != MDP_OK) {
+    return inner->last_error;
+  }
+  if (has_old && has_new) {
+    if (_mdp_diff_push(diff, type, old_value, new_value) == MDP_OK &&
+        t->kind == MDP_KIND_OPTION) {
+      _mdp_diff_frame *child = &diff->frames[diff->frame_count - 1];
+      child->shown_type = f->shown_type;
+      child->shown_old = f->shown_old;
+      child->shown_new = f->shown_new;
     }
+    return inner->last_error;
+  }
+  return _mdp_diff_report(diff, type, has_old ? &old_value : NULL,
+                          has_new ? &new_value : NULL);
+}
 
-    mol2_cursor_t value2 = value;
-    mol2_add_offset(&value2, total_consumed);
-    value2.size = end - total_consumed;
+int _mdp_diff_with_arena(mdp_context *context, mdp_arena *arena,
+                         mol2_cursor_t old_data) {
+  _mdp_inner inner_s;
+  _mdp_initialize_inner(&inner_s, context, _MDP_OUTPUT_NONE);
+  _mdp_inner *inner = &inner_s;
 
-    mol2_num_t current_consumed = 0;
-    int ret = _mdp_visit_subtype(inner, value2, subtype, &current_consumed);
-    if (ret != 0) {
-      MDP_RETURN_ERROR(ret);
-    }
-    if (current_consumed != value2.size) {
-      MDP_DEBUG(
-          "Dynvec item %u consumed incorrect bytes, actual: %u, expected: %u\n",
-          i, current_consumed, value2.size);
-      MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+  size_t mark = arena->used;
+  mdp_schema prepared;
+  _mdp_diff diff;
+  memset(&diff, 0, sizeof(_mdp_diff));
+  if (_mdp_load_schema(inner, arena, &prepared) == MDP_OK) {
+    diff.inner = inner;
+    diff.arena = arena;
+    diff.context = context;
+    diff.old_data = old_data;
+    // Changed values are rendered with the schema prepared here
+    diff.render = *context;
+    diff.render.prepared_schema = inner->schema;
+    diff.render.feeder = _mdp_diff_feeder;
+    diff.render.feeder_context = &diff;
+    diff.frame_capacity = inner->schema->max_depth;
+    diff.frames = (_mdp_diff_frame *)mdp_arena_alloc(
+        arena, sizeof(_mdp_diff_frame) * diff.frame_capacity);
+    if (diff.frames == NULL) {
+      MDP_SET_ERROR(MDP_ERROR_ARENA);
+    } else {
+      _mdp_diff_push(&diff, inner->schema->top_level_type, old_data,
+                     context->data);
     }
-    total_consumed += current_consumed;
-
-    if (i != item_count - 1) {
-      _mdp_send_literal(inner, ",");
+  }
+  while (diff.frame_count > 0 && inner->last_error == MDP_OK) {
+    _mdp_diff_frame *f = &diff.frames[diff.frame_count - 1];
+    if (!f->split) {
+      _mdp_diff_enter(&diff, f);
+    } else if (f->next < f->old_count || f->next < f->new_count) {
+      _mdp_diff_next(&diff, f);
+    } else {
+      diff.frame_count--;
     }
-    _mdp_send_literal(inner, "\n");
   }
-  if (total_consumed != full_size) {
-    MDP_DEBUG("Dynvec's full size is %u but only consumed %u bytes!\n",
-              full_size, total_consumed);
-    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+  if (arena->used > diff.peak) {
+    diff.peak = arena->used;
   }
-
-  *consumed_size = total_consumed;
-  inner->indent_levels--;
-
-  _mdp_send_indents(inner);
-  _mdp_send_literal(inner, "]");
-
+  arena->last_used = diff.peak - mark;
+  arena->used = mark;
   return inner->last_error;
 }
 
-int _mdp_visit_table(_mdp_inner *inner, mol2_cursor_t value,
-                     struct TableDefinitionType *t, mol2_num_t *consumed_size) {
-  if (inner->last_error != MDP_OK) {
-    return inner->last_error;
+int mdp_visit_diff(mdp_context context, mol2_cursor_t old_data) {
+  _mdp_context_defaults(&context);
+  if (context.arena != NULL) {
+    return _mdp_diff_with_arena(&context, context.arena, old_data);
   }
+  uint8_t buffer[MDP_DEFAULT_ARENA_SIZE];
+  mdp_arena arena;
+  mdp_arena_initialize(&arena, buffer, MDP_DEFAULT_ARENA_SIZE);
+  return _mdp_diff_with_arena(&context, &arena, old_data);
+}
 
-  if (value.size < 8) {
-    MDP_DEBUG(
-        "Table requires at least 8 bytes for full size but the value only "
-        "has length: "
-        "%u\n",
-        value.size);
-    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+/* A range of data kept in the window of a streaming visit */
+typedef struct {
+  uint32_t offset;
+  uint32_t length;
+  /* Position of the range in window */
+  size_t position;
+} _mdp_segment;
+
+/*
+ * Data of a streaming visit kept in window, as ascending segments. The last
+ * segment always ends at received.
+ */
+typedef struct {
+  _mdp_inner *inner;
+  uint8_t *window;
+  size_t window_size;
+  _mdp_segment *segments;
+  _mdp_segment *spare_segments;
+  uint32_t segment_count;
+  uint32_t segment_capacity;
+  uint32_t received;
+  /* Set when a step reads data not received yet */
+  int starved;
+} _mdp_stream;
+
+/* State of a visit in pull mode, kept in the arena */
+typedef struct {
+  mdp_context context;
+  _mdp_inner inner;
+  mdp_schema prepared;
+  /* Text delivered by previous calls for the interrupted step */
+  size_t step_delivered;
+  int done;
+  /* Only used by streaming visits */
+  _mdp_stream *stream;
+} _mdp_pull_state;
+
+int mdp_visit_begin(mdp_pull *pull, mdp_context context) {
+  _mdp_context_defaults(&context);
+  memset(pull, 0, sizeof(mdp_pull));
+  mdp_arena *arena = context.arena;
+  if (arena == NULL) {
+    return MDP_ERROR_ARENA;
   }
-  mol2_num_t full_size = mol2_unpack_number(&value);
-  if (full_size > value.size) {
-    MDP_DEBUG("Table requires %u bytes but buffer only has %u bytes!\n",
-              full_size, value.size);
-    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+  size_t mark = arena->used;
+  _mdp_pull_state *state =
+      (_mdp_pull_state *)mdp_arena_alloc(arena, sizeof(_mdp_pull_state));
+  if (state == NULL) {
+    return MDP_ERROR_ARENA;
   }
+  memset(state, 0, sizeof(_mdp_pull_state));
+  state->context = context;
+  _mdp_inner *inner = &state->inner;
+  _mdp_initialize_inner(inner, &state->context, _MDP_OUTPUT_PULL);
 
-  if (full_size < 8) {
-    MDP_DEBUG(
-        "Table requires an offset at least, but length %u is not "
-        "enough!\n",
-        full_size);
-    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+  int ret = _mdp_begin(inner, arena, &state->prepared);
+  if (ret != MDP_OK) {
+    arena->last_used = arena->used - mark;
+    arena->used = mark;
+    return ret;
   }
+  pull->state = state;
+  pull->arena = arena;
+  pull->mark = mark;
+  return MDP_OK;
+}
 
-  mol2_cursor_t tvalue = value;
-  mol2_add_offset(&tvalue, 4);
-  mol2_num_t first_offset = mol2_unpack_number(&tvalue);
-  if ((first_offset % 4) != 0 || first_offset < 8) {
-    MDP_DEBUG("Invalid table first offset: %u!\n", first_offset);
-    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+/*
+ * Runs a single step in pull mode. When the buffer fills up, all state
+ * touched by the step is rolled back, so the step can be replayed later.
+ */
+int _mdp_pull_step(_mdp_pull_state *state) {
+  _mdp_inner *inner = &state->inner;
+  _mdp_inner saved = *inner;
+  _mdp_frame top, parent;
+  if (inner->frame_count > 0) {
+    top = inner->frames[inner->frame_count - 1];
   }
-
-  mol2_num_t field_count = first_offset / 4 - 1;
-  if (value.size < 4 * (field_count + 1)) {
-    MDP_DEBUG(
-        "A table of %u fields requires minimal %u bytes, but actual length is "
-        "%u!\n",
-        field_count, 4 * (field_count + 1), value.size);
-    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+  if (inner->frame_count > 1) {
+    parent = inner->frames[inner->frame_count - 2];
   }
+  size_t start = inner->output_length;
+  inner->skip = state->step_delivered;
 
-  struct FieldPairVecType fields = t->t->fields(t);
-  if (field_count != fields.t->len(&fields)) {
-    /* TODO: do we need compatible support? */
-    MDP_DEBUG("Table requires %u fields, but actual data has %u fields!\n",
-              fields.t->len(&fields), field_count);
-    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+  if (inner->frame_count > 0) {
+    _mdp_step(inner);
+  } else if (_mdp_finish(inner) == MDP_OK) {
+    state->done = 1;
+  }
+  // A step reading data not received yet stops as a suspended one
+  int starved = state->stream != NULL && state->stream->starved;
+  if (inner->last_error != _MDP_SUSPEND && !starved) {
+    state->step_delivered = 0;
+    return inner->last_error;
   }
 
-  _mdp_send_indents(inner);
-  _mdp_send_cursor_to_feeder(inner, t->t->name(t));
-  _mdp_send_literal(inner, "(table): {\n");
+  size_t delivered = inner->output_length - start;
+  *inner = saved;
+  inner->output_length = start + delivered;
+  if (inner->frame_count > 0) {
+    inner->frames[inner->frame_count - 1] = top;
+  }
+  if (inner->frame_count > 1) {
+    inner->frames[inner->frame_count - 2] = parent;
+  }
+  state->done = 0;
+  state->step_delivered += delivered;
+  return _MDP_SUSPEND;
+}
 
-  inner->indent_levels++;
-  mol2_num_t total_consumed = first_offset;
-  for (mol2_num_t i = 0; i < field_count; i++) {
-    mol2_num_t end;
-    if (i < field_count - 1) {
-      tvalue = value;
-      mol2_add_offset(&tvalue, 4 + 4 * (i + 1));
-      end = mol2_unpack_number(&tvalue);
-    } else {
-      end = full_size;
+int mdp_visit_next(mdp_pull *pull, uint8_t *buffer, size_t capacity,
+                   size_t *length) {
+  *length = 0;
+  if (capacity == 0) {
+    return MDP_ERROR_FEEDER;
+  }
+  _mdp_pull_state *state = (_mdp_pull_state *)pull->state;
+  _mdp_inner *inner = &state->inner;
+  if (inner->last_error != MDP_OK) {
+    return inner->last_error;
+  }
+  inner->output = buffer;
+  inner->output_length = 0;
+  inner->output_capacity = capacity;
+  int ret = MDP_OK;
+  while (!state->done && inner->output_length < capacity) {
+    if (_mdp_pull_step(state) == _MDP_SUSPEND) {
+      if (state->stream != NULL && state->stream->starved) {
+        state->stream->starved = 0;
+        ret = MDP_NEED_DATA;
+      }
+      break;
     }
-    if (end < total_consumed || end > value.size) {
-      MDP_DEBUG("Table field %u has invalid offset: (%u, %u)!\n", i,
-                total_consumed, end);
-      MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+    if (inner->last_error != MDP_OK) {
+      return inner->last_error;
     }
+  }
+  *length = inner->output_length;
+  inner->output = NULL;
+  return ret;
+}
 
-    mol2_cursor_t value2 = value;
-    mol2_add_offset(&value2, total_consumed);
-    value2.size = end - total_consumed;
+/* Serves reads from window, a read beyond received data starves the step */
+uint32_t _mdp_stream_read(uintptr_t args[], uint8_t *ptr, uint32_t len,
+                          uint32_t offset) {
+  _mdp_stream *stream = (_mdp_stream *)args[0];
+  _mdp_inner *inner = stream->inner;
+  for (uint32_t i = 0; i < stream->segment_count; i++) {
+    const _mdp_segment *segment = &stream->segments[i];
+    if (offset >= segment->offset &&
+        (uint64_t)offset + len <= (uint64_t)segment->offset + segment->length) {
+      memcpy(ptr, &stream->window[segment->position + offset - segment->offset],
+             len);
+      return len;
+    }
+  }
+  // The molecule reader requires full reads, zeros are returned, and readers
+  // stop the step on the error set here before using them
+  memset(ptr, 0, len);
+  if ((uint64_t)offset + len > stream->received) {
+    stream->starved = 1;
+    if (inner->last_error == MDP_OK) {
+      MDP_SET_ERROR(_MDP_SUSPEND);
+    }
+  } else if (inner->last_error == MDP_OK) {
+    MDP_DEBUG("Data at %u of %u bytes is already released!\n", offset, len);
+    MDP_SET_ERROR(MDP_ERROR_MOL2_IO);
+  }
+  return len;
+}
 
-    bool found = false;
-    struct FieldPairType field = fields.t->get(&fields, i, &found);
-    if (!found) {
-      MDP_DEBUG(
-          "Table definition has %u entries but accessing entry %u results in "
-          "failure\n",
-          fields.t->len(&fields), i);
-      MDP_RETURN_ERROR(MDP_ERROR_SCHEMA_ENCODING);
+/*
+ * Appends a range still needed to segments, ranges must be given in
+ * ascending order.
+ */
+void _mdp_stream_keep(_mdp_stream *stream, _mdp_segment *segments,
+                      uint32_t *count, uint32_t start, uint32_t end) {
+  // Offsets are read lazily, so headers might not be fully received
+  if (end > stream->received) {
+    end = stream->received;
+  }
+  if (start > end) {
+    start = end;
+  }
+  if (*count > 0) {
+    _mdp_segment *last = &segments[*count - 1];
+    if (start <= last->offset + last->length) {
+      if (end > last->offset + last->length) {
+        last->length = end - last->offset;
+      }
+      return;
     }
-    _mdp_send_indents(inner);
-    _mdp_send_cursor_to_feeder(inner, field.t->name(&field));
-    _mdp_send_literal(inner, ":\n");
+  }
+  segments[*count].offset = start;
+  segments[*count].length = end - start;
+  (*count)++;
+}
 
-    inner->indent_levels++;
-    mol2_num_t current_consumed = 0;
-    int ret = _mdp_visit_subtype(inner, value2, field.t->typ(&field),
-                                 &current_consumed);
-    if (ret != 0) {
-      MDP_RETURN_ERROR(ret);
+/*
+ * Releases data no longer needed from window: everything before the next
+ * value to visit, except the remaining offsets of tables and dynvecs.
+ */
+void _mdp_stream_compact(_mdp_stream *stream) {
+  _mdp_inner *inner = stream->inner;
+  _mdp_segment *kept = stream->spare_segments;
+  uint32_t kept_count = 0;
+  uint32_t frontier = stream->received;
+  for (uint32_t i = 0; i < inner->frame_count; i++) {
+    const _mdp_frame *f = &inner->frames[i];
+    int top = i + 1 == inner->frame_count;
+    if (top && f->phase == _MDP_PHASE_ENTER) {
+      frontier = f->value.offset;
+      break;
     }
-    if (current_consumed != value2.size) {
-      MDP_DEBUG(
-          "Dynvec item %u consumed incorrect bytes, actual: %u, expected: %u\n",
-          i, current_consumed, value2.size);
-      MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+    uint8_t kind = inner->schema->definitions[f->type].kind;
+    if (kind == MDP_KIND_TABLE || kind == MDP_KIND_DYNVEC) {
+      uint32_t start = f->value.offset + 4 * (f->index + 1);
+      uint32_t end = f->value.offset + 4 * (f->count + 1);
+      if (start < end) {
+        _mdp_stream_keep(stream, kept, &kept_count, start, end);
+      }
     }
-    total_consumed += current_consumed;
-
-    if (i != field_count - 1) {
-      _mdp_send_literal(inner, ",");
+    if (top) {
+      frontier = inner->consumed_end;
     }
-    _mdp_send_literal(inner, "\n");
-    inner->indent_levels--;
   }
-  if (total_consumed != full_size) {
-    MDP_DEBUG("Dynvec's full size is %u but only consumed %u bytes!\n",
-              full_size, total_consumed);
-    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
+  _mdp_stream_keep(stream, kept, &kept_count, frontier, stream->received);
+
+  // Kept ranges only shrink from existing segments, so data moves towards
+  // the start of window
+  size_t position = 0;
+  uint32_t j = 0;
+  for (uint32_t i = 0; i < kept_count; i++) {
+    while (j + 1 < stream->segment_count &&
+           stream->segments[j].offset + stream->segments[j].length <
+               kept[i].offset + kept[i].length) {
+      j++;
+    }
+    const _mdp_segment *segment = &stream->segments[j];
+    memmove(&stream->window[position],
+            &stream->window[segment->position + kept[i].offset -
+                            segment->offset],
+            kept[i].length);
+    kept[i].position = position;
+    position += kept[i].length;
   }
-
-  *consumed_size = total_consumed;
-  inner->indent_levels--;
-
-  _mdp_send_indents(inner);
-  _mdp_send_literal(inner, "}");
-
-  return inner->last_error;
+  stream->spare_segments = stream->segments;
+  stream->segments = kept;
+  stream->segment_count = kept_count;
 }
 
-int _mdp_visit_subtype(_mdp_inner *inner, mol2_cursor_t value,
-                       mol2_cursor_t sub_type_name, mol2_num_t *consumed_size) {
-  if (inner->last_error != MDP_OK) {
-    return inner->last_error;
+int mdp_visit_begin_stream(mdp_pull *pull, mdp_context context, uint32_t size,
+                           size_t window) {
+  _mdp_context_defaults(&context);
+  memset(pull, 0, sizeof(mdp_pull));
+  mdp_arena *arena = context.arena;
+  if (arena == NULL) {
+    return MDP_ERROR_ARENA;
   }
-
-  int match = 1;
-  int ret = _mdp_cursor_s_cmp(sub_type_name, "byte", &match);
-  if (ret != 0) {
-    MDP_RETURN_ERROR(ret);
+  size_t mark = arena->used;
+  _mdp_pull_state *state =
+      (_mdp_pull_state *)mdp_arena_alloc(arena, sizeof(_mdp_pull_state));
+  _mdp_stream *stream =
+      (_mdp_stream *)mdp_arena_alloc(arena, sizeof(_mdp_stream));
+  uint8_t *buffer = (uint8_t *)mdp_arena_alloc(arena, window);
+  mol2_data_source_t source;
+  memset(&source, 0, sizeof(mol2_data_source_t));
+  source.read = _mdp_stream_read;
+  source.total_size = size;
+  source.args[0] = (uintptr_t)stream;
+  mol2_data_source_t *direct = _mdp_arena_clone_source(arena, &source, 0);
+  if (state == NULL || stream == NULL || buffer == NULL || direct == NULL) {
+    arena->used = mark;
+    return MDP_ERROR_ARENA;
   }
-  if (match == 0) {
-    _mdp_send_indents(inner);
-    uint8_t c;
-    if (mol2_read_at(&value, &c, 1) != 1) {
-      MDP_DEBUG("Reading a single byte from cursor results in error!\n");
-      MDP_RETURN_ERROR(MDP_ERROR_MOL2_IO);
+  memset(state, 0, sizeof(_mdp_pull_state));
+  memset(stream, 0, sizeof(_mdp_stream));
+  state->context = context;
+  state->context.data.offset = 0;
+  state->context.data.size = size;
+  state->context.data.data_source = direct;
+  state->stream = stream;
+  _mdp_inner *inner = &state->inner;
+  _mdp_initialize_inner(inner, &state->context, _MDP_OUTPUT_PULL);
+  inner->uncached = 1;
+  stream->inner = inner;
+  stream->window = buffer;
+  stream->window_size = window;
+
+  int ret = _mdp_begin(inner, arena, &state->prepared);
+  if (ret == MDP_OK) {
+    // A kept range for each level, plus data not visited yet
+    stream->segment_capacity = inner->frame_capacity + 1;
+    stream->segments = (_mdp_segment *)mdp_arena_alloc(
+        arena, sizeof(_mdp_segment) * stream->segment_capacity * 2);
+    if (stream->segments == NULL) {
+      ret = MDP_ERROR_ARENA;
     }
-    mol2_add_offset(&value, 1);
-    mol2_sub_size(&value, 1);
-
-    _mdp_send_printf(inner, "0x%x", c);
-    *consumed_size = 1;
-    return inner->last_error;
   }
-
-  struct DefinitionVecType vec = inner->defs.t->definitions(&inner->defs);
-  for (uint32_t i = 0; i < vec.t->len(&vec); i++) {
-    bool found = false;
-    struct DefinitionType d = vec.t->get(&vec, i, &found);
-    if (!found) {
-      MDP_DEBUG(
-          "Definitions have %u entries but accessing entry %u results in "
-          "failure\n",
-          vec.t->len(&vec), i);
-      MDP_RETURN_ERROR(MDP_ERROR_SCHEMA_ENCODING);
-    }
-
-    switch (d.t->item_id(&d)) {
-      case 0: {
-        struct OptionDefinitionType t = d.t->as_OptionDefinition(&d);
-        int match = 1;
-        int ret = _mdp_cursor_cmp(sub_type_name, t.t->name(&t), &match);
-        if (ret != MDP_OK) {
-          MDP_RETURN_ERROR(ret);
-        }
-        if (match == 0) {
-          return _mdp_visit_option(inner, value, &t, consumed_size);
-        }
-      } break;
-      case 1: {
-        struct UnionDefinitionType t = d.t->as_UnionDefinition(&d);
-        int match = 1;
-        int ret = _mdp_cursor_cmp(sub_type_name, t.t->name(&t), &match);
-        if (ret != MDP_OK) {
-          MDP_RETURN_ERROR(ret);
-        }
-        if (match == 0) {
-          return _mdp_visit_union(inner, value, &t, consumed_size);
-        }
-      } break;
-      case 2: {
-        struct ArrayDefinitionType t = d.t->as_ArrayDefinition(&d);
-        int match = 1;
-        int ret = _mdp_cursor_cmp(sub_type_name, t.t->name(&t), &match);
-        if (ret != MDP_OK) {
-          MDP_RETURN_ERROR(ret);
-        }
-        if (match == 0) {
-          return _mdp_visit_array(inner, value, &t, consumed_size);
-        }
-      } break;
-      case 3: {
-        struct StructDefinitionType t = d.t->as_StructDefinition(&d);
-        int match = 1;
-        int ret = _mdp_cursor_cmp(sub_type_name, t.t->name(&t), &match);
-        if (ret != MDP_OK) {
-          MDP_RETURN_ERROR(ret);
-        }
-        if (match == 0) {
-          return _mdp_visit_struct(inner, value, &t, consumed_size);
-        }
-      } break;
-      case 4: {
-        struct FixvecDefinitionType t = d.t->as_FixvecDefinition(&d);
-        int match = 1;
-        int ret = _mdp_cursor_cmp(sub_type_name, t.t->name(&t), &match);
-        if (ret != MDP_OK) {
-          MDP_RETURN_ERROR(ret);
-        }
-        if (match == 0) {
-          return _mdp_visit_fixvec(inner, value, &t, consumed_size);
-        }
-      } break;
-      case 5: {
-        struct DynvecDefinitionType t = d.t->as_DynvecDefinition(&d);
-        int match = 1;
-        int ret = _mdp_cursor_cmp(sub_type_name, t.t->name(&t), &match);
-        if (ret != MDP_OK) {
-          MDP_RETURN_ERROR(ret);
-        }
-        if (match == 0) {
-          return _mdp_visit_dynvec(inner, value, &t, consumed_size);
-        }
-      } break;
-      case 6: {
-        struct TableDefinitionType t = d.t->as_TableDefinition(&d);
-        int match = 1;
-        int ret = _mdp_cursor_cmp(sub_type_name, t.t->name(&t), &match);
-        if (ret != MDP_OK) {
-          MDP_RETURN_ERROR(ret);
-        }
-        if (match == 0) {
-          return _mdp_visit_table(inner, value, &t, consumed_size);
-        }
-      } break;
-      default: {
-        MDP_DEBUG("Invalid union for Definitions id: %u", d.t->item_id(&d));
-        MDP_RETURN_ERROR(MDP_ERROR_SCHEMA_ENCODING);
-      } break;
-    }
+  if (ret != MDP_OK) {
+    arena->last_used = arena->used - mark;
+    arena->used = mark;
+    return ret;
   }
-
-  MDP_DEBUG("Target type cannot be found!\n");
-  MDP_RETURN_ERROR(MDP_ERROR_SCHEMA_ENCODING);
+  stream->spare_segments = &stream->segments[stream->segment_capacity];
+  stream->segments[0].offset = 0;
+  stream->segments[0].length = 0;
+  stream->segments[0].position = 0;
+  stream->segment_count = 1;
+  pull->state = state;
+  pull->arena = arena;
+  pull->mark = mark;
+  return MDP_OK;
 }
 
-int mdp_visit(mdp_context context) {
-  _mdp_inner inner_s;
-  inner_s.context = &context;
-  inner_s.defs = make_Definitions(&context.schema);
-  inner_s.indent_levels = 0;
-  inner_s.last_error = MDP_OK;
-  _mdp_inner *inner = &inner_s;
-
-  uint64_t syntax_version = inner->defs.t->syntax_version(&inner->defs);
-  if (syntax_version != 1) {
-    MDP_DEBUG("Expected syntax version: %d, actual syntax version: %ld\n", 1,
-              syntax_version);
-    MDP_RETURN_ERROR(MDP_ERROR_SCHEMA_ENCODING);
+int mdp_visit_feed(mdp_pull *pull, const uint8_t *chunk, size_t length) {
+  _mdp_pull_state *state = (_mdp_pull_state *)pull->state;
+  _mdp_inner *inner = &state->inner;
+  _mdp_stream *stream = state->stream;
+  if (inner->last_error != MDP_OK) {
+    return inner->last_error;
   }
-
-  mol2_num_t consumed_size = 0;
-  int ret = _mdp_visit_subtype(inner, context.data,
-                               inner->defs.t->top_level_type(&inner->defs),
-                               &consumed_size);
-  if (ret != MDP_OK) {
-    MDP_RETURN_ERROR(ret);
+  if (length > inner->data_size - stream->received) {
+    MDP_DEBUG("Fed %lu bytes beyond data size %u!\n", (unsigned long)length,
+              inner->data_size);
+    MDP_RETURN_ERROR(MDP_ERROR_MOL2_IO);
   }
-  if (consumed_size != context.data.size) {
-    MDP_DEBUG("Value has %u bytes but only consumed %u bytes!",
-              context.data.size, consumed_size);
-    MDP_RETURN_ERROR(MDP_ERROR_MOLECULE_ENCODING);
-    return MDP_ERROR_MOLECULE_ENCODING;
+  _mdp_segment *last = &stream->segments[stream->segment_count - 1];
+  if (last->position + last->length + length > stream->window_size) {
+    _mdp_stream_compact(stream);
+    last = &stream->segments[stream->segment_count - 1];
+    if (last->position + last->length + length > stream->window_size) {
+      MDP_DEBUG("Window of %lu bytes cannot hold %lu more bytes!\n",
+                (unsigned long)stream->window_size, (unsigned long)length);
+      MDP_RETURN_ERROR(MDP_ERROR_ARENA);
+    }
   }
-  _mdp_send_literal(inner, "\n");
+  memcpy(&stream->window[last->position + last->length], chunk, length);
+  last->length += (uint32_t)length;
+  stream->received += (uint32_t)length;
   return inner->last_error;
 }
 
+void mdp_visit_end(mdp_pull *pull) {
+  if (pull->arena != NULL) {
+    pull->arena->last_used = pull->arena->used - pull->mark;
+    pull->arena->used = pull->mark;
+  }
+  memset(pull, 0, sizeof(mdp_pull));
+}
+
 #endif /* MOLECULE_DYNAMIC_PARSER_H_ */
@@ -127,7 +127,9 @@ int utf8_check(utf8_inputter_t inputter, void *inputter_context,
       return 5;
     }
 
-    int ret = outputter(buf, filled, outputter_context);
+    // A sequence cut at the end of buf is kept for the next round, only
+    // processed bytes are sent
+    int ret = outputter(buf, processed, outputter_context);
     if (ret != 0) {
       return ret;
     }
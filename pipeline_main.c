@@ -0,0 +1,483 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "clib/molecule-dynamic-visitor.h"
+#include "deps/ckb-c-stdlib/blake2b.h"
+
+// Hashes the text of a corpus of data files sharing one schema, with
+// loading, visiting and hashing running on 3 threads. Stages are connected
+// by bounded single producer single consumer rings, so throughput is bound
+// by the slowest stage. The blake2b hash of each file's text is written to
+// stdout in the order of the files, stage stats go to stderr.
+
+#define LOAD_SLOTS 4
+#define CHUNK_SLOTS 64
+#define CHUNK_SIZE 4096
+#define VISITOR_ARENA_SIZE (64 * 1024)
+#define VISITOR_ADDRESS_CACHE_SIZE 64
+#define VISITOR_FRAGMENT_CACHE_SIZE (1024 * 1024)
+#define VISITOR_FRAGMENT_SLOT_SIZE 1024
+
+double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Time a stage spends waiting on its rings, the rest of its time is busy
+typedef struct {
+  const char *name;
+  double started;
+  double finished;
+  double waited;
+  // Waits on a full output ring, the next stage falling behind
+  size_t full_waits;
+  // Waits on an empty input ring, the previous stage falling behind
+  size_t empty_waits;
+} stage_t;
+
+// Slots are only written by the producer between ring_reserve and
+// ring_publish, and only read by the consumer between ring_peek and
+// ring_release. head and tail are the sole shared state.
+typedef struct {
+  uint8_t *slots;
+  size_t slot_size;
+  size_t capacity;
+  _Atomic size_t head;
+  _Atomic size_t tail;
+} ring_t;
+
+int ring_initialize(ring_t *ring, size_t slot_size, size_t capacity) {
+  ring->slots = (uint8_t *)malloc(slot_size * capacity);
+  ring->slot_size = slot_size;
+  ring->capacity = capacity;
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  return ring->slots != NULL ? 0 : 1;
+}
+
+// Spins briefly before yielding, so a stage waiting on a single core host
+// lets the other stages run
+void ring_wait(stage_t *stage, size_t *waits, int spins) {
+  if (spins == 0) {
+    (*waits)++;
+  }
+  if (spins < 64) {
+    return;
+  }
+  double start = now_seconds();
+  sched_yield();
+  stage->waited += now_seconds() - start;
+}
+
+void *ring_reserve(ring_t *ring, stage_t *stage) {
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  for (int spins = 0;
+       head - atomic_load_explicit(&ring->tail, memory_order_acquire) ==
+       ring->capacity;
+       spins += spins < 64) {
+    ring_wait(stage, &stage->full_waits, spins);
+  }
+  return &ring->slots[(head % ring->capacity) * ring->slot_size];
+}
+
+void ring_publish(ring_t *ring) {
+  atomic_fetch_add_explicit(&ring->head, 1, memory_order_release);
+}
+
+void *ring_peek(ring_t *ring, stage_t *stage) {
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  for (int spins = 0;
+       atomic_load_explicit(&ring->head, memory_order_acquire) == tail;
+       spins += spins < 64) {
+    ring_wait(stage, &stage->empty_waits, spins);
+  }
+  return &ring->slots[(tail % ring->capacity) * ring->slot_size];
+}
+
+void ring_release(ring_t *ring) {
+  atomic_fetch_add_explicit(&ring->tail, 1, memory_order_release);
+}
+
+// A data file read by the loader, data is freed by the visitor
+typedef struct {
+  size_t item;
+  void *data;
+  size_t size;
+} loaded_t;
+
+#define CHUNK_TEXT 0
+// Last chunk of an item, result is set
+#define CHUNK_END 1
+// Sent once all items are done
+#define CHUNK_STOP 2
+
+typedef struct {
+  size_t item;
+  int kind;
+  // MDP_OK, an error from the visitor, or -1 when the file cannot be read
+  int result;
+  size_t length;
+  uint8_t text[CHUNK_SIZE];
+} chunk_t;
+
+typedef struct {
+  char **paths;
+  size_t item_count;
+  mdp_context context;
+
+  ring_t loaded;
+  ring_t chunks;
+  stage_t loader;
+  stage_t visitor;
+  stage_t hasher;
+  // Only used by the visitor
+  mdp_arena arena;
+  mdp_address_cache address_cache;
+  void *fragment_memory;
+  mdp_fragment_cache fragment_cache;
+
+  size_t data_total;
+  size_t text_total;
+  size_t failed;
+} pipeline_t;
+
+void *read_file(const char *path, size_t *size) {
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) {
+    return NULL;
+  }
+  fseek(fp, 0L, SEEK_END);
+  *size = ftell(fp);
+  fseek(fp, 0L, SEEK_SET);
+  void *data = malloc(*size > 0 ? *size : 1);
+  if (data != NULL && fread(data, 1, *size, fp) != *size) {
+    free(data);
+    data = NULL;
+  }
+  fclose(fp);
+  return data;
+}
+
+// A missing file is passed on with NULL data, so the visitor reports it in
+// order. An item past the last one stops the visitor.
+void *loader_main(void *argument) {
+  pipeline_t *pipeline = (pipeline_t *)argument;
+  pipeline->loader.started = now_seconds();
+  for (size_t i = 0; i <= pipeline->item_count; i++) {
+    loaded_t loaded;
+    loaded.item = i;
+    loaded.data = NULL;
+    loaded.size = 0;
+    if (i < pipeline->item_count) {
+      loaded.data = read_file(pipeline->paths[i], &loaded.size);
+      pipeline->data_total += loaded.size;
+    }
+    loaded_t *slot = (loaded_t *)ring_reserve(&pipeline->loaded,
+                                               &pipeline->loader);
+    *slot = loaded;
+    ring_publish(&pipeline->loaded);
+  }
+  pipeline->loader.finished = now_seconds();
+  return NULL;
+}
+
+typedef struct {
+  pipeline_t *pipeline;
+  size_t item;
+  // Reserved chunk being filled, NULL when none
+  chunk_t *chunk;
+} visit_t;
+
+chunk_t *reserve_chunk(visit_t *visit) {
+  if (visit->chunk == NULL) {
+    pipeline_t *pipeline = visit->pipeline;
+    visit->chunk =
+        (chunk_t *)ring_reserve(&pipeline->chunks, &pipeline->visitor);
+    visit->chunk->item = visit->item;
+    visit->chunk->kind = CHUNK_TEXT;
+    visit->chunk->result = MDP_OK;
+    visit->chunk->length = 0;
+  }
+  return visit->chunk;
+}
+
+// Copies text into chunks, publishing each one once full
+int feed_chunks(const uint8_t *data, size_t length, void *feeder_context) {
+  visit_t *visit = (visit_t *)feeder_context;
+  while (length > 0) {
+    chunk_t *chunk = reserve_chunk(visit);
+    size_t n = CHUNK_SIZE - chunk->length;
+    if (n > length) {
+      n = length;
+    }
+    memcpy(&chunk->text[chunk->length], data, n);
+    chunk->length += n;
+    data += n;
+    length -= n;
+    if (chunk->length == CHUNK_SIZE) {
+      ring_publish(&visit->pipeline->chunks);
+      visit->chunk = NULL;
+    }
+  }
+  return 0;
+}
+
+// Publishes the chunk being filled, or an empty one, as the last of an item
+void end_chunks(visit_t *visit, int kind, int result) {
+  chunk_t *chunk = reserve_chunk(visit);
+  chunk->kind = kind;
+  chunk->result = result;
+  ring_publish(&visit->pipeline->chunks);
+  visit->chunk = NULL;
+}
+
+// Allocates the memory of the visitor before any stage starts
+int visitor_allocate(pipeline_t *pipeline) {
+  uint8_t *buffer = (uint8_t *)malloc(VISITOR_ARENA_SIZE);
+  mdp_address_cache_entry *entries = (mdp_address_cache_entry *)malloc(
+      VISITOR_ADDRESS_CACHE_SIZE * sizeof(mdp_address_cache_entry));
+  pipeline->fragment_memory = malloc(VISITOR_FRAGMENT_CACHE_SIZE);
+  mdp_arena_initialize(&pipeline->arena, buffer, VISITOR_ARENA_SIZE);
+  pipeline->address_cache.entries = entries;
+  if (buffer == NULL || entries == NULL || pipeline->fragment_memory == NULL) {
+    return 1;
+  }
+  mdp_address_cache_initialize(&pipeline->address_cache, entries,
+                               VISITOR_ADDRESS_CACHE_SIZE);
+  return mdp_fragment_cache_initialize(
+      &pipeline->fragment_cache, pipeline->fragment_memory,
+      VISITOR_FRAGMENT_CACHE_SIZE, VISITOR_FRAGMENT_SLOT_SIZE);
+}
+
+void pipeline_release(pipeline_t *pipeline) {
+  free(pipeline->fragment_memory);
+  free(pipeline->address_cache.entries);
+  free(pipeline->arena.buffer);
+  free(pipeline->loaded.slots);
+  free(pipeline->chunks.slots);
+}
+
+void *visitor_main(void *argument) {
+  pipeline_t *pipeline = (pipeline_t *)argument;
+  pipeline->visitor.started = now_seconds();
+
+  visit_t visit;
+  visit.pipeline = pipeline;
+  visit.chunk = NULL;
+  while (1) {
+    loaded_t *slot =
+        (loaded_t *)ring_peek(&pipeline->loaded, &pipeline->visitor);
+    loaded_t loaded = *slot;
+    ring_release(&pipeline->loaded);
+    visit.item = loaded.item;
+    if (loaded.item == pipeline->item_count) {
+      break;
+    }
+    if (loaded.data == NULL) {
+      end_chunks(&visit, CHUNK_END, -1);
+      continue;
+    }
+
+    mol2_data_source_t source;
+    mdp_context context = pipeline->context;
+    context.data =
+        mdp_cursor_from_memory(&source, loaded.data, (uint32_t)loaded.size);
+    context.feeder = feed_chunks;
+    context.feeder_context = &visit;
+    context.arena = &pipeline->arena;
+    context.address_cache = &pipeline->address_cache;
+    context.fragment_cache = &pipeline->fragment_cache;
+    int ret = mdp_visit(context);
+    free(loaded.data);
+    end_chunks(&visit, CHUNK_END, ret);
+  }
+  end_chunks(&visit, CHUNK_STOP, MDP_OK);
+  pipeline->visitor.finished = now_seconds();
+  return NULL;
+}
+
+void *hasher_main(void *argument) {
+  pipeline_t *pipeline = (pipeline_t *)argument;
+  pipeline->hasher.started = now_seconds();
+  blake2b_state state;
+  blake2b_init(&state, 32);
+  while (1) {
+    chunk_t *chunk = (chunk_t *)ring_peek(&pipeline->chunks, &pipeline->hasher);
+    if (chunk->kind == CHUNK_STOP) {
+      ring_release(&pipeline->chunks);
+      break;
+    }
+    blake2b_update(&state, chunk->text, chunk->length);
+    pipeline->text_total += chunk->length;
+    if (chunk->kind == CHUNK_END) {
+      const char *path = pipeline->paths[chunk->item];
+      if (chunk->result == MDP_OK) {
+        uint8_t hash[32];
+        blake2b_final(&state, hash, 32);
+        printf("0x");
+        for (int i = 0; i < 32; i++) {
+          printf("%02x", hash[i]);
+        }
+        printf("  %s\n", path);
+      } else if (chunk->result == -1) {
+        fprintf(stderr, "Cannot open file %s\n", path);
+        pipeline->failed++;
+      } else {
+        fprintf(stderr, "Error visiting %s: %d\n", path, chunk->result);
+        pipeline->failed++;
+      }
+      blake2b_init(&state, 32);
+    }
+    ring_release(&pipeline->chunks);
+  }
+  pipeline->hasher.finished = now_seconds();
+  return NULL;
+}
+
+void print_stage(const stage_t *stage, double elapsed) {
+  double active = stage->finished - stage->started;
+  fprintf(stderr,
+          "%-8s busy %5.1f%%, waited %lu times on a full ring, "
+          "%lu times on an empty ring\n",
+          stage->name, (active - stage->waited) / elapsed * 100.0,
+          stage->full_waits, stage->empty_waits);
+}
+
+int main(int argc, char *argv[]) {
+  int format = MDP_FORMAT_TEXT;
+  const char *hrp = "ckb";
+  int opt;
+  while ((opt = getopt(argc, argv, "f:p:")) != -1) {
+    if (opt == 'f' && strcmp(optarg, "text") == 0) {
+      format = MDP_FORMAT_TEXT;
+    } else if (opt == 'f' && strcmp(optarg, "json") == 0) {
+      format = MDP_FORMAT_JSON;
+    } else if (opt == 'f' && strcmp(optarg, "compact") == 0) {
+      format = MDP_FORMAT_COMPACT;
+    } else if (opt == 'p') {
+      hrp = optarg;
+    } else {
+      optind = argc;
+      break;
+    }
+  }
+  if (argc - optind < 2) {
+    printf(
+        "Usage: %s [-f text|json|compact] [-p hrp] "
+        "<schema file> <data file>...\n",
+        argv[0]);
+    return 1;
+  }
+
+  size_t schema_size = 0;
+  void *schema = read_file(argv[optind], &schema_size);
+  if (schema == NULL) {
+    fprintf(stderr, "Cannot open file %s\n", argv[optind]);
+    return 1;
+  }
+  static uint8_t schema_arena_buffer[64 * 1024];
+  mdp_arena schema_arena;
+  mdp_arena_initialize(&schema_arena, schema_arena_buffer,
+                       sizeof(schema_arena_buffer));
+  mol2_data_source_t schema_source;
+  mdp_schema prepared_schema;
+  int ret = mdp_prepare_schema(
+      &schema_arena,
+      mdp_cursor_from_memory(&schema_source, schema, (uint32_t)schema_size),
+      &prepared_schema);
+  if (ret != MDP_OK) {
+    fprintf(stderr, "Error preparing schema: %d\n", ret);
+    return ret;
+  }
+
+  pipeline_t pipeline;
+  memset(&pipeline, 0, sizeof(pipeline));
+  pipeline.paths = &argv[optind + 1];
+  pipeline.item_count = (size_t)(argc - optind - 1);
+  mdp_context_initialize(&pipeline.context);
+  pipeline.context.hrp = hrp;
+  pipeline.context.prepared_schema = &prepared_schema;
+  pipeline.context.format = format;
+  pipeline.loader.name = "loader";
+  pipeline.visitor.name = "visitor";
+  pipeline.hasher.name = "hasher";
+  if (ring_initialize(&pipeline.loaded, sizeof(loaded_t), LOAD_SLOTS) != 0 ||
+      ring_initialize(&pipeline.chunks, sizeof(chunk_t), CHUNK_SLOTS) != 0 ||
+      visitor_allocate(&pipeline) != 0) {
+    fprintf(stderr, "Cannot allocate memory\n");
+    pipeline_release(&pipeline);
+    free(schema);
+    return 1;
+  }
+
+  // Stages start from the last one. When a stage cannot start, the main
+  // thread stops the stages already running, by sending what the missing
+  // stage sends once done.
+  double start = now_seconds();
+  pthread_t loader, visitor, hasher;
+  int stages = 0;
+  if (pthread_create(&hasher, NULL, hasher_main, &pipeline) == 0) {
+    stages++;
+    if (pthread_create(&visitor, NULL, visitor_main, &pipeline) == 0) {
+      stages++;
+      if (pthread_create(&loader, NULL, loader_main, &pipeline) == 0) {
+        stages++;
+      }
+    }
+  }
+  if (stages == 2) {
+    loaded_t *slot =
+        (loaded_t *)ring_reserve(&pipeline.loaded, &pipeline.loader);
+    slot->item = pipeline.item_count;
+    slot->data = NULL;
+    slot->size = 0;
+    ring_publish(&pipeline.loaded);
+  } else if (stages == 1) {
+    visit_t visit;
+    visit.pipeline = &pipeline;
+    visit.item = pipeline.item_count;
+    visit.chunk = NULL;
+    end_chunks(&visit, CHUNK_STOP, MDP_OK);
+  }
+  if (stages == 3) {
+    pthread_join(loader, NULL);
+  }
+  if (stages >= 2) {
+    pthread_join(visitor, NULL);
+  }
+  if (stages >= 1) {
+    pthread_join(hasher, NULL);
+  }
+  fflush(stdout);
+  if (stages < 3) {
+    fprintf(stderr, "Cannot start threads\n");
+    pipeline_release(&pipeline);
+    free(schema);
+    return 1;
+  }
+  double elapsed = now_seconds() - start;
+
+  fprintf(stderr, "Hashed %lu items (%lu failed) in %.3f s\n",
+          pipeline.item_count, pipeline.failed, elapsed);
+  fprintf(stderr, "Data: %lu bytes, %.2f MB/s, %.0f items/s\n",
+          pipeline.data_total, pipeline.data_total / elapsed / 1e6,
+          pipeline.item_count / elapsed);
+  fprintf(stderr, "Text: %lu bytes, %.2f MB/s\n", pipeline.text_total,
+          pipeline.text_total / elapsed / 1e6);
+  print_stage(&pipeline.loader, elapsed);
+  print_stage(&pipeline.visitor, elapsed);
+  print_stage(&pipeline.hasher, elapsed);
+  fprintf(stderr, "Addresses: %lu cached, %lu encoded\n",
+          pipeline.address_cache.hits, pipeline.address_cache.misses);
+  fprintf(stderr, "Subtrees: %lu cached, %lu visited\n",
+          pipeline.fragment_cache.hits, pipeline.fragment_cache.misses);
+
+  pipeline_release(&pipeline);
+  free(schema);
+  return pipeline.failed > 0 ? 1 : 0;
+}
@@ -1,21 +1,7 @@
+#include "clib/mdp_sinks.h"
 #include "clib/molecule-dynamic-visitor.h"
 #include "deps/ckb-c-stdlib/blake2b.h"
 
-typedef struct {
-  uint8_t *data;
-  size_t length;
-} alloc_feeder;
-
-// A simple feeder that writes to a realloc-managed memory buffer
-int feed_data(const uint8_t *data, size_t length, void *feeder_context) {
-  alloc_feeder *f = (alloc_feeder *)feeder_context;
-  f->data = realloc(f->data, f->length + length);
-  memcpy(&f->data[f->length], data, length);
-  f->length += length;
-
-  return 0;
-}
-
 // Typically, one would not want to simple keep the feeder data in CKB-VM's
 // memory, since the data might be of arbitrary length. A more likely scenario,
 // is that the output data for a feeder, is then sent to a hasher function to
@@ -26,6 +12,443 @@ int feed_to_blak2b(const uint8_t *data, size_t length, void *feeder_context) {
   return 0;
 }
 
+// Counts generated bytes, to be checked against the measured length
+int count_length(const uint8_t *data, size_t length, void *feeder_context) {
+  *(size_t *)feeder_context += length;
+  return 0;
+}
+
+// Hasher functions used to digest elided bytes
+int blake2b_digest_init(void *hasher_context) {
+  return blake2b_init((blake2b_state *)hasher_context, MDP_DIGEST_LEN);
+}
+
+int blake2b_digest_update(void *hasher_context, const uint8_t *data,
+                          size_t length) {
+  return blake2b_update((blake2b_state *)hasher_context, data, length);
+}
+
+int blake2b_digest_final(void *hasher_context, uint8_t *digest) {
+  return blake2b_final((blake2b_state *)hasher_context, digest, MDP_DIGEST_LEN);
+}
+
+// Consumers of structured data can handle visiting events directly, without
+// generating text. This one simply counts tables and their shown fields.
+typedef struct {
+  size_t tables;
+  size_t fields;
+} event_counter;
+
+int count_table(void *context, const mdp_definition *t) {
+  ((event_counter *)context)->tables++;
+  return 0;
+}
+
+int count_field(void *context, const mdp_definition *t,
+                const mdp_field *field, uint32_t position) {
+  if (t->kind == MDP_KIND_TABLE) {
+    ((event_counter *)context)->fields++;
+  }
+  return 0;
+}
+
+// Results of a batch visit are reported item by item
+typedef struct {
+  size_t items;
+  size_t failed;
+} batch_counter;
+
+int count_item(void *batch_context, size_t item, int result) {
+  batch_counter *counter = (batch_counter *)batch_context;
+  counter->items++;
+  if (result != MDP_OK) {
+    counter->failed++;
+  }
+  return 0;
+}
+
+// Tells whether text equals count copies of expected
+int repeats_text(const mdp_growable_sink *text,
+                 const mdp_growable_sink *expected, size_t count) {
+  if (text->length != expected->length * count) {
+    return 0;
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (memcmp(&text->data[expected->length * i], expected->data,
+               expected->length) != 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Strings are validated by utf8_check in rounds of _UTF8_BUF_LEN bytes, a
+// sequence cut at the end of a round must be sent once, in the next round
+typedef struct {
+  const uint8_t *data;
+  size_t length;
+} utf8_input;
+
+int read_utf8_input(uint8_t *buf, size_t *length, void *context) {
+  utf8_input *input = (utf8_input *)context;
+  if (*length > input->length) {
+    *length = input->length;
+  }
+  memcpy(buf, input->data, *length);
+  input->data += *length;
+  input->length -= *length;
+  return 0;
+}
+
+int check_utf8_boundary() {
+  // U+00E9 and U+20AC start at byte 31 and byte 62, crossing the 32-byte
+  // buffer edge in the first and second rounds
+  const char *text = "0123456789012345678901234567890\xc3\xa9"
+                     "34567890123456789012345678901\xe2\x82\xac"
+                     "567";
+  utf8_input input = {(const uint8_t *)text, strlen(text)};
+  mdp_growable_sink output = {0};
+  int ret = utf8_check(read_utf8_input, &input, mdp_growable_sink_feeder,
+                       &output);
+  int same = ret == 0 && output.length == strlen(text) &&
+             memcmp(output.data, text, output.length) == 0;
+  mdp_growable_sink_release(&output);
+  return same;
+}
+
+// Visits into text, returning the result of visit
+int visit_text(mdp_context context, const char *path, mdp_growable_sink *text) {
+  text->length = 0;
+  context.feeder = mdp_growable_sink_feeder;
+  context.feeder_context = text;
+  return path == NULL ? mdp_visit(context) : mdp_visit_path(context, path);
+}
+
+// Finds the top level table, stepping through the variant held by a top
+// level union, which variant is set to. NULL is returned for other types.
+const mdp_definition *top_level_table(mdp_context context,
+                                      const mdp_field **variant) {
+  const mdp_schema *schema = context.prepared_schema;
+  const mdp_definition *t = &schema->definitions[schema->top_level_type];
+  *variant = NULL;
+  if (t->kind == MDP_KIND_UNION) {
+    uint8_t id[4];
+    mol2_cursor_t data = context.data;
+    if (mol2_read_at(&data, id, 4) != 4) {
+      return NULL;
+    }
+    uint32_t item_id =
+        id[0] | (id[1] << 8) | (id[2] << 16) | ((uint32_t)id[3] << 24);
+    for (uint32_t i = 0; i < t->field_count; i++) {
+      if (schema->fields[t->first_field + i].id == item_id) {
+        *variant = &schema->fields[t->first_field + i];
+      }
+    }
+    if (*variant == NULL) {
+      return NULL;
+    }
+    t = &schema->definitions[(*variant)->type];
+  }
+  if (t->kind != MDP_KIND_TABLE || t->field_count == 0) {
+    return NULL;
+  }
+  return t;
+}
+
+// Builds the path of the last field of the top level table
+int last_field_path(mdp_context context, char *path, size_t size) {
+  const mdp_field *variant;
+  const mdp_definition *t = top_level_table(context, &variant);
+  if (t == NULL) {
+    return 0;
+  }
+  int length = 0;
+  if (variant != NULL) {
+    length = snprintf(path, size, "%.*s/", (int)variant->name_length,
+                      (const char *)variant->name);
+  }
+  const mdp_field *field =
+      &context.prepared_schema->fields[t->first_field + t->field_count - 1];
+  snprintf(&path[length], size - length, "%.*s", (int)field->name_length,
+           (const char *)field->name);
+  return 1;
+}
+
+// Paths locate values for mdp_select and mdp_visit_path. An empty path
+// renders the whole data, and the text of a field is what mdp_visit
+// generates with the field as the top level value.
+int check_paths(mdp_context context, const mdp_growable_sink *visited) {
+  mdp_growable_sink text = {0};
+  int ret = visit_text(context, "", &text);
+  if (ret != MDP_OK || !repeats_text(&text, visited, 1)) {
+    printf("Text of empty path differs from visited text: %d\n", ret);
+    return 1;
+  }
+  char path[256];
+  if (!last_field_path(context, path, sizeof(path))) {
+    printf("No table field to select\n");
+    mdp_growable_sink_release(&text);
+    return MDP_OK;
+  }
+
+  mol2_cursor_t value;
+  uint32_t type = 0;
+  ret = mdp_select(context, path, &value, &type);
+  if (ret != MDP_OK) {
+    printf("Select Error: %d\n", ret);
+    return ret;
+  }
+  mdp_schema alone = *context.prepared_schema;
+  alone.top_level_type = type;
+  mdp_context value_context = context;
+  value_context.prepared_schema = &alone;
+  value_context.data = value;
+  mdp_growable_sink expected = {0};
+  ret = visit_text(value_context, NULL, &expected);
+  if (ret == MDP_OK) {
+    ret = visit_text(context, path, &text);
+  }
+  if (ret != MDP_OK) {
+    printf("Path Error: %d\n", ret);
+    return ret;
+  }
+  printf("Path %s: %lu of %lu bytes of text\n", path, text.length,
+         visited->length);
+  if (!repeats_text(&text, &expected, 1) || text.length == 0 ||
+      text.length >= visited->length) {
+    printf("Text of path %s differs from its value alone!\n", path);
+    return 1;
+  }
+
+  // An unknown field, and a variant not held by data, are not found
+  char wrong[256];
+  char *field = strrchr(path, '/');
+  snprintf(wrong, sizeof(wrong), "%.*sno_such_field",
+           field == NULL ? 0 : (int)(field - path + 1), path);
+  ret = mdp_select(context, wrong, &value, &type);
+  int path_ret = visit_text(context, wrong, &text);
+  if (ret != MDP_ERROR_PATH_NOT_FOUND || path_ret != MDP_ERROR_PATH_NOT_FOUND) {
+    printf("Unknown field %s is found: %d %d\n", wrong, ret, path_ret);
+    return 1;
+  }
+  const mdp_schema *schema = context.prepared_schema;
+  const mdp_definition *top = &schema->definitions[schema->top_level_type];
+  for (uint32_t i = 0; top->kind == MDP_KIND_UNION && i < top->field_count;
+       i++) {
+    const mdp_field *other = &schema->fields[top->first_field + i];
+    snprintf(wrong, sizeof(wrong), "%.*s/", (int)other->name_length,
+             (const char *)other->name);
+    if (strncmp(path, wrong, strlen(wrong)) == 0) {
+      continue;
+    }
+    wrong[other->name_length] = '\0';
+    ret = mdp_select(context, wrong, &value, &type);
+    path_ret = visit_text(context, wrong, &text);
+    if (ret != MDP_ERROR_PATH_NOT_FOUND ||
+        path_ret != MDP_ERROR_PATH_NOT_FOUND) {
+      printf("Variant %s not in data is found: %d %d\n", wrong, ret, path_ret);
+      return 1;
+    }
+  }
+  mdp_growable_sink_release(&text);
+  mdp_growable_sink_release(&expected);
+  return MDP_OK;
+}
+
+// Finds the line holding "name:" after indent spaces, from offset on. The
+// offset of the line is returned, or the length of text when missing.
+size_t find_field_line(const mdp_growable_sink *text, size_t offset,
+                       const char *name, size_t indent) {
+  size_t name_length = strlen(name);
+  while (offset < text->length) {
+    const uint8_t *line = &text->data[offset];
+    size_t rest = text->length - offset;
+    size_t spaces = 0;
+    while (spaces < rest && line[spaces] == ' ') {
+      spaces++;
+    }
+    if (spaces == indent && rest > indent + name_length + 1 &&
+        memcmp(&line[indent], name, name_length) == 0 &&
+        line[indent + name_length] == ':' &&
+        line[indent + name_length + 1] == '\n') {
+      return offset;
+    }
+    const uint8_t *end = memchr(line, '\n', rest);
+    offset = end == NULL ? text->length : (size_t)(end - text->data) + 1;
+  }
+  return text->length;
+}
+
+// A projection hiding the first field of the top level table removes its
+// text, while the text of all other fields stays the same, whether hidden
+// fields are validated or skipped. The field is hidden in place after a
+// visit filled fragments, which must not be sent with the field again.
+int check_projection(mdp_context context, mdp_fragment_cache *fragments,
+                     const mdp_growable_sink *visited) {
+  const mdp_schema *schema = context.prepared_schema;
+  const mdp_field *variant;
+  const mdp_definition *t = top_level_table(context, &variant);
+  if (t == NULL || t->field_count < 2) {
+    printf("No table fields to hide\n");
+    return MDP_OK;
+  }
+  char definition[128];
+  char hidden[128];
+  char next[128];
+  const mdp_field *field = &schema->fields[t->first_field];
+  snprintf(definition, sizeof(definition), "%.*s", (int)t->name_length,
+           (const char *)t->name);
+  snprintf(hidden, sizeof(hidden), "%.*s", (int)field->name_length,
+           (const char *)field->name);
+  field++;
+  snprintf(next, sizeof(next), "%.*s", (int)field->name_length,
+           (const char *)field->name);
+
+  // Fields of a table are indented one level deeper than the table, which is
+  // itself one level deeper than a union holding it
+  size_t indent = variant != NULL ? 4 : 2;
+  size_t begin = find_field_line(visited, 0, hidden, indent);
+  size_t end = find_field_line(visited, begin, next, indent);
+  if (end >= visited->length) {
+    printf("Text of field %s cannot be found!\n", hidden);
+    return 1;
+  }
+  mdp_growable_sink expected = {0};
+  mdp_growable_sink_feeder(visited->data, begin, &expected);
+  mdp_growable_sink_feeder(&visited->data[end], visited->length - end,
+                           &expected);
+
+  mdp_projection projection;
+  mdp_growable_sink text = {0};
+  int ret = mdp_projection_initialize(context.arena, schema, &projection);
+  context.projection = &projection;
+  context.fragment_cache = fragments;
+  if (ret == MDP_OK) {
+    ret = visit_text(context, NULL, &text);
+  }
+  if (ret == MDP_OK) {
+    ret = mdp_projection_hide(&projection, schema, definition, hidden);
+  }
+  if (ret != MDP_OK || !repeats_text(&text, visited, 1)) {
+    printf("Projection Error: %d\n", ret);
+    return ret != MDP_OK ? ret : 1;
+  }
+  for (int i = 0; i < 4; i++) {
+    projection.skip_hidden = i % 2;
+    context.fragment_cache = i < 2 ? NULL : fragments;
+    ret = visit_text(context, NULL, &text);
+    if (ret != MDP_OK) {
+      printf("Projection Error: %d\n", ret);
+      return ret;
+    }
+    if (!repeats_text(&text, &expected, 1)) {
+      printf("Text hiding %s.%s differs from visited text without it%s!\n",
+             definition, hidden, i < 2 ? "" : ", with fragments cached");
+      return 1;
+    }
+  }
+  printf("Hiding %s.%s removes %lu bytes of text\n", definition, hidden,
+         visited->length - text.length);
+  mdp_growable_sink_release(&text);
+  mdp_growable_sink_release(&expected);
+  return MDP_OK;
+}
+
+// Budgets hold at their boundaries: a visit needing exactly the budget
+// succeeds, one less fails with MDP_ERROR_BUDGET. Values visited and their
+// levels are counted from index, built against the same data.
+int check_budgets(mdp_context context, const mdp_index *index) {
+  size_t length = 0;
+  int ret = mdp_measure(context, &length);
+  if (ret != MDP_OK) {
+    printf("Measure Error: %d\n", ret);
+    return ret;
+  }
+  uint32_t depth = 0;
+  for (uint32_t i = 0; i < index->count; i++) {
+    uint32_t levels = 0;
+    for (uint32_t n = i; n != MDP_INDEX_NONE; n = index->nodes[n].parent) {
+      levels++;
+    }
+    if (levels > depth) {
+      depth = levels;
+    }
+  }
+
+  mdp_growable_sink text = {0};
+  for (int budget = 0; budget < 3; budget++) {
+    for (int less = 0; less < 2; less++) {
+      size_t limit =
+          (budget == 0 ? length : budget == 1 ? index->count : depth) - less;
+      if (limit == 0) {
+        // 0 means no limit
+        continue;
+      }
+      mdp_context limited = context;
+      if (budget == 0) {
+        limited.budget.max_output = limit;
+      } else if (budget == 1) {
+        limited.budget.max_nodes = limit;
+      } else {
+        limited.budget.max_depth = (uint32_t)limit;
+      }
+      ret = visit_text(limited, NULL, &text);
+      if (ret != (less ? MDP_ERROR_BUDGET : MDP_OK) || text.length > length) {
+        printf("Budget of %lu bytes, %u values, %u levels returns %d\n",
+               (unsigned long)limited.budget.max_output,
+               (uint32_t)limited.budget.max_nodes, limited.budget.max_depth,
+               ret);
+        return 1;
+      }
+    }
+  }
+  printf("Budgets of %lu bytes, %u values, %u levels are exact\n",
+         (unsigned long)length, index->count, depth);
+  mdp_growable_sink_release(&text);
+  return MDP_OK;
+}
+
+// Fragments are sent again by a visit with the same settings. An hrp changed
+// in place is used by the next visit, instead of fragments holding addresses
+// with the old one.
+int check_fragment_hrp(mdp_context context, mdp_fragment_cache *fragments,
+                       const mdp_growable_sink *visited) {
+  char hrp[4] = "ckb";
+  mdp_growable_sink text = {0};
+  mdp_growable_sink expected = {0};
+  context.hrp = hrp;
+  context.fragment_cache = fragments;
+  int ret = visit_text(context, NULL, &text);
+  uint64_t hits = fragments->hits;
+  if (ret == MDP_OK) {
+    ret = visit_text(context, NULL, &text);
+  }
+  if (ret == MDP_OK &&
+      (fragments->hits == hits || !repeats_text(&text, visited, 1))) {
+    printf("Fragments are not sent again as they were rendered!\n");
+    return 1;
+  }
+  hrp[2] = 't';
+  if (ret == MDP_OK) {
+    ret = visit_text(context, NULL, &text);
+  }
+  context.fragment_cache = NULL;
+  if (ret == MDP_OK) {
+    ret = visit_text(context, NULL, &expected);
+  }
+  if (ret != MDP_OK) {
+    printf("Fragment Error: %d\n", ret);
+    return ret;
+  }
+  if (!repeats_text(&text, &expected, 1)) {
+    printf("Text with fragments cached keeps an hrp changed in place!\n");
+    return 1;
+  }
+  mdp_growable_sink_release(&text);
+  mdp_growable_sink_release(&expected);
+  return MDP_OK;
+}
+
 mol2_data_source_t make_data_source(const void *memory, uint32_t size) {
   mol2_data_source_t s_data_source = {0};
 
@@ -49,11 +472,219 @@ mol2_cursor_t cursor_from_source(mol2_data_source_t *source) {
   return cur;
 }
 
+void append_uint32(mdp_growable_sink *data, uint32_t value) {
+  uint8_t bytes[4] = {(uint8_t)value, (uint8_t)(value >> 8),
+                      (uint8_t)(value >> 16), (uint8_t)(value >> 24)};
+  mdp_growable_sink_feeder(bytes, 4, data);
+}
+
+// Appends a small valid value of type to data: zeroed bytes, empty vectors
+// and options, and the first variant of unions
+void append_default_value(const mdp_schema *schema, uint32_t type,
+                          mdp_growable_sink *data) {
+  const mdp_definition *t = &schema->definitions[type];
+  switch (t->kind) {
+    case MDP_KIND_BYTE: {
+      uint8_t zero = 0;
+      mdp_growable_sink_feeder(&zero, 1, data);
+    } break;
+    case MDP_KIND_ARRAY:
+      for (uint64_t i = 0; i < t->item_count; i++) {
+        append_default_value(schema, t->item, data);
+      }
+      break;
+    case MDP_KIND_STRUCT:
+      for (uint32_t i = 0; i < t->field_count; i++) {
+        append_default_value(schema, schema->fields[t->first_field + i].type,
+                             data);
+      }
+      break;
+    case MDP_KIND_FIXVEC:
+      append_uint32(data, 0);
+      break;
+    case MDP_KIND_DYNVEC:
+      append_uint32(data, 4);
+      break;
+    case MDP_KIND_UNION: {
+      const mdp_field *variant = &schema->fields[t->first_field];
+      append_uint32(data, (uint32_t)variant->id);
+      append_default_value(schema, variant->type, data);
+    } break;
+    case MDP_KIND_TABLE: {
+      mdp_growable_sink fields = {0};
+      uint32_t header = 4 + 4 * t->field_count;
+      uint32_t offsets[64];
+      for (uint32_t i = 0; i < t->field_count && i < 64; i++) {
+        offsets[i] = header + (uint32_t)fields.length;
+        append_default_value(schema, schema->fields[t->first_field + i].type,
+                             &fields);
+      }
+      append_uint32(data, header + (uint32_t)fields.length);
+      for (uint32_t i = 0; i < t->field_count && i < 64; i++) {
+        append_uint32(data, offsets[i]);
+      }
+      if (fields.length > 0) {
+        mdp_growable_sink_feeder(fields.data, fields.length, data);
+      }
+      mdp_growable_sink_release(&fields);
+    } break;
+    default:
+      // Options are left empty
+      break;
+  }
+}
+
+// Appends text with each line prefixed, as mdp_visit_diff sends the text of
+// a changed value
+void append_prefixed(mdp_growable_sink *out, const mdp_growable_sink *text,
+                     uint8_t prefix) {
+  size_t start = 0;
+  while (start < text->length) {
+    const uint8_t *newline =
+        memchr(&text->data[start], '\n', text->length - start);
+    size_t end =
+        newline == NULL ? text->length : (size_t)(newline - text->data) + 1;
+    mdp_growable_sink_feeder(&prefix, 1, out);
+    mdp_growable_sink_feeder(&text->data[start], end - start, out);
+    start = end;
+  }
+  if (text->length > 0 && text->data[text->length - 1] != '\n') {
+    mdp_growable_sink_feeder((const uint8_t *)"\n", 1, out);
+  }
+}
+
+int diff_text(mdp_context context, mol2_cursor_t old_data,
+              mdp_growable_sink *text) {
+  text->length = 0;
+  context.feeder = mdp_growable_sink_feeder;
+  context.feeder_context = text;
+  return mdp_visit_diff(context, old_data);
+}
+
+// Diffing data against an equal copy generates no text. A byte changed in a
+// field of the top level table is reported alone under its path, and a
+// top level union switching variants is reported whole at "/".
+int check_diff(mdp_context context, const void *data, size_t size,
+               const mdp_growable_sink *visited) {
+  const mdp_schema *schema = context.prepared_schema;
+  uint8_t *changed = (uint8_t *)malloc(size);
+  memcpy(changed, data, size);
+  mol2_data_source_t changed_source = make_data_source(changed, (uint32_t)size);
+  mdp_context changed_context = context;
+  changed_context.data = cursor_from_source(&changed_source);
+  mdp_growable_sink text = {0};
+  int ret = diff_text(changed_context, context.data, &text);
+  if (ret != MDP_OK || text.length != 0) {
+    printf("Diff of equal data generates %lu bytes of text: %d\n",
+           text.length, ret);
+    return ret != MDP_OK ? ret : 1;
+  }
+
+  const mdp_field *variant;
+  const mdp_definition *t = top_level_table(context, &variant);
+  const mdp_field *field = NULL;
+  for (uint32_t i = 0; t != NULL && i < t->field_count && field == NULL; i++) {
+    const mdp_field *f = &schema->fields[t->first_field + i];
+    const mdp_definition *ft = &schema->definitions[f->type];
+    if (ft->kind == MDP_KIND_ARRAY && ft->item == MDP_TYPE_BYTE) {
+      field = f;
+    }
+  }
+  mdp_growable_sink expected = {0};
+  mdp_growable_sink value_text = {0};
+  if (field != NULL) {
+    char path[256];
+    int length = 0;
+    if (variant != NULL) {
+      length = snprintf(path, sizeof(path), "%.*s/", (int)variant->name_length,
+                        (const char *)variant->name);
+    }
+    snprintf(&path[length], sizeof(path) - length, "%.*s",
+             (int)field->name_length, (const char *)field->name);
+    mol2_cursor_t value;
+    ret = mdp_select(context, path, &value, NULL);
+    if (ret != MDP_OK) {
+      printf("Select Error: %d\n", ret);
+      return ret;
+    }
+    changed[value.offset] ^= 1;
+
+    mdp_growable_sink_feeder((const uint8_t *)"@@ /", 4, &expected);
+    mdp_growable_sink_feeder((const uint8_t *)path, strlen(path), &expected);
+    mdp_growable_sink_feeder((const uint8_t *)"\n", 1, &expected);
+    ret = visit_text(context, path, &value_text);
+    append_prefixed(&expected, &value_text, '-');
+    if (ret == MDP_OK) {
+      ret = visit_text(changed_context, path, &value_text);
+      append_prefixed(&expected, &value_text, '+');
+    }
+    if (ret == MDP_OK) {
+      ret = diff_text(changed_context, context.data, &text);
+    }
+    if (ret != MDP_OK) {
+      printf("Diff Error: %d\n", ret);
+      return ret;
+    }
+    printf("Diff of a byte changed at %s:\n%.*s", path, (int)text.length,
+           text.data);
+    if (!repeats_text(&text, &expected, 1)) {
+      printf("Diff of a byte changed at %s is not its value alone!\n", path);
+      return 1;
+    }
+  }
+
+  const mdp_definition *top = &schema->definitions[schema->top_level_type];
+  for (uint32_t i = 0; variant != NULL && i < top->field_count; i++) {
+    const mdp_field *other = &schema->fields[top->first_field + i];
+    if (other == variant) {
+      continue;
+    }
+    mdp_growable_sink switched = {0};
+    append_uint32(&switched, (uint32_t)other->id);
+    append_default_value(schema, other->type, &switched);
+    mol2_data_source_t switched_source =
+        make_data_source(switched.data, (uint32_t)switched.length);
+    changed_context.data = cursor_from_source(&switched_source);
+
+    expected.length = 0;
+    mdp_growable_sink_feeder((const uint8_t *)"@@ /\n", 5, &expected);
+    append_prefixed(&expected, visited, '-');
+    ret = visit_text(changed_context, NULL, &value_text);
+    append_prefixed(&expected, &value_text, '+');
+    if (ret == MDP_OK) {
+      ret = diff_text(changed_context, context.data, &text);
+    }
+    if (ret != MDP_OK) {
+      printf("Diff Error: %d\n", ret);
+      return ret;
+    }
+    if (!repeats_text(&text, &expected, 1)) {
+      printf("Diff switching to variant %.*s is not reported whole!\n",
+             (int)other->name_length, (const char *)other->name);
+      return 1;
+    }
+    printf("Diff switching to variant %.*s: %lu bytes of text\n",
+           (int)other->name_length, (const char *)other->name, text.length);
+    mdp_growable_sink_release(&switched);
+    break;
+  }
+  printf("Diff Success!\n");
+  mdp_growable_sink_release(&text);
+  mdp_growable_sink_release(&expected);
+  mdp_growable_sink_release(&value_text);
+  free(changed);
+  return MDP_OK;
+}
+
 int main(int argc, char *argv[]) {
   if (argc != 3) {
     printf("Usage: %s <schema file> <data file>\n", argv[0]);
     return 1;
   }
+  if (!check_utf8_boundary()) {
+    printf("String crossing the UTF-8 buffer edge is not kept as it is!\n");
+    return 1;
+  }
 
   FILE *fp = fopen(argv[1], "rb");
   if (fp == NULL) {
@@ -81,9 +712,9 @@ int main(int argc, char *argv[]) {
   fclose(fp);
   printf("Data size: %lu\n", data_size);
 
-  alloc_feeder context;
-  context.data = NULL;
-  context.length = 0;
+  // Text is kept in memory by a sink from clib/mdp_sinks.h, which grows its
+  // buffer geometrically
+  mdp_growable_sink context = {0};
 
   mol2_data_source_t schema_source =
       make_data_source(schema, (uint32_t)schema_size);
@@ -92,32 +723,300 @@ int main(int argc, char *argv[]) {
   mol2_cursor_t schema_cursor = cursor_from_source(&schema_source);
   mol2_cursor_t data_cursor = cursor_from_source(&data_source);
 
+  // A single arena is reused by all visits below. The schema is prepared
+  // once, and kept at the start of the arena.
+  static uint8_t arena_buffer[64 * 1024];
+  mdp_arena arena;
+  mdp_arena_initialize(&arena, arena_buffer, sizeof(arena_buffer));
+  mdp_schema prepared_schema;
+  int ret = mdp_prepare_schema(&arena, schema_cursor, &prepared_schema);
+  if (ret != MDP_OK) {
+    printf("Error preparing schema: %d\n", ret);
+    return ret;
+  }
+  printf("Prepared schema size: %lu\n", arena.last_used);
+
   // In the first example here, we simple concatenate all output data from
   // the visitor for printing. Note that in a real smart contract, this might
   // never really happen.
+  //
+  // The context is filled in field by field, as code written before optional
+  // fields existed does. Such a context leaves version and optional fields
+  // holding whatever was on the stack, which is mimicked here, and visits as
+  // it always did.
+  mdp_growable_sink visited = {0};
+  mdp_context legacy;
+  memset(&legacy, 0xa5, sizeof(legacy));
+  legacy.hrp = "ckb";
+  legacy.schema = schema_cursor;
+  legacy.data = data_cursor;
+  legacy.feeder = mdp_growable_sink_feeder;
+  legacy.feeder_context = &visited;
+
+  printf("\n");
+  ret = mdp_visit(legacy);
+  if (ret != MDP_OK) {
+    printf("Error: %d\n", ret);
+    return ret;
+  }
+  printf("Concatenating Visit Success!\n");
+  printf("Visited data:\n\n%.*s\n", (int)visited.length, visited.data);
+
   mdp_context mcontext;
+  mdp_context_initialize(&mcontext);
   // For a real setup, this should be a parameter depending on actual
   // environment
   mcontext.hrp = "ckb";
   mcontext.schema = schema_cursor;
   mcontext.data = data_cursor;
-  mcontext.feeder = feed_data;
+  mcontext.feeder = mdp_growable_sink_feeder;
   mcontext.feeder_context = &context;
+  mcontext.prepared_schema = &prepared_schema;
+  mcontext.arena = &arena;
+
+  // Verifying is much cheaper than visiting, since no text is generated. It
+  // is a good idea to reject malformed data here first.
+  ret = mdp_verify(mcontext);
+  if (ret != MDP_OK) {
+    printf("Verify Error: %d\n", ret);
+    return ret;
+  }
+  printf("Verify Success!\n");
+
+  mdp_events events = {0};
+  events.on_table_begin = count_table;
+  events.on_field = count_field;
+  event_counter counter = {0};
+  ret = mdp_visit_events(mcontext, &events, &counter);
+  if (ret != MDP_OK) {
+    printf("Events Error: %d\n", ret);
+    return ret;
+  }
+  printf("Visited %lu tables with %lu fields\n", counter.tables,
+         counter.fields);
+
+  // An index built once locates values for later visits without reading
+  // offsets from data again. Each value takes at least 1 byte, except for
+  // empty options in tables and dynvecs, which take a 4 byte offset.
+  mdp_index index;
+  index.capacity = (uint32_t)data_size + 1;
+  index.nodes = (mdp_index_node *)malloc(sizeof(mdp_index_node) *
+                                         index.capacity);
+  ret = mdp_build_index(mcontext, &index);
+  if (ret != MDP_OK) {
+    printf("Index Error: %d\n", ret);
+    return ret;
+  }
+  printf("Indexed %u values\n", index.count);
+  ret = check_budgets(mcontext, &index);
+  free(index.nodes);
+  if (ret != MDP_OK) {
+    return ret;
+  }
+
+  ret = check_paths(mcontext, &visited);
+  if (ret != MDP_OK) {
+    return ret;
+  }
+  // Fragments are cached across visits, and must follow settings changed in
+  // place between them
+  void *fragment_memory = malloc(256 * 1024);
+  mdp_fragment_cache fragments;
+  ret = mdp_fragment_cache_initialize(&fragments, fragment_memory, 256 * 1024,
+                                      1024);
+  if (ret == MDP_OK) {
+    ret = check_projection(mcontext, &fragments, &visited);
+  }
+  if (ret == MDP_OK) {
+    ret = check_fragment_hrp(mcontext, &fragments, &visited);
+  }
+  printf("Fragments: %lu hits, %lu misses\n", (unsigned long)fragments.hits,
+         (unsigned long)fragments.misses);
+  free(fragment_memory);
+  if (ret != MDP_OK) {
+    return ret;
+  }
+
+  // Reviewing an update only renders what changed
+  ret = check_diff(mcontext, data, data_size, &visited);
+  if (ret != MDP_OK) {
+    return ret;
+  }
+
+  // Long byte vectors can be elided from the text, only a few leading bytes
+  // and a digest of the full content are kept.
+  blake2b_state digest_state;
+  mdp_elision elision = {0};
+  elision.threshold = 64;
+  elision.preview = 16;
+  elision.init = blake2b_digest_init;
+  elision.update = blake2b_digest_update;
+  elision.final = blake2b_digest_final;
+  elision.hasher_context = &digest_state;
+  mcontext.elision = &elision;
+
+  printf("\n");
+  ret = mdp_visit(mcontext);
+  if (ret == MDP_OK) {
+    printf("Elided Visit Success!\n");
+    if (context.length > 0) {
+      printf("Visited data:\n\n%.*s", (int)context.length, context.data);
+    } else {
+      printf("No data\n");
+    }
+  } else {
+    printf("Error: %d\n", ret);
+  }
+  mcontext.elision = NULL;
+
+  // Machine consumers can have the same data as compact JSON
+  mcontext.format = MDP_FORMAT_JSON;
+  context.length = 0;
 
   printf("\n");
-  int ret = mdp_visit(mcontext);
+  ret = mdp_visit(mcontext);
   if (ret == MDP_OK) {
-    printf("Concatenating Visit Success!\n");
-    if (context.data != NULL) {
-      feed_data((const uint8_t *)"\0", 1, &context);
-      printf("Visited data:\n\n%s", context.data);
-      free(context.data);
+    printf("JSON Visit Success!\n");
+    if (context.length > 0) {
+      printf("Visited data:\n\n%.*s\n", (int)context.length, context.data);
     } else {
       printf("No data\n");
     }
   } else {
     printf("Error: %d\n", ret);
   }
+  mcontext.format = MDP_FORMAT_TEXT;
+
+  // In pull mode, text is requested in chunks of the caller's choosing,
+  // such as a page on a small screen, instead of being pushed to a feeder.
+  printf("\n");
+  mdp_pull pull;
+  context.length = 0;
+  ret = mdp_visit_begin(&pull, mcontext);
+  if (ret == MDP_OK) {
+    uint8_t page[64];
+    size_t page_length = 0;
+    size_t pages = 0;
+    while ((ret = mdp_visit_next(&pull, page, sizeof(page), &page_length)) ==
+               MDP_OK &&
+           page_length > 0) {
+      mdp_growable_sink_feeder(page, page_length, &context);
+      pages++;
+    }
+    mdp_visit_end(&pull);
+    printf("Pulled %lu pages of %lu bytes\n", pages, sizeof(page));
+  }
+  if (ret != MDP_OK) {
+    printf("Pull Error: %d\n", ret);
+    return ret;
+  }
+  if (!repeats_text(&context, &visited, 1)) {
+    printf("Pulled text differs from visited text!\n");
+    return 1;
+  }
+
+  // Data arriving in chunks can be visited without assembling it first, only
+  // data still needed is kept in a small window.
+  printf("\n");
+  context.length = 0;
+  ret = mdp_visit_begin_stream(&pull, mcontext, (uint32_t)data_size, 4096);
+  if (ret == MDP_OK) {
+    uint8_t page[64];
+    size_t page_length = 0;
+    size_t fed = 0;
+    while (1) {
+      ret = mdp_visit_next(&pull, page, sizeof(page), &page_length);
+      mdp_growable_sink_feeder(page, page_length, &context);
+      if (ret == MDP_NEED_DATA) {
+        size_t chunk = data_size - fed < 256 ? data_size - fed : 256;
+        ret = mdp_visit_feed(&pull, (const uint8_t *)data + fed, chunk);
+        fed += chunk;
+      } else if (page_length < sizeof(page)) {
+        break;
+      }
+      if (ret != MDP_OK) {
+        break;
+      }
+    }
+    mdp_visit_end(&pull);
+    printf("Streamed %lu bytes of text\n", context.length);
+  }
+  if (ret != MDP_OK) {
+    printf("Stream Error: %d\n", ret);
+    return ret;
+  }
+  if (!repeats_text(&context, &visited, 1)) {
+    printf("Streamed text differs from visited text!\n");
+    return 1;
+  }
+
+  // Data rendered more than once can record a trace on the first visit, later
+  // renderings replay the trace, skipping all checks and schema lookups.
+  mdp_trace trace;
+  trace.capacity = data_size * 8 + 4096;
+  trace.buffer = (uint8_t *)malloc(trace.capacity);
+  context.length = 0;
+  printf("\n");
+  ret = mdp_visit_record(mcontext, &trace);
+  if (ret == MDP_OK) {
+    if (!repeats_text(&context, &visited, 1)) {
+      printf("Recorded text differs from visited text!\n");
+      free(trace.buffer);
+      return 1;
+    }
+    context.length = 0;
+    ret = mdp_replay(mcontext, &trace);
+    printf("Recorded %lu bytes of trace, replayed %lu of %lu bytes of text\n",
+           trace.length, context.length, visited.length);
+  }
+  free(trace.buffer);
+  if (ret != MDP_OK) {
+    printf("Trace Error: %d\n", ret);
+    return ret;
+  }
+  if (!repeats_text(&context, &visited, 1)) {
+    printf("Replayed text differs from visited text!\n");
+    return 1;
+  }
+
+  // Many pieces of data with the same schema can be visited in a batch, the
+  // setup is only done once for all of them.
+  mol2_cursor_t items[3] = {data_cursor, data_cursor, data_cursor};
+  batch_counter batch = {0};
+  mdp_batch_sink sink = {0};
+  sink.end = count_item;
+  sink.batch_context = &batch;
+  context.length = 0;
+  printf("\n");
+  ret = mdp_visit_batch(mcontext, items, 3, &sink);
+  if (ret != MDP_OK) {
+    printf("Batch Error: %d\n", ret);
+    return ret;
+  }
+  printf("Batch visited %lu items, %lu failed, %lu bytes of text\n",
+         batch.items, batch.failed, context.length);
+  if (batch.items != 3 || batch.failed != 0 ||
+      !repeats_text(&context, &visited, 3)) {
+    printf("Batch text differs from visited text!\n");
+    return 1;
+  }
+  context.length = 0;
+
+#ifdef MDP_PARALLEL
+  // Items of fixvecs and dynvecs can be rendered on several threads, the
+  // text is the same as the serial visit
+  ret = mdp_visit_parallel(mcontext, 4, 2);
+  if (ret != MDP_OK) {
+    printf("Parallel Error: %d\n", ret);
+    return ret;
+  }
+  printf("Parallel visit generated %lu bytes of text\n", context.length);
+  if (!repeats_text(&context, &visited, 1)) {
+    printf("Parallel text differs from visited text!\n");
+    return 1;
+  }
+  context.length = 0;
+#endif
 
   // This is a more typical scenario we might encounter in a smart contract:
   // the output data from visitor are then fed into a hashing function, which
@@ -130,13 +1029,65 @@ int main(int argc, char *argv[]) {
   mcontext.hrp = "ckb";
   mcontext.schema = schema_cursor;
   mcontext.data = data_cursor;
-  mcontext.feeder = feed_to_blak2b;
-  mcontext.feeder_context = &state;
+
+  // Like Ethereum's personal_sign, the message length is hashed before the
+  // message itself. mdp_measure calculates it without generating any text.
+  size_t message_length = 0;
+  ret = mdp_measure(mcontext, &message_length);
+  if (ret != MDP_OK) {
+    printf("Measure Error: %d\n", ret);
+    return ret;
+  }
+  printf("\nMeasured length: %lu\n", message_length);
+
+  // The compact format is much cheaper to hash, when the signer agrees on it
+  size_t compact_length = 0;
+  mcontext.format = MDP_FORMAT_COMPACT;
+  ret = mdp_measure(mcontext, &compact_length);
+  mcontext.format = MDP_FORMAT_TEXT;
+  if (ret != MDP_OK) {
+    printf("Measure Error: %d\n", ret);
+    return ret;
+  }
+  printf("Compact length: %lu\n", compact_length);
+  char length_buffer[32];
+  int length_buffer_length =
+      snprintf(length_buffer, sizeof(length_buffer), "%lu", message_length);
+  blake2b_update(&state, length_buffer, length_buffer_length);
+
+  // A tee feeds the same text to several feeders, so the text is printed,
+  // hashed and counted in a single visit, instead of visiting once per use.
+  // Outside of CKB-VM, the displaying branch is where one would keep the
+  // text for the signer to review.
+  size_t visited_length = 0;
+  mdp_tee_branch branches[3] = {
+      {mdp_growable_sink_feeder, &context, 0},
+      {feed_to_blak2b, &state, 0},
+      {count_length, &visited_length, 0},
+  };
+  mdp_tee tee = {branches, 3};
+  mcontext.feeder = mdp_tee_feeder;
+  mcontext.feeder_context = &tee;
 
   printf("\n");
   ret = mdp_visit(mcontext);
   if (ret == MDP_OK) {
-    printf("Hashing Visit Success!\n");
+    printf("Hashing Visit Success! Arena used: %lu\n", arena.last_used);
+    if (context.length > 0) {
+      printf("Visited data:\n\n%.*s", (int)context.length, context.data);
+    } else {
+      printf("No data\n");
+    }
+    printf("Visited length: %lu\n", visited_length);
+    if (context.length != visited.length ||
+        memcmp(context.data, visited.data, visited.length) != 0) {
+      printf("Text differs from the concatenating visit!\n");
+      return 1;
+    }
+    if (visited_length != message_length) {
+      printf("Visited length differs from measured length!\n");
+      return 1;
+    }
 
     uint8_t hash[32];
     blake2b_final(&state, hash, 32);
@@ -149,6 +1100,31 @@ int main(int argc, char *argv[]) {
     printf("Error: %d\n", ret);
   }
 
+  // A lock script can receive the message along with data, and check that it
+  // equals the text, which is compared as it is generated instead of being
+  // kept or hashed. The text visited above stands in for such a message here.
+  if (ret == MDP_OK && context.length > 0) {
+    mol2_data_source_t message_source =
+        make_data_source(context.data, (uint32_t)visited_length);
+    ret = mdp_compare(mcontext, cursor_from_source(&message_source));
+    printf("Compared with message: %d\n", ret);
+    if (ret != MDP_OK) {
+      printf("Unaltered message is not accepted!\n");
+      return ret;
+    }
+
+    context.data[visited_length / 2] ^= 1;
+    message_source = make_data_source(context.data, (uint32_t)visited_length);
+    int altered = mdp_compare(mcontext, cursor_from_source(&message_source));
+    printf("Compared with altered message: %d\n", altered);
+    if (altered != MDP_ERROR_MISMATCH) {
+      printf("Altered message is not detected!\n");
+      return 1;
+    }
+  }
+  mdp_growable_sink_release(&context);
+  mdp_growable_sink_release(&visited);
+
   free(schema);
   free(data);
   return ret;